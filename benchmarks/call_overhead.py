@@ -0,0 +1,79 @@
+#! /usr/bin/env python3
+"""
+Micro-benchmark of the per-call overhead of the cpepfrag entry points.
+
+Each function is called on a single-residue peptide, so that the time is
+dominated by argument parsing and conversion rather than by ion generation.
+Calls are timed both with positional arguments, as made by pepfrag.Peptide,
+and, where supported, with keyword arguments.
+
+Usage, from the repository root after building the extension in place:
+
+    PYTHONPATH=. python benchmarks/call_overhead.py [--number N] [--repeat R]
+
+"""
+import argparse
+import timeit
+
+import cpepfrag
+
+from pepfrag import IonPreset, Peptide
+from pepfrag.pepfrag import _preset_handle
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--number', type=int, default=200000)
+    parser.add_argument('--repeat', type=int, default=5)
+    args = parser.parse_args()
+
+    peptide = Peptide('K', 1, [])
+    handle = _preset_handle(IonPreset.cid)
+    mass = peptide.mass
+    seq_masses = peptide.peptide_mass[1:-1]
+    b_masses, y_masses = peptide._ion_masses()
+
+    calls = {
+        'calculate_mass': (
+            lambda: cpepfrag.calculate_mass('K', [], 0),
+            lambda: cpepfrag.calculate_mass(
+                sequence='K', mod_sites=[], mass_type=0
+            ),
+        ),
+        'generate_ions': (
+            lambda: cpepfrag.generate_ions(
+                handle, mass, seq_masses, b_masses, y_masses, 1, False, 'K'
+            ),
+            lambda: cpepfrag.generate_ions(
+                handle, mass, seq_masses, b_masses, y_masses, charge=1,
+                radical=False, sequence='K'
+            ),
+        ),
+        'generate_ion_masses': (
+            lambda: cpepfrag.generate_ion_masses(
+                handle, mass, seq_masses, b_masses, y_masses, 1, False, 'K', 0
+            ),
+            lambda: cpepfrag.generate_ion_masses(
+                handle, mass, seq_masses, b_masses, y_masses, charge=1,
+                radical=False, sequence='K', mass_format=0
+            ),
+        ),
+    }
+
+    print(f"{'function':<22} {'positional':>12} {'keywords':>12}")
+    for name, (positional, keywords) in calls.items():
+        times = []
+        for func in (positional, keywords):
+            try:
+                func()
+            except TypeError:
+                # Keyword arguments are not supported by this build
+                times.append('-')
+                continue
+            best = min(timeit.repeat(func, number=args.number, repeat=args.repeat))
+            times.append(f'{best / args.number * 1e9:.0f} ns')
+        print(f'{name:<22} {times[0]:>12} {times[1]:>12}')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,54 @@
+#! /usr/bin/env python3
+"""
+Compares two sets of microbenchmark results, as written by
+pepfrag_microbenchmarks, printing the relative change in time per iteration
+for each benchmark present in both.
+
+Usage: compare.py BASELINE.json CONTENDER.json [--threshold PERCENT]
+
+"""
+import argparse
+import json
+from typing import Dict, Tuple
+
+
+def load(path: str) -> Dict[Tuple[str, Tuple[Tuple[str, int], ...]], float]:
+    """
+    Loads the results in `path`, keyed by benchmark name and parameters.
+
+    """
+    with open(path) as fh:
+        results = json.load(fh)
+    return {
+        (b["name"], tuple(sorted(b["params"].items()))): b["ns_per_iteration"]
+        for b in results["benchmarks"]
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("baseline")
+    parser.add_argument("contender")
+    parser.add_argument(
+        "--threshold", type=float, default=0.,
+        help="Only show benchmarks which changed by more than this percentage"
+    )
+    args = parser.parse_args()
+
+    baseline = load(args.baseline)
+    contender = load(args.contender)
+
+    for key in sorted(baseline.keys() & contender.keys()):
+        name, params = key
+        change = 100. * (contender[key] - baseline[key]) / baseline[key]
+        if abs(change) < args.threshold:
+            continue
+        label = "/".join([name] + [f"{k}={v}" for k, v in params])
+        print(
+            f"{label:<60} {baseline[key]:>12.1f} {contender[key]:>12.1f} "
+            f"{change:>+8.1f}%"
+        )
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,101 @@
+/*
+ * Benchmark of the fragment mass kernel across the instruction sets supported
+ * by the current CPU, compared to the scalar fallback.
+ *
+ * Build and run from the repository root with:
+ *
+ *     cmake -S . -B build && cmake --build build --target kernel_benchmark
+ *     ./build/kernel_benchmark
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "fragmentkernel.h"
+
+const double PROTON = 1.007276466879;
+
+std::vector<double> randomLadder(size_t length, std::mt19937& rng) {
+	std::uniform_real_distribution<double> residueMass(57.02, 186.08);
+	std::vector<double> ladder(length);
+	double mass = 0.;
+	for (double& m : ladder) {
+		mass += residueMass(rng);
+		m = mass;
+	}
+	return ladder;
+}
+
+/*
+ * Returns the mean time, in nanoseconds, for one call to computeFragmentMasses.
+ */
+double timeKernel(
+	const std::vector<double>& ladder,
+	const std::vector<double>& deltas,
+	long charge,
+	FragmentMassTable& table)
+{
+	// Scale the repetitions so that each measurement covers ~10^7 masses
+	size_t work = ladder.size() * (deltas.size() + 1) * charge;
+	size_t reps = work > 10000000 ? 1 : 10000000 / work;
+
+	auto start = std::chrono::steady_clock::now();
+	for (size_t ii = 0; ii < reps; ii++) {
+		computeFragmentMasses(ladder.data(), ladder.size(), PROTON, 0., deltas, charge, PROTON, table);
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	return std::chrono::duration<double, std::nano>(end - start).count() / reps;
+}
+
+int main() {
+	std::mt19937 rng(42);
+
+	// Two radical deltas and three neutral losses
+	const std::vector<double> deltas{PROTON, -PROTON, 18.01056468403, 17.02654910112, 27.99491461957};
+
+	std::vector<KernelIsa> isas;
+	for (KernelIsa isa : {KernelIsa::scalar, KernelIsa::sse2, KernelIsa::avx2, KernelIsa::avx512}) {
+		if (kernelIsaSupported(isa)) {
+			isas.push_back(isa);
+		}
+	}
+
+	std::printf("%8s %6s", "length", "charge");
+	for (KernelIsa isa : isas) {
+		std::printf(" %12s", kernelIsaName(isa));
+	}
+	std::printf(" %8s\n", "speedup");
+
+	for (size_t length : {10, 50, 500, 5000}) {
+		std::vector<double> ladder = randomLadder(length, rng);
+		for (long charge : {1, 3, 8}) {
+			FragmentMassTable reference, table;
+			setKernelIsa(KernelIsa::scalar);
+			computeFragmentMasses(ladder.data(), ladder.size(), PROTON, 0., deltas, charge, PROTON, reference);
+
+			std::printf("%8zu %6ld", length, charge);
+			double scalarTime = 0., bestTime = 0.;
+			for (KernelIsa isa : isas) {
+				setKernelIsa(isa);
+				double ns = timeKernel(ladder, deltas, charge, table);
+				if (std::memcmp(
+						table.masses.data(), reference.masses.data(),
+						reference.masses.size() * sizeof(double)) != 0) {
+					std::fprintf(stderr, "%s results differ from scalar\n", kernelIsaName(isa));
+					return 1;
+				}
+				if (isa == KernelIsa::scalar) {
+					scalarTime = ns;
+				}
+				bestTime = ns;
+				std::printf(" %10.0fns", ns);
+			}
+			std::printf(" %7.2fx\n", scalarTime / bestTime);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,486 @@
+/*
+ * Microbenchmarks for the mass calculation, ion generation and Python
+ * conversion routines of the cpepfrag extension.
+ *
+ * Results are written as JSON, for comparison across commits using
+ * benchmarks/compare.py. Build and run from the repository root with:
+ *
+ *     cmake -S . -B build && cmake --build build --target pepfrag_microbenchmarks
+ *     ./build/pepfrag_microbenchmarks --out results.json
+ *
+ * Run with --help for the available options.
+ */
+#include <Python.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "converters.h"
+#include "fragmentkernel.h"
+#include "ionconfig.h"
+#include "iongenerator.h"
+#include "ion.h"
+#include "isotope.h"
+#include "mass.h"
+#include "topdown.h"
+#include "workspace.h"
+
+using Params = std::vector<std::pair<std::string, long>>;
+
+struct BenchmarkResult {
+	std::string name;
+	Params params;
+	size_t iterations;
+	// Median time per iteration across the repetitions
+	double nsPerIteration;
+	// Items, e.g. ions, produced per iteration
+	double itemsPerIteration;
+};
+
+class BenchmarkRunner {
+	public:
+		BenchmarkRunner(double minTime, int repetitions, const std::string& filter)
+			: minTime(minTime), repetitions(repetitions), filter(filter), sink(0) {}
+
+		/*
+		 * Runs body repeatedly, with the number of iterations calibrated so
+		 * that each repetition takes at least minTime seconds. body returns
+		 * the number of items it produced.
+		 */
+		void run(const std::string& name, const Params& params, const std::function<size_t()>& body) {
+			std::string fullName = name;
+			for (const auto& param : params) {
+				fullName += "/" + param.first + "=" + std::to_string(param.second);
+			}
+			if (fullName.find(filter) == std::string::npos) return;
+
+			size_t items = body();
+			size_t iterations = 1;
+			while (true) {
+				double elapsed = time(body, iterations);
+				if (elapsed >= minTime) break;
+				double scale = elapsed > 0 ? 1.2 * minTime / elapsed : 10.;
+				iterations = std::max(iterations * 2, (size_t) (iterations * std::min(scale, 100.)));
+			}
+
+			std::vector<double> times;
+			for (int ii = 0; ii < repetitions; ii++) {
+				times.push_back(time(body, iterations) * 1e9 / iterations);
+			}
+			std::sort(times.begin(), times.end());
+
+			results.push_back({name, params, iterations, times[times.size() / 2], (double) items});
+			std::fprintf(stderr, "%-60s %12.1f ns\n", fullName.c_str(), times[times.size() / 2]);
+		}
+
+		void writeJson(std::ostream& out) const {
+			out << "{\n  \"context\": {\n"
+			    << "    \"date\": " << std::time(nullptr) << ",\n"
+			    << "    \"kernel_isa\": \"" << kernelIsaName(activeKernelIsa()) << "\",\n"
+			    << "    \"compiler\": \"" << compiler() << "\",\n"
+			    << "    \"min_time\": " << minTime << ",\n"
+			    << "    \"repetitions\": " << repetitions << "\n"
+			    << "  },\n  \"benchmarks\": [";
+			for (size_t ii = 0; ii < results.size(); ii++) {
+				const BenchmarkResult& result = results[ii];
+				out << (ii == 0 ? "\n" : ",\n")
+				    << "    {\"name\": \"" << result.name << "\", \"params\": {";
+				for (size_t jj = 0; jj < result.params.size(); jj++) {
+					out << (jj == 0 ? "" : ", ")
+					    << "\"" << result.params[jj].first << "\": " << result.params[jj].second;
+				}
+				out << "}, \"iterations\": " << result.iterations
+				    << ", \"ns_per_iteration\": " << result.nsPerIteration
+				    << ", \"items_per_iteration\": " << result.itemsPerIteration
+				    << ", \"items_per_second\": " << result.itemsPerIteration * 1e9 / result.nsPerIteration
+				    << "}";
+			}
+			out << "\n  ]\n}\n";
+		}
+
+	private:
+		double minTime;
+		int repetitions;
+		std::string filter;
+		std::vector<BenchmarkResult> results;
+		volatile size_t sink;
+
+		double time(const std::function<size_t()>& body, size_t iterations) {
+			auto start = std::chrono::steady_clock::now();
+			for (size_t ii = 0; ii < iterations; ii++) {
+				sink = sink + body();
+			}
+			auto end = std::chrono::steady_clock::now();
+			return std::chrono::duration<double>(end - start).count();
+		}
+
+		static std::string compiler() {
+#if defined(__clang__)
+			return "clang " __clang_version__;
+#elif defined(__GNUC__)
+			return "gcc " __VERSION__;
+#elif defined(_MSC_VER)
+			return "msvc " + std::to_string(_MSC_VER);
+#else
+			return "unknown";
+#endif
+		}
+};
+
+/* Inputs */
+
+const std::string RESIDUES = "ACDEFGHIKLMNPQRSTVWY";
+
+struct PeptideInput {
+	std::string sequence;
+	std::vector<double> seqMasses;
+	std::vector<double> bMasses;
+	std::vector<double> yMasses;
+	double mass;
+};
+
+PeptideInput makePeptide(size_t length, std::mt19937& rng) {
+	std::uniform_int_distribution<size_t> residue(0, RESIDUES.size() - 1);
+	PeptideInput peptide;
+	for (size_t ii = 0; ii < length; ii++) {
+		peptide.sequence += RESIDUES[residue(rng)];
+	}
+
+	// As Peptide._ion_masses in pepfrag.py
+	std::vector<double> masses = calculateMass(peptide.sequence, {{0, 304.20536}}, 0);
+	peptide.seqMasses.assign(masses.begin() + 1, masses.end() - 1);
+	double bMass = masses[0];
+	double yMass = FIXED_MASSES.at("H2O") + masses[length + 1];
+	for (size_t ii = 0; ii < length; ii++) {
+		bMass += masses[ii + 1];
+		yMass += masses[length - ii];
+		peptide.bMasses.push_back(bMass);
+		peptide.yMasses.push_back(yMass);
+	}
+	peptide.mass = bMass + masses[length + 1] + FIXED_MASSES.at("H2O");
+	return peptide;
+}
+
+const std::vector<NeutralLossPair> ALL_LOSSES{
+	{"H2O", 18.01056468403}, {"NH3", 17.02654910112}, {"CO", 27.99491461957},
+	{"CO2", 43.989830}, {"H3PO4", 97.976896}
+};
+
+std::vector<NeutralLossPair> neutralLosses(long count) {
+	return std::vector<NeutralLossPair>(ALL_LOSSES.begin(), ALL_LOSSES.begin() + std::min<long>(count, ALL_LOSSES.size()));
+}
+
+AppliedLosses appliedLosses(long count) {
+	AppliedLosses applied;
+	applyNeutralLosses(neutralLosses(count), 1, applied);
+	return applied;
+}
+
+const std::vector<std::pair<std::string, IonType>> ION_TYPES{
+	{"precursor", IonType::precursor}, {"imm", IonType::immonium}, {"b", IonType::b},
+	{"y", IonType::y}, {"a", IonType::a}, {"c", IonType::c}, {"z", IonType::z}, {"x", IonType::x},
+	{"int", IonType::internal}, {"d", IonType::d}, {"v", IonType::v}, {"w", IonType::w}
+};
+
+const std::vector<double>& massesFor(IonType type, const PeptideInput& peptide, const std::vector<double>& precMasses) {
+	switch (type) {
+		case IonType::precursor:
+			return precMasses;
+		case IonType::immonium:
+		case IonType::internal:
+			return peptide.seqMasses;
+		case IonType::y:
+		case IonType::z:
+		case IonType::x:
+		case IonType::v:
+		case IonType::w:
+			return peptide.yMasses;
+		default:
+			return peptide.bMasses;
+	}
+}
+
+/* Python helpers */
+
+PyObject* doubleList(const std::vector<double>& values) {
+	return vectorToList(values, &PyFloat_FromDouble);
+}
+
+/*
+ * Returns array.array('d', list), as an example of a float64 buffer.
+ */
+PyObject* doubleArray(PyObject* list) {
+	PyObject* arrayModule = PyImport_ImportModule("array");
+	PyObject* result = PyObject_CallMethod(arrayModule, "array", "sO", "d", list);
+	Py_DECREF(arrayModule);
+	if (result == NULL) {
+		PyErr_Print();
+		std::exit(1);
+	}
+	return result;
+}
+
+/*
+ * Builds the reformatted ion type dict passed to generate_ions by pepfrag.py,
+ * for the given number of ion types (in DEFAULT_IONS order) and losses each.
+ */
+PyObject* ionTypesDict(size_t nTypes, long nLosses) {
+	PyObject* dict = PyDict_New();
+	for (size_t ii = 0; ii < nTypes && ii < ION_TYPES.size(); ii++) {
+		PyObject* losses = PyList_New(0);
+		for (const NeutralLossPair& loss : neutralLosses(nLosses)) {
+			PyObject* tuple = Py_BuildValue("(sd)", loss.first.c_str(), loss.second);
+			PyList_Append(losses, tuple);
+			Py_DECREF(tuple);
+		}
+		PyObject* key = PyLong_FromLong((long) ION_TYPES[ii].second);
+		PyDict_SetItem(dict, key, losses);
+		Py_DECREF(key);
+		Py_DECREF(losses);
+	}
+	return dict;
+}
+
+/* Argument parsing */
+
+std::vector<long> parseList(const std::string& arg) {
+	std::vector<long> values;
+	std::stringstream stream(arg);
+	std::string item;
+	while (std::getline(stream, item, ',')) {
+		values.push_back(std::stol(item));
+	}
+	return values;
+}
+
+const char* USAGE =
+	"Usage: pepfrag_microbenchmarks [options]\n"
+	"  --out FILE         write JSON results to FILE (default: stdout)\n"
+	"  --filter TEXT      only run benchmarks whose name contains TEXT\n"
+	"  --lengths L,...    sequence lengths (default: 7,20,50,500)\n"
+	"  --charges Z,...    charge states (default: 1,4,8)\n"
+	"  --losses N,...     neutral loss counts (default: 0,3)\n"
+	"  --min-time S       minimum seconds per repetition (default: 0.01)\n"
+	"  --repetitions N    repetitions per benchmark (default: 3)\n";
+
+int main(int argc, char** argv) {
+	std::string outPath, filter;
+	std::vector<long> lengths{7, 20, 50, 500};
+	std::vector<long> charges{1, 4, 8};
+	std::vector<long> lossCounts{0, 3};
+	double minTime = 0.01;
+	int repetitions = 3;
+
+	for (int ii = 1; ii < argc; ii++) {
+		std::string arg = argv[ii];
+		if (arg == "--help" || arg == "-h" || ii + 1 >= argc) {
+			std::fputs(USAGE, arg == "--help" || arg == "-h" ? stdout : stderr);
+			return arg == "--help" || arg == "-h" ? 0 : 1;
+		}
+		std::string value = argv[++ii];
+		if (arg == "--out") outPath = value;
+		else if (arg == "--filter") filter = value;
+		else if (arg == "--lengths") lengths = parseList(value);
+		else if (arg == "--charges") charges = parseList(value);
+		else if (arg == "--losses") lossCounts = parseList(value);
+		else if (arg == "--min-time") minTime = std::stod(value);
+		else if (arg == "--repetitions") repetitions = std::stoi(value);
+		else {
+			std::fputs(USAGE, stderr);
+			return 1;
+		}
+	}
+
+	Py_Initialize();
+
+	BenchmarkRunner runner(minTime, repetitions, filter);
+	std::mt19937 rng(42);
+
+	std::map<long, PeptideInput> peptides;
+	for (long length : lengths) {
+		peptides[length] = makePeptide(length, rng);
+	}
+
+	WorkspaceLease workspace;
+	IonGenerationOptions options;
+
+	/* Mass calculation */
+
+	for (long length : lengths) {
+		const PeptideInput& peptide = peptides[length];
+		std::map<long, double> mods{{0, 304.20536}, {length / 2 + 1, 15.994915}};
+		for (long massType : {0, 1}) {
+			runner.run("calculateMass", {{"length", length}, {"mass_type", massType}}, [&]() {
+				return calculateMass(peptide.sequence, mods, massType).size();
+			});
+		}
+	}
+
+	/* Ion generators */
+
+	for (const auto& ionType : ION_TYPES) {
+		const IonGenerator& generator = IonGenerator::get(ionType.second);
+		for (long length : lengths) {
+			const PeptideInput& peptide = peptides[length];
+			std::vector<double> precMasses{peptide.mass};
+			const std::vector<double>& masses = massesFor(ionType.second, peptide, precMasses);
+			for (long charge : charges) {
+				for (long radical : {0, 1}) {
+					for (long nLosses : lossCounts) {
+						AppliedLosses losses = appliedLosses(nLosses);
+						runner.run(
+							"generate/" + ionType.first,
+							{{"length", length}, {"charge", charge}, {"radical", radical}, {"losses", nLosses}},
+							[&]() {
+								workspace->generated.clear();
+								generator.generate(
+									masses, charge, losses, (bool) radical, peptide.sequence, options,
+									*workspace, workspace->generated);
+								return workspace->generated.size();
+							});
+					}
+				}
+			}
+		}
+	}
+
+	/* Merging */
+
+	for (long length : lengths) {
+		const PeptideInput& peptide = peptides[length];
+		Ions bIons, yIons, target, source, buffer;
+		IonGenerator::get(IonType::b).generate(
+			peptide.bMasses, 2, appliedLosses(3), false, peptide.sequence, options, *workspace, bIons);
+		IonGenerator::get(IonType::y).generate(
+			peptide.yMasses, 2, appliedLosses(3), false, peptide.sequence, options, *workspace, yIons);
+		// The inputs are consumed by each merge, so copying them is included
+		// in each measurement; merge/copy measures the copy alone
+		runner.run("merge/copy", {{"length", length}}, [&]() {
+			target = bIons;
+			source = yIons;
+			return target.size() + source.size();
+		});
+		runner.run("merge/inplace", {{"length", length}}, [&]() {
+			target = bIons;
+			source = yIons;
+			mergeIonVectors(target, source);
+			return target.size();
+		});
+		runner.run("merge/buffered", {{"length", length}}, [&]() {
+			target = bIons;
+			source = yIons;
+			mergeIonVectors(target, source, buffer);
+			return target.size();
+		});
+	}
+
+	/* Top-down fragmentation */
+
+	IonTypeMap topDownTypes{{IonType::c, {}}, {IonType::z, {}}};
+	TopDownOptions topDownOptions;
+	topDownOptions.minMz = 200.;
+	topDownOptions.maxMz = 2000.;
+	for (long length : lengths) {
+		const PeptideInput& peptide = peptides[length];
+		workspace->sequence = peptide.sequence;
+		workspace->bMasses = peptide.bMasses;
+		workspace->yMasses = peptide.yMasses;
+		for (long charge : {10L, 50L}) {
+			runner.run("fragmentTopDown", {{"length", length}, {"charge", charge}}, [&]() {
+				size_t nIons = 0;
+				fragmentTopDown(
+					topDownTypes, charge, false, topDownOptions, *workspace,
+					[&](const TopDownChunk& chunk) { nIons += chunk.size; });
+				return nIons;
+			});
+		}
+	}
+
+	/* Isotope distributions */
+
+	IsotopeCalculator calculator;
+	std::vector<double> isotopeMz;
+	std::vector<double> isotopeAbundances;
+	for (long length : lengths) {
+		const PeptideInput& peptide = peptides[length];
+		workspace->sequence = peptide.sequence;
+		workspace->bMasses = peptide.bMasses;
+		workspace->yMasses = peptide.yMasses;
+		for (long nPeaks : {4L, 10L}) {
+			runner.run("ionIsotopes", {{"length", length}, {"peaks", nPeaks}}, [&]() {
+				size_t nValues = 0;
+				for (IonType type : {IonType::b, IonType::y}) {
+					ionIsotopes(type, 1, (size_t) nPeaks, calculator, *workspace, isotopeMz, isotopeAbundances);
+					nValues += isotopeMz.size();
+				}
+				return nValues;
+			});
+		}
+	}
+
+	/* Python conversions */
+
+	for (long nLosses : lossCounts) {
+		PyObject* dict = ionTypesDict(ION_TYPES.size(), nLosses);
+		runner.run("dictToIonTypeMap", {{"ion_types", (long) ION_TYPES.size()}, {"losses", nLosses}}, [&]() {
+			return dictToIonTypeMap(dict).size();
+		});
+		Py_DECREF(dict);
+	}
+
+	for (long length : lengths) {
+		const PeptideInput& peptide = peptides[length];
+		PyObject* list = doubleList(peptide.bMasses);
+		std::vector<double> target;
+		runner.run("listToDoubleVector", {{"length", length}}, [&]() {
+			listToDoubleVector(list, target);
+			return target.size();
+		});
+
+		PyObject* buffer = doubleArray(list);
+		runner.run("listToDoubleVector/buffer", {{"length", length}}, [&]() {
+			listToDoubleVector(buffer, target);
+			return target.size();
+		});
+		Py_DECREF(buffer);
+		Py_DECREF(list);
+
+		runner.run("vectorToList/double", {{"length", length}}, [&]() {
+			PyObject* result = doubleList(peptide.bMasses);
+			Py_DECREF(result);
+			return peptide.bMasses.size();
+		});
+
+		for (long charge : charges) {
+			Ions ions;
+			IonGenerator::get(IonType::b).generate(
+				peptide.bMasses, charge, appliedLosses(3), false, peptide.sequence, options, *workspace, ions);
+			runner.run("vectorToList/ion", {{"length", length}, {"charge", charge}}, [&]() {
+				PyObject* result = vectorToList(ions, &ionToTuple);
+				Py_DECREF(result);
+				return ions.size();
+			});
+		}
+	}
+
+	if (outPath.empty()) {
+		runner.writeJson(std::cout);
+	}
+	else {
+		std::ofstream out(outPath);
+		runner.writeJson(out);
+	}
+
+	return 0;
+}
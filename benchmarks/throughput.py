@@ -0,0 +1,349 @@
+#! /usr/bin/env python3
+"""
+End-to-end throughput benchmark for pepfrag.
+
+A deterministic corpus of tryptic-like peptides, with realistic length,
+modification and charge distributions, is generated and each stage of
+typical pepfrag usage (construction, mass calculation, fragmentation with
+several ion type configurations, batch fragmentation with fragment_peptides
+and fragmentation at several charges with fragment_charges) is timed over
+the whole corpus.
+
+For each workload, peptides/sec and ions/sec are reported, along with the
+Python memory blocks retained per peptide and the peak traced Python memory
+(both measured in a separate, single process pass using tracemalloc) and
+the process peak RSS.
+
+With --processes, each workload is also run with the corpus split between
+that many worker processes, each of which builds its own copy of the
+corpus before timing starts. Processes are used rather than threads since
+the timed entry points hold the GIL, so threads would measure contention
+for it rather than parallel throughput.
+
+Usage, from the repository root after building the extension in place:
+
+    PYTHONPATH=. python benchmarks/throughput.py [--peptides N] [--seed S]
+        [--processes P [P ...]] [--json FILE]
+
+"""
+import argparse
+import concurrent.futures
+import json
+import random
+import resource
+import sys
+import time
+import tracemalloc
+from typing import Callable, Dict, List, Optional, Sequence, Tuple
+
+from pepfrag import IonPreset, IonType, ModSite, Peptide, fragment_peptides
+
+# Residue frequencies (%) in UniProtKB/Swiss-Prot
+RESIDUE_FREQUENCIES = {
+    'A': 8.25, 'R': 5.53, 'N': 4.06, 'D': 5.45, 'C': 1.37, 'Q': 3.93,
+    'E': 6.75, 'G': 7.07, 'H': 2.27, 'I': 5.96, 'L': 9.66, 'K': 5.84,
+    'M': 2.42, 'F': 3.86, 'P': 4.70, 'S': 6.56, 'T': 5.34, 'W': 1.08,
+    'Y': 2.92, 'V': 6.87,
+}
+
+CARBAMIDOMETHYL = 57.021464
+OXIDATION = 15.994915
+PHOSPHO = 79.966331
+ITRAQ = 304.20536
+
+CHARGE_DISTRIBUTION = {1: 0.02, 2: 0.6, 3: 0.3, 4: 0.06, 5: 0.02}
+
+# The precursor charges tried for a peptide of unknown charge
+UNKNOWN_CHARGES = [2, 3, 4]
+
+CUSTOM_IONS = {
+    IonType.precursor: ['H2O', 'NH3'],
+    IonType.b: ['H2O', 'NH3'],
+    IonType.y: ['H2O', 'NH3'],
+    IonType.c: [],
+    IonType.z: [],
+}
+
+
+class Corpus:
+    """
+    A deterministic corpus of tryptic-like peptides.
+
+    """
+    def __init__(self, size: int, seed: int):
+        rng = random.Random(seed)
+        residues = ''.join(r for r in RESIDUE_FREQUENCIES if r not in 'KR')
+        weights = [RESIDUE_FREQUENCIES[r] for r in residues]
+
+        self.peptides = []
+        for _ in range(size):
+            # Tryptic peptide lengths are approximately log-normal, mode ~10
+            length = min(max(int(rng.lognormvariate(2.55, 0.35)), 6), 50)
+            seq = ''.join(rng.choices(residues, weights, k=length - 1))
+            # ~10 % of peptides contain a missed cleavage
+            if length > 8 and rng.random() < 0.1:
+                pos = rng.randrange(2, length - 2)
+                seq = seq[:pos] + rng.choice('KR') + seq[pos + 1:]
+            seq += rng.choice('KR')
+
+            mods = [
+                ModSite(CARBAMIDOMETHYL, ii + 1, 'Carbamidomethyl')
+                for ii, res in enumerate(seq) if res == 'C'
+            ]
+            mods.extend(
+                ModSite(OXIDATION, ii + 1, 'Oxidation')
+                for ii, res in enumerate(seq)
+                if res == 'M' and rng.random() < 0.3
+            )
+            sty = [ii for ii, res in enumerate(seq) if res in 'STY']
+            if sty and rng.random() < 0.15:
+                mods.append(ModSite(PHOSPHO, rng.choice(sty) + 1, 'Phospho'))
+            if rng.random() < 0.2:
+                mods.append(ModSite(ITRAQ, 'nterm', 'iTRAQ8plex'))
+
+            charge = rng.choices(
+                list(CHARGE_DISTRIBUTION), list(CHARGE_DISTRIBUTION.values())
+            )[0]
+
+            self.peptides.append((seq, charge, mods))
+
+    def construct(self) -> List[Peptide]:
+        return [Peptide(seq, charge, mods) for seq, charge, mods in self.peptides]
+
+
+class Workload:
+    """
+    A benchmark workload, applying `func` to each peptide in the corpus and
+    returning the number of ions produced.
+
+    """
+    def __init__(self, name: str, func: Callable[[Peptide], int]):
+        self.name = name
+        self.func = func
+
+    def run(self, peptides: Sequence[Peptide]) -> int:
+        return sum(self.func(p) for p in peptides)
+
+
+class BatchWorkload(Workload):
+    """
+    A benchmark workload, applying `func` to the whole corpus at once and
+    returning the number of ions produced.
+
+    """
+    def run(self, peptides: Sequence[Peptide]) -> int:
+        return self.func(peptides)
+
+
+def _no_ions(_) -> int:
+    return 0
+
+
+def _count_ions(ion_lists) -> int:
+    return sum(len(ions) for ions in ion_lists)
+
+
+WORKLOADS = [
+    Workload('mass', lambda p: _no_ions(p.mass)),
+    Workload('mz', lambda p: _no_ions(p.mz)),
+    Workload('fragment(default)', lambda p: len(p.fragment())),
+    Workload(
+        'fragment(dict)',
+        lambda p: len(p.fragment({t: list(l) for t, l in CUSTOM_IONS.items()}))
+    ),
+    Workload('fragment(IonPreset.cid)', lambda p: len(p.fragment(IonPreset.cid))),
+    Workload(
+        'fragment(IonPreset.ethcd)',
+        lambda p: len(p.fragment(IonPreset.ethcd))
+    ),
+    Workload('fragment_masses(default)', lambda p: len(p.fragment_masses()[0])),
+    BatchWorkload(
+        'fragment_peptides(default)',
+        lambda ps: _count_ions(fragment_peptides(ps))
+    ),
+    BatchWorkload(
+        'fragment_peptides(cid)',
+        lambda ps: _count_ions(fragment_peptides(ps, IonPreset.cid))
+    ),
+    Workload(
+        'fragment_charges(default)',
+        lambda p: _count_ions(p.fragment_charges(UNKNOWN_CHARGES).values())
+    ),
+]
+
+# The corpus of a worker process, built by _init_worker
+_worker_peptides: List[Peptide] = []
+
+
+def _init_worker(size: int, seed: int):
+    global _worker_peptides
+    _worker_peptides = Corpus(size, seed).construct()
+
+
+def _worker_ready(delay: float):
+    # Occupies a worker briefly, so that each process is started and has
+    # built its corpus before timing starts
+    time.sleep(delay)
+
+
+def _run_chunk(
+        workload_index: int, start: int, stop: int
+) -> Tuple[int, float, float]:
+    """
+    Runs the workload on a slice of the worker's corpus, returning the number
+    of ions produced and the wall clock times at which it started and
+    finished.
+
+    """
+    chunk = _worker_peptides[start:stop]
+    begin = time.time()
+    n_ions = WORKLOADS[workload_index].run(chunk)
+    return n_ions, begin, time.time()
+
+
+def peak_rss_mb() -> float:
+    rss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    # ru_maxrss is in bytes on macOS and kilobytes elsewhere
+    return rss / 2 ** 20 if sys.platform == 'darwin' else rss / 2 ** 10
+
+
+def measure_allocations(
+        func: Callable[[], object], n_peptides: int
+) -> Dict[str, float]:
+    """
+    Measures the Python memory blocks allocated by `func`, and still held by
+    its return value, per peptide, and the peak Python memory usage during
+    the call.
+
+    """
+    tracemalloc.start()
+    before = tracemalloc.take_snapshot()
+    result = func()
+    after = tracemalloc.take_snapshot()
+    _, peak = tracemalloc.get_traced_memory()
+    tracemalloc.stop()
+    del result
+
+    stats = after.compare_to(before, 'filename')
+    return {
+        'blocks_per_peptide':
+            sum(max(s.count_diff, 0) for s in stats) / n_peptides,
+        'traced_peak_kb': peak / 1024,
+    }
+
+
+def run_workload(
+        workload_index: int,
+        peptides: List[Peptide],
+        processes: int,
+        executor: Optional[concurrent.futures.Executor]
+) -> Dict[str, float]:
+    workload = WORKLOADS[workload_index]
+    if executor is not None:
+        chunk_size = (len(peptides) + processes - 1) // processes
+        futures = [
+            executor.submit(_run_chunk, workload_index, ii, ii + chunk_size)
+            for ii in range(0, len(peptides), chunk_size)
+        ]
+        chunks = [future.result() for future in futures]
+        n_ions = sum(chunk[0] for chunk in chunks)
+        # From the first chunk starting to the last finishing, excluding the
+        # transfer of the results to this process
+        elapsed = max(chunk[2] for chunk in chunks) - \
+            min(chunk[1] for chunk in chunks)
+    else:
+        start = time.perf_counter()
+        n_ions = workload.run(peptides)
+        elapsed = time.perf_counter() - start
+
+    result = {
+        'workload': workload.name,
+        'processes': processes,
+        'seconds': elapsed,
+        'peptides_per_second': len(peptides) / elapsed,
+        'ions_per_second': n_ions / elapsed,
+    }
+    result.update(
+        measure_allocations(lambda: workload.run(peptides), len(peptides))
+    )
+    result['peak_rss_mb'] = peak_rss_mb()
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--peptides', type=int, default=20000)
+    parser.add_argument('--seed', type=int, default=1)
+    parser.add_argument(
+        '--processes', type=int, nargs='+', default=[1],
+        help='Process counts for which to run each workload'
+    )
+    parser.add_argument('--json', help='Write results as JSON to this file')
+    args = parser.parse_args()
+
+    corpus = Corpus(args.peptides, args.seed)
+
+    results = []
+
+    start = time.perf_counter()
+    peptides = corpus.construct()
+    elapsed = time.perf_counter() - start
+    construct = {
+        'workload': 'Peptide(...)',
+        'processes': 1,
+        'seconds': elapsed,
+        'peptides_per_second': len(peptides) / elapsed,
+        'ions_per_second': 0.,
+    }
+    construct.update(measure_allocations(corpus.construct, len(peptides)))
+    construct['peak_rss_mb'] = peak_rss_mb()
+    results.append(construct)
+
+    executors = {}
+    for processes in args.processes:
+        if processes > 1 and processes not in executors:
+            executor = concurrent.futures.ProcessPoolExecutor(
+                processes, initializer=_init_worker,
+                initargs=(args.peptides, args.seed)
+            )
+            list(executor.map(_worker_ready, [0.1] * processes))
+            executors[processes] = executor
+
+    for index in range(len(WORKLOADS)):
+        for processes in args.processes:
+            results.append(run_workload(
+                index, peptides, processes, executors.get(processes)
+            ))
+
+    for executor in executors.values():
+        executor.shutdown()
+
+    print(
+        f"{'workload':<32} {'processes':>9} {'peptides/s':>12} "
+        f"{'ions/s':>12} {'blocks/pep':>10} {'traced KB':>10} "
+        f"{'peak RSS MB':>11}"
+    )
+    for r in results:
+        print(
+            f"{r['workload']:<32} {r['processes']:>9} "
+            f"{r['peptides_per_second']:>12.0f} {r['ions_per_second']:>12.0f} "
+            f"{r['blocks_per_peptide']:>10.1f} {r['traced_peak_kb']:>10.0f} "
+            f"{r['peak_rss_mb']:>11.1f}"
+        )
+
+    if args.json is not None:
+        with open(args.json, 'w') as fh:
+            json.dump(
+                {
+                    'peptides': args.peptides,
+                    'seed': args.seed,
+                    'python': sys.version,
+                    'results': results,
+                },
+                fh,
+                indent=2
+            )
+
+
+if __name__ == '__main__':
+    main()
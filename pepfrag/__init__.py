@@ -1,13 +1,42 @@
-from .constants import AA_MASSES, FIXED_MASSES, Mass, MassType
-from .pepfrag import Ion, IonType, ModSite, Peptide
+import os
+
+from .constants import (
+    AA_MASSES, FIXED_MASSES, FIXED_POINT_SCALE, Mass, MassFormat, MassType
+)
+from .pepfrag import (
+    CID_IONS, DEFAULT_IONS, ETD_IONS, ETHCD_IONS, Ion, IonPreset, IonType,
+    IsotopePeaks, ModSite, Peptide, TopDownIons, fragment_peptides,
+    register_ion_types
+)
 
 __all__ = [
     "AA_MASSES",
     "FIXED_MASSES",
+    "FIXED_POINT_SCALE",
     "Mass",
+    "MassFormat",
     "MassType",
+    "CID_IONS",
+    "DEFAULT_IONS",
+    "ETD_IONS",
+    "ETHCD_IONS",
     "Ion",
+    "IonPreset",
     "IonType",
+    "IsotopePeaks",
     "ModSite",
     "Peptide",
+    "TopDownIons",
+    "fragment_peptides",
+    "get_include",
+    "register_ion_types",
 ]
+
+
+def get_include() -> str:
+    """
+    Returns the directory containing pepfrag_capi.h, the header declaring the
+    C API of the extension, for use by other compiled extensions.
+
+    """
+    return os.path.dirname(__file__)
@@ -0,0 +1,131 @@
+#include <Python.h>
+#include <initializer_list>
+#include <vector>
+
+#include "arguments.h"
+
+FastcallParameters::FastcallParameters(
+	const char* functionName,
+	std::initializer_list<const char*> names,
+	size_t nRequired)
+	: functionName(functionName), names(names), nRequired(nRequired) {}
+
+bool FastcallParameters::intern() {
+	interned.clear();
+	for (const char* name : names) {
+		PyObject* str = PyUnicode_InternFromString(name);
+		if (str == NULL) {
+			return false;
+		}
+		// The interned names live as long as the module
+		interned.push_back(str);
+	}
+	return true;
+}
+
+long FastcallParameters::find(PyObject* keyword) const {
+	for (size_t ii = 0; ii < interned.size(); ii++) {
+		if (interned[ii] == keyword) {
+			return (long) ii;
+		}
+	}
+	// Fall back to comparing the strings, e.g. for keywords built at runtime
+	for (size_t ii = 0; ii < interned.size(); ii++) {
+		if (PyUnicode_Compare(interned[ii], keyword) == 0) {
+			return (long) ii;
+		}
+	}
+	return -1;
+}
+
+bool FastcallParameters::parse(
+	PyObject* const* args,
+	Py_ssize_t nargs,
+	PyObject* kwnames,
+	PyObject** values) const
+{
+	if ((size_t) nargs > names.size()) {
+		PyErr_Format(
+			PyExc_TypeError, "%s() takes at most %zu arguments (%zd given)",
+			functionName, names.size(), nargs);
+		return false;
+	}
+
+	for (size_t ii = 0; ii < names.size(); ii++) {
+		values[ii] = ii < (size_t) nargs ? args[ii] : NULL;
+	}
+
+	if (kwnames != NULL) {
+		Py_ssize_t nKeywords = PyTuple_GET_SIZE(kwnames);
+		for (Py_ssize_t ii = 0; ii < nKeywords; ii++) {
+			PyObject* keyword = PyTuple_GET_ITEM(kwnames, ii);
+			long index = find(keyword);
+			if (index < 0) {
+				PyErr_Format(
+					PyExc_TypeError, "%s() got an unexpected keyword argument '%U'",
+					functionName, keyword);
+				return false;
+			}
+			if (values[index] != NULL) {
+				PyErr_Format(
+					PyExc_TypeError, "%s() got multiple values for argument '%s'",
+					functionName, names[index]);
+				return false;
+			}
+			values[index] = args[nargs + ii];
+		}
+	}
+
+	for (size_t ii = 0; ii < nRequired; ii++) {
+		if (values[ii] == NULL) {
+			PyErr_Format(
+				PyExc_TypeError, "%s() missing required argument '%s' (pos %zu)",
+				functionName, names[ii], ii + 1);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Conversions */
+
+bool argumentToDouble(PyObject* arg, double& value) {
+	if (PyFloat_CheckExact(arg)) {
+		value = PyFloat_AS_DOUBLE(arg);
+		return true;
+	}
+	value = PyFloat_AsDouble(arg);
+	return !(value == -1. && PyErr_Occurred());
+}
+
+bool argumentToLong(PyObject* arg, long& value) {
+	value = PyLong_AsLong(arg);
+	return !(value == -1 && PyErr_Occurred());
+}
+
+bool argumentToBool(PyObject* arg, bool& value) {
+	int result = PyObject_IsTrue(arg);
+	value = result > 0;
+	return result >= 0;
+}
+
+bool argumentToString(PyObject* arg, const char* name, const char*& value) {
+	if (!PyUnicode_Check(arg)) {
+		PyErr_Format(PyExc_TypeError, "%s must be a str, not %.200s", name, Py_TYPE(arg)->tp_name);
+		return false;
+	}
+	value = PyUnicode_AsUTF8(arg);
+	return value != NULL;
+}
+
+bool argumentToMassFormat(PyObject* arg, MassFormat& format) {
+	long value;
+	if (!argumentToLong(arg, value)) return false;
+	if (value >= static_cast<long>(MassFormat::float64) && value <= static_cast<long>(MassFormat::fixed)) {
+		format = static_cast<MassFormat>(value);
+		return true;
+	}
+	PyErr_Format(PyExc_ValueError, "Invalid mass format: %ld", value);
+	return false;
+}
@@ -0,0 +1,66 @@
+#ifndef _PEPFRAG_ARGUMENTS_H
+#define _PEPFRAG_ARGUMENTS_H
+
+#include <Python.h>
+#include <initializer_list>
+#include <vector>
+
+#include "ion.h"
+
+/*
+ * Argument parsing for METH_FASTCALL | METH_KEYWORDS functions. The parameter
+ * names are interned on module initialization, so that keyword arguments,
+ * whose names Python also interns, are usually matched by pointer.
+ */
+class FastcallParameters {
+	public:
+		FastcallParameters(
+			const char* functionName,
+			std::initializer_list<const char*> names,
+			size_t nRequired);
+
+		/*
+		 * Interns the parameter names. Returns false, with a Python exception
+		 * set, on failure.
+		 */
+		bool intern();
+
+		/*
+		 * Sets values, which must have space for one value per parameter, to
+		 * borrowed references to the arguments, or NULL for omitted optional
+		 * arguments. Returns false, with a TypeError set, if the arguments do
+		 * not match the parameters.
+		 */
+		bool parse(PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames, PyObject** values) const;
+
+		size_t size() const { return names.size(); }
+
+	private:
+		long find(PyObject* keyword) const;
+
+		const char* functionName;
+		std::vector<const char*> names;
+		std::vector<PyObject*> interned;
+		size_t nRequired;
+};
+
+/*
+ * Argument conversions, returning false with a Python exception set if the
+ * argument is of the wrong type.
+ */
+
+bool argumentToDouble(PyObject* arg, double& value);
+
+bool argumentToLong(PyObject* arg, long& value);
+
+bool argumentToBool(PyObject* arg, bool& value);
+
+bool argumentToString(PyObject* arg, const char* name, const char*& value);
+
+/*
+ * As argumentToLong, also raising ValueError for values which are not a
+ * MassFormat.
+ */
+bool argumentToMassFormat(PyObject* arg, MassFormat& format);
+
+#endif // _PEPFRAG_ARGUMENTS_H
@@ -0,0 +1,199 @@
+#include <Python.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "capi.h"
+#include "fragment.h"
+#include "ionconfig.h"
+#include "pepfrag_capi.h"
+#include "workspace.h"
+
+thread_local std::string lastError;
+
+/*
+ * Calls func, converting any exception into an error code.
+ */
+template<class F>
+int translateExceptions(F func) {
+	try {
+		return func();
+	}
+	catch (const std::out_of_range& ex) {
+		lastError = ex.what();
+		return PEPFRAG_ERROR_INVALID_ARGUMENT;
+	}
+	catch (const std::logic_error& ex) {
+		lastError = ex.what();
+		return PEPFRAG_ERROR_INVALID_ARGUMENT;
+	}
+	catch (const std::exception& ex) {
+		lastError = ex.what();
+		return PEPFRAG_ERROR_INTERNAL;
+	}
+}
+
+void checkPeptide(const PepfragPeptide* peptide) {
+	if (peptide == nullptr || peptide->sequence == nullptr) {
+		throw std::invalid_argument("No peptide sequence given");
+	}
+	if (peptide->n_mods > 0 && peptide->mods == nullptr) {
+		throw std::invalid_argument("No modification sites given");
+	}
+	if (peptide->mass_type != PEPFRAG_MASS_TYPE_MONO && peptide->mass_type != PEPFRAG_MASS_TYPE_AVG) {
+		throw std::invalid_argument("Invalid mass type: " + std::to_string(peptide->mass_type));
+	}
+}
+
+std::map<long, double> modSiteMasses(const PepfragPeptide* peptide) {
+	std::map<long, double> masses;
+	for (size_t ii = 0; ii < peptide->n_mods; ii++) {
+		// As for the Python API, only the first modification at a site applies
+		masses.emplace(peptide->mods[ii].site, peptide->mods[ii].mass);
+	}
+	return masses;
+}
+
+void fragment(const PepfragPeptide* peptide, long ionConfig, bool labels, Workspace& workspace) {
+	checkPeptide(peptide);
+	IonGenerationOptions options;
+	options.labels = labels;
+	fragmentPeptide(
+		peptide->sequence, modSiteMasses(peptide), peptide->charge, getIonConfig(ionConfig),
+		peptide->radical != 0, peptide->mass_type, options, workspace);
+}
+
+/* C API functions */
+
+extern "C" {
+
+const char* capiLastError(void) {
+	return lastError.c_str();
+}
+
+int capiCalculateMass(const PepfragPeptide* peptide, double* masses, size_t capacity) {
+	return translateExceptions([&]() {
+		checkPeptide(peptide);
+		std::vector<double> result = calculateMass(
+			peptide->sequence, modSiteMasses(peptide), peptide->mass_type);
+		if (capacity < result.size()) {
+			lastError = "Mass buffer requires " + std::to_string(result.size()) + " values";
+			return PEPFRAG_ERROR_BUFFER_TOO_SMALL;
+		}
+		std::copy(result.begin(), result.end(), masses);
+		return PEPFRAG_OK;
+	});
+}
+
+int capiRegisterIonTypes(const PepfragIonTypeSpec* ionTypes, size_t nIonTypes, long* handle) {
+	return translateExceptions([&]() {
+		IonTypeMap ionTypeMap;
+		for (size_t ii = 0; ii < nIonTypes; ii++) {
+			const PepfragIonTypeSpec& spec = ionTypes[ii];
+			if (spec.ion_type < PEPFRAG_ION_PRECURSOR || spec.ion_type > PEPFRAG_ION_X) {
+				throw std::invalid_argument("Invalid ion type: " + std::to_string(spec.ion_type));
+			}
+			std::vector<NeutralLossPair> losses;
+			for (size_t jj = 0; jj < spec.n_losses; jj++) {
+				losses.emplace_back(spec.losses[jj].label, spec.losses[jj].mass);
+			}
+			ionTypeMap.emplace_back(static_cast<IonType>(spec.ion_type), std::move(losses));
+		}
+		*handle = registerIonConfig(ionTypeMap);
+		return PEPFRAG_OK;
+	});
+}
+
+int capiGenerateIons(
+	const PepfragPeptide* peptide, long ionConfig,
+	double* mz, int32_t* positions, size_t capacity, size_t* nIons)
+{
+	return translateExceptions([&]() {
+		WorkspaceLease workspace;
+		fragment(peptide, ionConfig, false, *workspace);
+
+		const Ions& ions = workspace->ions;
+		*nIons = ions.size();
+		if (capacity < ions.size()) {
+			lastError = "Ion buffers require " + std::to_string(ions.size()) + " values";
+			return PEPFRAG_ERROR_BUFFER_TOO_SMALL;
+		}
+		for (size_t ii = 0; ii < ions.size(); ii++) {
+			mz[ii] = ions[ii].mass;
+			positions[ii] = (int32_t) ions[ii].position;
+		}
+		return PEPFRAG_OK;
+	});
+}
+
+int capiAnnotatePeaks(
+	const PepfragPeptide* peptide, long ionConfig,
+	const double* mz, size_t nPeaks, double tolerance,
+	char* labels, size_t labelSize, size_t* nMatched)
+{
+	return translateExceptions([&]() {
+		if (nPeaks > 0 && labelSize == 0) {
+			throw std::invalid_argument("label_size must be positive");
+		}
+
+		WorkspaceLease workspace;
+		fragment(peptide, ionConfig, true, *workspace);
+
+		const Ions& ions = workspace->ions;
+		std::vector<size_t> order(ions.size());
+		std::iota(order.begin(), order.end(), 0);
+		std::sort(order.begin(), order.end(), [&ions](size_t a, size_t b) {
+			return ions[a].mass < ions[b].mass;
+		});
+
+		*nMatched = 0;
+		for (size_t ii = 0; ii < nPeaks; ii++) {
+			// The nearest ion is either side of the first ion not below the peak
+			auto it = std::lower_bound(order.begin(), order.end(), mz[ii], [&ions](size_t index, double value) {
+				return ions[index].mass < value;
+			});
+			const Ion* nearest = nullptr;
+			if (it != order.end()) {
+				nearest = &ions[*it];
+			}
+			if (it != order.begin()) {
+				const Ion& previous = ions[*(it - 1)];
+				if (nearest == nullptr || mz[ii] - previous.mass < nearest->mass - mz[ii]) {
+					nearest = &previous;
+				}
+			}
+
+			char* label = labels + ii * labelSize;
+			if (nearest != nullptr && std::abs(nearest->mass - mz[ii]) <= tolerance) {
+				size_t length = std::min(nearest->label.size(), labelSize - 1);
+				std::memcpy(label, nearest->label.data(), length);
+				label[length] = '\0';
+				(*nMatched)++;
+			}
+			else {
+				label[0] = '\0';
+			}
+		}
+		return PEPFRAG_OK;
+	});
+}
+
+}
+
+const PepfragCAPI CAPI_TABLE = {
+	PEPFRAG_CAPI_VERSION,
+	&capiLastError,
+	&capiCalculateMass,
+	&capiRegisterIonTypes,
+	&capiGenerateIons,
+	&capiAnnotatePeaks
+};
+
+PyObject* createCApiCapsule() {
+	return PyCapsule_New((void*) &CAPI_TABLE, PEPFRAG_CAPSULE_NAME, NULL);
+}
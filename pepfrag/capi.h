@@ -0,0 +1,11 @@
+#ifndef _PEPFRAG_CAPI_IMPL_H
+#define _PEPFRAG_CAPI_IMPL_H
+
+#include <Python.h>
+
+/*
+ * Creates the capsule exporting the C API declared in pepfrag_capi.h.
+ */
+PyObject* createCApiCapsule();
+
+#endif // _PEPFRAG_CAPI_IMPL_H
@@ -21,6 +21,26 @@ class MassType(enum.Enum):
     avg = 1  #: Average mass
 
 
+class MassFormat(enum.Enum):
+    """
+    An enumeration of the storage formats available for compact fragment
+    masses (see :meth:`Peptide.fragment_masses`).
+
+    Masses are always calculated in double precision and are only converted
+    to the selected format on output.
+
+    """
+    float64 = 0  #: Double precision floating point
+    float32 = 1  #: Single precision floating point
+    #: m/z multiplied by `FIXED_POINT_SCALE` and rounded to a 32-bit integer.
+    #: m/z values out of its range raise OverflowError
+    fixed = 2
+
+
+#: Scale factor applied to m/z values in the `MassFormat.fixed` format
+FIXED_POINT_SCALE: int = 10000
+
+
 @dataclasses.dataclass
 class Mass:
     """
@@ -1,4 +1,7 @@
 #include <Python.h>
+#include <cmath>
+#include <cstdint>
+#include <limits>
 #include <stdexcept>
 #include <string>
 #include <utility>
@@ -8,6 +11,7 @@
 
 #include "converters.h"
 #include "ion.h"
+#include "stats.h"
 
 using PyObjectPredicate = std::function<bool(PyObject*)>;
 
@@ -34,18 +38,19 @@ std::string unicodeToString(PyObject* obj) {
 /* Python to C++ */
 
 template<class T>
-std::vector<T> listToVector(
+void listToVector(
         PyObject* source,
         const PyObjectPredicate& check,
         const std::function<T(PyObject*)>& convert,
-        const std::string& pythonType
+        const std::string& pythonType,
+        std::vector<T>& data
 ) {
 	if (!PySequence_Check(source)) {
 		throw std::logic_error("PyObject pointer was not a sequence");
 	}
 	
 	long size = (long) PySequence_Size(source);
-	std::vector<T> data;
+	data.clear();
 	data.reserve(size);
 	for (Py_ssize_t ii = 0; ii < size; ii++) {
 		PyObject* value = PySequence_GetItem(source, ii);
@@ -58,11 +63,106 @@ std::vector<T> listToVector(
 		}
 		Py_DECREF(value);
 	}
+}
+
+template<class T>
+std::vector<T> listToVector(
+        PyObject* source,
+        const PyObjectPredicate& check,
+        const std::function<T(PyObject*)>& convert,
+        const std::string& pythonType
+) {
+	std::vector<T> data;
+	listToVector<T>(source, check, convert, pythonType, data);
 	return data;
 }
 
+/*
+ * Whether the struct module format string describes a native double.
+ */
+bool isDoubleFormat(const char* format) {
+	const uint16_t one = 1;
+	const char nativeOrder = *reinterpret_cast<const char*>(&one) == 1 ? '<' : '>';
+	if (format[0] == '@' || format[0] == '=' || format[0] == nativeOrder) {
+		format++;
+	}
+	return format[0] == 'd' && format[1] == '\0';
+}
+
+/*
+ * Copies source into target if it exposes a one-dimensional, C-contiguous
+ * float64 buffer, e.g. a NumPy array or array.array('d'). Returns false,
+ * leaving target unchanged, otherwise.
+ */
+bool bufferToDoubleVector(PyObject* source, std::vector<double>& target) {
+	if (!PyObject_CheckBuffer(source)) {
+		return false;
+	}
+
+	Py_buffer view;
+	if (PyObject_GetBuffer(source, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0) {
+		PyErr_Clear();
+		return false;
+	}
+
+	bool isDouble = view.ndim == 1 && view.itemsize == sizeof(double)
+		&& view.format != NULL && isDoubleFormat(view.format);
+	if (isDouble) {
+		const double* data = static_cast<const double*>(view.buf);
+		target.assign(data, data + view.shape[0]);
+	}
+
+	PyBuffer_Release(&view);
+	return isDouble;
+}
+
 std::vector<double> listToDoubleVector(PyObject* source) {
-	return listToVector<double>(source, &checkFloat, &PyFloat_AsDouble, "float");
+	std::vector<double> data;
+	listToDoubleVector(source, data);
+	return data;
+}
+
+void listToDoubleVector(PyObject* source, std::vector<double>& target) {
+	PEPFRAG_TIME(listToDoubleVector);
+
+	if (bufferToDoubleVector(source, target)) {
+		return;
+	}
+
+	// PySequence_Fast would accept any iterable, so unordered collections and
+	// iterators are rejected first: their order is not that of the masses
+	if (!PySequence_Check(source) || PyAnySet_Check(source) || PyDict_Check(source)) {
+		throw std::logic_error("PyObject pointer was not a sequence");
+	}
+
+	// Lists and tuples are accessed directly, other sequences are copied to a
+	// list
+	PyObject* sequence = PySequence_Fast(source, "");
+	if (sequence == NULL) {
+		PyErr_Clear();
+		throw std::logic_error("PyObject pointer was not a sequence");
+	}
+
+	Py_ssize_t size = PySequence_Fast_GET_SIZE(sequence);
+	PyObject** items = PySequence_Fast_ITEMS(sequence);
+	target.resize(size);
+	for (Py_ssize_t ii = 0; ii < size; ii++) {
+		PyObject* value = items[ii];
+		if (PyFloat_CheckExact(value)) {
+			target[ii] = PyFloat_AS_DOUBLE(value);
+			continue;
+		}
+		// Any other number, e.g. an int or NumPy scalar
+		double converted = PyFloat_AsDouble(value);
+		if (converted == -1. && PyErr_Occurred()) {
+			PyErr_Clear();
+			Py_DECREF(sequence);
+			throw std::logic_error("Contained PyObject pointer was not expected type: float");
+		}
+		target[ii] = converted;
+	}
+
+	Py_DECREF(sequence);
 }
 
 std::vector<std::string> listToStringVector(PyObject* source) {
@@ -108,6 +208,7 @@ std::pair<T, U> tupleToPair(
 }
 
 IonTypeMap dictToIonTypeMap(PyObject* source) {
+	PEPFRAG_TIME(dictToIonTypeMap);
 	if (!PyDict_Check(source)) {
 		throw std::logic_error("PyObject pointer was not a dict");
 	}
@@ -171,3 +272,71 @@ std::map<long, double> modSiteListToMap(PyObject* source, size_t seqLen) {
 
 	return modSiteMasses;
 }
+
+/* C++ to Python */
+
+PyObject* ionToTuple(const Ion& ion) {
+	PyObject* pMass = PyFloat_FromDouble(ion.mass);
+	PyObject* pLabel = PyUnicode_FromString(ion.label.c_str());
+	PyObject* pPosition = PyLong_FromLong(ion.position);
+
+	PyObject* tuple = PyTuple_Pack(3, pMass, pLabel, pPosition);
+
+	Py_DECREF(pMass);
+	Py_DECREF(pLabel);
+	Py_DECREF(pPosition);
+
+	return tuple;
+}
+
+template<class T, class S, class F>
+PyObject* packValues(const std::vector<S>& values, F convert) {
+	PyObject* bytes = PyBytes_FromStringAndSize(NULL, (Py_ssize_t) (values.size() * sizeof(T)));
+	if (bytes == NULL) {
+		throw std::runtime_error("Failed to allocate bytes object");
+	}
+	T* data = reinterpret_cast<T*>(PyBytes_AS_STRING(bytes));
+	try {
+		for (size_t ii = 0; ii < values.size(); ii++) {
+			data[ii] = convert(values[ii]);
+		}
+	}
+	catch (...) {
+		Py_DECREF(bytes);
+		throw;
+	}
+	return bytes;
+}
+
+template<class S, class F>
+PyObject* packMasses(const std::vector<S>& values, MassFormat format, F mass) {
+	switch (format) {
+		case MassFormat::float64:
+			return packValues<double>(values, [&](const S& value) { return mass(value); });
+		case MassFormat::float32:
+			return packValues<float>(values, [&](const S& value) { return (float) mass(value); });
+		case MassFormat::fixed:
+			return packValues<int32_t>(values, [&](const S& value) {
+				double scaled = std::round(mass(value) * FIXED_POINT_SCALE);
+				if (!(scaled >= (double) std::numeric_limits<int32_t>::min()
+						&& scaled <= (double) std::numeric_limits<int32_t>::max())) {
+					throw std::overflow_error(
+						"m/z out of range of the fixed-point mass format: " + std::to_string(mass(value)));
+				}
+				return (int32_t) scaled;
+			});
+	}
+	throw std::logic_error("Invalid mass format: " + std::to_string((int) format));
+}
+
+PyObject* ionMassesToBytes(const Ions& ions, MassFormat format) {
+	return packMasses(ions, format, [](const Ion& ion) { return ion.mass; });
+}
+
+PyObject* massesToBytes(const std::vector<double>& masses, MassFormat format) {
+	return packMasses(masses, format, [](double mass) { return mass; });
+}
+
+PyObject* ionPositionsToBytes(const Ions& ions) {
+	return packValues<int32_t>(ions, [](const Ion& ion) { return (int32_t) ion.position; });
+}
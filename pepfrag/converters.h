@@ -2,19 +2,27 @@
 #define _PEPFRAG_CONVERTERS_H
 
 #include <Python.h>
+#include <stdexcept>
 #include <string>
 #include <utility>
 #include <vector>
 #include <map>
 
 #include "ion.h"
+#include "ionconfig.h"
 #include "mass.h"
+#include "stats.h"
 
 std::vector<double> listToDoubleVector(PyObject* source);
 
-std::vector<std::string> listToStringVector(PyObject* source);
+/*
+ * Converts source into target, reusing target's storage. source may be a
+ * sequence of numbers, or any object exposing a contiguous float64 buffer,
+ * such as a NumPy array, which is copied without per-element conversion.
+ */
+void listToDoubleVector(PyObject* source, std::vector<double>& target);
 
-using IonTypeMap = std::vector<std::pair<IonType, std::vector<std::pair<std::string, double>>>>;
+std::vector<std::string> listToStringVector(PyObject* source);
 
 IonTypeMap dictToIonTypeMap(PyObject* source);
 
@@ -24,32 +32,85 @@ std::map<long, double> modSiteListToMap(PyObject* source, size_t seqLen);
 
 template<class T>
 PyObject* vectorToList(const std::vector<T>& data, PyObject*(*convert)(T)) {
+        PEPFRAG_TIME(vectorToList);
         long size = (long) data.size();
         PyObject* listObj = PyList_New(size);
+        if (listObj == NULL) return NULL;
         for (long ii = 0; ii < size; ii++) {
-                PyList_SET_ITEM(listObj, ii, convert(data[ii]));
+                PyObject* item = convert(data[ii]);
+                if (item == NULL) {
+                        Py_DECREF(listObj);
+                        return NULL;
+                }
+                PyList_SET_ITEM(listObj, ii, item);
         }
         return listObj;
 }
 
 template<class T>
 PyObject* vectorToList(const std::vector<T>& data, PyObject*(*convert)(const T&)) {
+        PEPFRAG_TIME(vectorToList);
         long size = (long) data.size();
         PyObject* listObj = PyList_New(size);
+        if (listObj == NULL) return NULL;
         for (long ii = 0; ii < size; ii++) {
-                PyList_SET_ITEM(listObj, ii, convert(data[ii]));
+                PyObject* item = convert(data[ii]);
+                if (item == NULL) {
+                        Py_DECREF(listObj);
+                        return NULL;
+                }
+                PyList_SET_ITEM(listObj, ii, item);
         }
         return listObj;
 }
 
 template<class T>
 PyObject* vectorToList(const std::vector<T>& data) {
+        PEPFRAG_TIME(vectorToList);
         long size = (long) data.size();
         PyObject* listObj = PyList_New(size);
+        if (listObj == NULL) return NULL;
         for (long ii = 0; ii < size; ii++) {
                 PyList_SET_ITEM(listObj, ii, (PyObject*) data[ii]);
         }
         return listObj;
 }
 
+/*
+ * Converts the ion to a (mass, label, position) tuple.
+ */
+PyObject* ionToTuple(const Ion& ion);
+
+/*
+ * Packs the masses of ions into a bytes object of native-endian values in the
+ * given format. Throws std::overflow_error for m/z values which do not fit
+ * the fixed-point format.
+ */
+PyObject* ionMassesToBytes(const Ions& ions, MassFormat format);
+
+/*
+ * Packs the positions of ions into a bytes object of native-endian 32-bit
+ * integers.
+ */
+PyObject* ionPositionsToBytes(const Ions& ions);
+
+/*
+ * Packs the masses into a bytes object as ionMassesToBytes.
+ */
+PyObject* massesToBytes(const std::vector<double>& masses, MassFormat format);
+
+/*
+ * Packs the values into a bytes object of their native-endian
+ * representation.
+ */
+template<class T>
+PyObject* vectorToBytes(const std::vector<T>& data) {
+	PyObject* bytes = PyBytes_FromStringAndSize(
+		reinterpret_cast<const char*>(data.data()), (Py_ssize_t) (data.size() * sizeof(T)));
+	if (bytes == NULL) {
+		throw std::runtime_error("Failed to allocate bytes object");
+	}
+	return bytes;
+}
+
 #endif // _PEPFRAG_CONVERTERS_H
@@ -4,110 +4,387 @@
 #include <unordered_map>
 #include <vector>
 
+#include "arguments.h"
+#include "capi.h"
 #include "cpepfrag.h"
 #include "converters.h"
+#include "fragmentkernel.h"
+#include "ionconfig.h"
 #include "iongenerator.h"
 #include "ion.h"
 #include "mass.h"
+#include "peptide.h"
+#include "stats.h"
+#include "tracing.h"
+#include "workspace.h"
 
-Ions generateIons(
-	IonType type,
-	const std::vector<double>& masses,
+FastcallParameters generateIonsParameters(
+	"generate_ions",
+	{"ion_types", "precursor_mass", "seq_masses", "b_masses", "y_masses", "charge", "radical", "sequence"},
+	8);
+
+FastcallParameters generateIonMassesParameters(
+	"generate_ion_masses",
+	{"ion_types", "precursor_mass", "seq_masses", "b_masses", "y_masses", "charge", "radical", "sequence",
+	 "mass_format"},
+	9);
+
+FastcallParameters calculateMassParameters("calculate_mass", {"sequence", "mod_sites", "mass_type"}, 3);
+
+/*
+ * The arguments common to generate_ions and generate_ion_masses.
+ */
+struct GenerationArguments {
+	// Either a dict of ion types to neutral losses or the handle of a
+	// registered configuration
+	PyObject* ionTypes;
+	double precMass;
+	PyObject* seqMasses;
+	PyObject* bMasses;
+	PyObject* yMasses;
+	long charge;
+	bool radical;
+	const char* sequence;
+};
+
+/*
+ * Converts the first eight parsed arguments, returning false with a Python
+ * exception set on failure.
+ */
+bool convertGenerationArguments(PyObject* const* values, GenerationArguments& args) {
+	args.ionTypes = values[0];
+	args.seqMasses = values[2];
+	args.bMasses = values[3];
+	args.yMasses = values[4];
+	return argumentToDouble(values[1], args.precMass)
+		&& argumentToLong(values[5], args.charge)
+		&& argumentToBool(values[6], args.radical)
+		&& argumentToString(values[7], "sequence", args.sequence);
+}
+
+void generateIons(
+	PyObject* ionTypes,
 	long charge,
-	const std::vector<NeutralLossPair>& neutralLosses,
 	bool radical,
-	const std::string& sequence)
+	const IonGenerationOptions& options,
+	Workspace& workspace)
+{
+	PEPFRAG_COUNT(peptides);
+
+	if (PyLong_CheckExact(ionTypes) || PyLong_Check(ionTypes)) {
+		PEPFRAG_COUNT(registeredConfigs);
+		generateConfigIons(getIonConfig(PyLong_AsLong(ionTypes)), charge, radical, options, workspace);
+	}
+	else {
+		IonTypeMap ionTypeMap;
+		{
+			PEPFRAG_TRACE_SPAN("convert ion types");
+			ionTypeMap = dictToIonTypeMap(ionTypes);
+		}
+		PEPFRAG_COUNT(convertedConfigs);
+		generateConfigIons(makeIonConfig(ionTypeMap), charge, radical, options, workspace);
+	}
+}
+
+/*
+ * Converts the mass lists into the workspace and generates the ions into
+ * workspace.ions.
+ */
+void generateIonsFromPython(
+	const GenerationArguments& args,
+	const IonGenerationOptions& options,
+	Workspace& workspace)
 {
-	IonGeneratorPtr generator = IonGenerator::create(type);
-	return generator->generate(masses, charge, neutralLosses, radical, sequence);
+	{
+		PEPFRAG_TRACE_SPAN("convert input");
+		workspace.sequence.assign(args.sequence);
+
+		listToDoubleVector(args.seqMasses, workspace.seqMasses);
+		listToDoubleVector(args.bMasses, workspace.bMasses);
+		listToDoubleVector(args.yMasses, workspace.yMasses);
+		workspace.precMasses.assign(1, args.precMass);
+	}
+
+	generateIons(args.ionTypes, args.charge, args.radical, options, workspace);
 }
 
-PyObject* python_generateIons(PyObject* module, PyObject* args) {
-	PyObject *ionTypes, *pySeqMasses, *bMassList, *yMassList, *pySequence;
-	double precMass;
-	long charge;
-	int radical;
-	
+PyObject* python_generateIons(PyObject* module, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames) {
+	PEPFRAG_COUNT(generateIonsCalls);
+	PEPFRAG_TRACE_SPAN("generate_ions");
+
+	PyObject* values[8];
+	GenerationArguments arguments;
+	if (!generateIonsParameters.parse(args, nargs, kwnames, values)
+			|| !convertGenerationArguments(values, arguments)) return NULL;
+
 	try {
-		if (!PyArg_ParseTuple(args, "OdOOOliO", &ionTypes, &precMass, &pySeqMasses, &bMassList,
-				      &yMassList, &charge, &radical, &pySequence)) return NULL;
-
-        IonTypeMap ionConfigs = dictToIonTypeMap(ionTypes);
-
-        std::string sequence = PyUnicode_AsUTF8(pySequence);
-
-        std::vector<double> seqMasses = listToDoubleVector(pySeqMasses);
-        std::vector<double> bMasses = listToDoubleVector(bMassList);
-        std::vector<double> yMasses = listToDoubleVector(yMassList);
-        std::vector<double> precMasses = std::vector<double>{ precMass };
-
-        Ions ions;
-        ions.reserve(1000);
-        const std::vector<double>* massList;
-        for (const auto& pair : ionConfigs) {
-            switch (pair.first) {
-                case IonType::b:
-                case IonType::a:
-                case IonType::c:
-                    massList = &bMasses;
-                    break;
-                case IonType::y:
-                case IonType::z:
-                case IonType::x:
-                    massList = &yMasses;
-                    break;
-                case IonType::immonium:
-                    massList = &seqMasses;
-                    break;
-                case IonType::precursor:
-                    massList = &precMasses;
-                    break;
-                default:
-                    PyErr_SetString(PyExc_RuntimeError, "Invalid ion type specified");
-                    return NULL;
-            }
-
-            mergeIonVectors(ions, generateIons(pair.first, *massList, charge, pair.second,
-                                               (bool) radical, sequence));
-        }
-
-        return vectorToList<Ion>(ions);
-    }
-    catch (const std::exception& ex) {
-        PyErr_SetString(PyExc_RuntimeError, ex.what());
-        return NULL;
-    }
-}
-
-PyObject* python_calculateMass(PyObject* module, PyObject* args) {
-	PyObject *sequence, *modSites, *massType;
+		WorkspaceLease workspace;
+		generateIonsFromPython(arguments, IonGenerationOptions(), *workspace);
 
+		PEPFRAG_TRACE_SPAN("convert output");
+		return vectorToList(workspace->ions, &ionToTuple);
+	}
+	catch (const std::exception& ex) {
+		PyErr_SetString(PyExc_RuntimeError, ex.what());
+		return NULL;
+	}
+}
+
+PyObject* python_generateIonMasses(PyObject* module, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames) {
+	PEPFRAG_COUNT(generateIonMassesCalls);
+	PEPFRAG_TRACE_SPAN("generate_ion_masses");
+
+	PyObject* values[9];
+	GenerationArguments arguments;
+	MassFormat massFormat;
+	if (!generateIonMassesParameters.parse(args, nargs, kwnames, values)
+			|| !convertGenerationArguments(values, arguments)
+			|| !argumentToMassFormat(values[8], massFormat)) return NULL;
+
+	// The result owns each buffer once set, so that an exception part way
+	// releases those already packed
+	PyObject* result = NULL;
 	try {
-        if (!PyArg_UnpackTuple(args, "calculateMass", 3, 3, &sequence, &modSites, &massType)) return NULL;
+		IonGenerationOptions options;
+		options.labels = false;
 
-        std::string seq = PyUnicode_AsUTF8(sequence);
+		WorkspaceLease workspace;
+		generateIonsFromPython(arguments, options, *workspace);
 
-        return vectorToList(calculateMass(
-            seq,
-            modSiteListToMap(modSites, seq.size()),
-            PyLong_AsLong(massType)
-        ), &PyFloat_FromDouble);
+		PEPFRAG_TRACE_SPAN("convert output");
+		result = PyTuple_New(2);
+		if (result == NULL) return NULL;
+		PyTuple_SET_ITEM(result, 0, ionMassesToBytes(workspace->ions, massFormat));
+		PyTuple_SET_ITEM(result, 1, ionPositionsToBytes(workspace->ions));
+		return result;
+	}
+	catch (const std::overflow_error& ex) {
+		Py_XDECREF(result);
+		PyErr_SetString(PyExc_OverflowError, ex.what());
+		return NULL;
+	}
+	catch (const std::exception& ex) {
+		Py_XDECREF(result);
+		PyErr_SetString(PyExc_RuntimeError, ex.what());
+		return NULL;
+	}
+}
+
+PyObject* python_registerIonTypes(PyObject* module, PyObject* ionTypes) {
+	PEPFRAG_COUNT(registerIonTypesCalls);
+
+	try {
+		return PyLong_FromLong(registerIonConfig(dictToIonTypeMap(ionTypes)));
+	}
+	catch (const std::exception& ex) {
+		PyErr_SetString(PyExc_RuntimeError, ex.what());
+		return NULL;
+	}
+}
+
+PyObject* python_calculateMass(PyObject* module, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames) {
+	PEPFRAG_COUNT(calculateMassCalls);
+	PEPFRAG_TRACE_SPAN("calculate_mass");
+
+	PyObject* values[3];
+	const char* sequence;
+	long massType;
+	if (!calculateMassParameters.parse(args, nargs, kwnames, values)
+			|| !argumentToString(values[0], "sequence", sequence)
+			|| !argumentToLong(values[2], massType)) return NULL;
+
+	try {
+		std::string seq = sequence;
+
+		return vectorToList(calculateMass(
+			seq,
+			modSiteListToMap(values[1], seq.size()),
+			massType
+		), &PyFloat_FromDouble);
 	}
 	catch (const std::out_of_range& ex) {
-	    PyErr_SetString(PyExc_KeyError, ex.what());
+		PyErr_SetString(PyExc_KeyError, ex.what());
 	}
 	catch (const std::exception& ex) {
-	    PyErr_SetString(PyExc_RuntimeError, ex.what());
+		PyErr_SetString(PyExc_RuntimeError, ex.what());
 	}
 
 	return NULL;
-};
+}
+
+PyObject* python_workspaceStats(PyObject* module, PyObject* args) {
+	WorkspaceStats stats = workspaceStats();
+	return Py_BuildValue(
+		"{s:K,s:K,s:K,s:K}",
+		"acquisitions", stats.acquisitions,
+		"fallbacks", stats.fallbacks,
+		"allocations", stats.allocations,
+		"bytes_allocated", stats.bytesAllocated);
+}
+
+PyObject* python_resetWorkspaceStats(PyObject* module, PyObject* args) {
+	resetWorkspaceStats();
+	Py_RETURN_NONE;
+}
+
+/*
+ * Sets key to value in dict, stealing the reference to value.
+ */
+void setDictItem(PyObject* dict, const char* key, PyObject* value) {
+	PyDict_SetItemString(dict, key, value);
+	Py_DECREF(value);
+}
+
+PyObject* python_stats(PyObject* module, PyObject* args) {
+	PyObject* result = PyDict_New();
+	setDictItem(result, "enabled", PyBool_FromLong(statsEnabled()));
+	setDictItem(result, "workspace", python_workspaceStats(module, NULL));
+
+	if (!statsEnabled()) {
+		return result;
+	}
+
+	Stats snapshot = stats();
+	auto counter = [&snapshot](StatCounter c) { return snapshot.counters[(size_t) c]; };
+	auto timer = [&snapshot](StatTimer t) { return snapshot.timers[(size_t) t]; };
+
+	setDictItem(result, "calls", Py_BuildValue(
+		"{s:K,s:K,s:K,s:K}",
+		"generate_ions", counter(StatCounter::generateIonsCalls),
+		"generate_ion_masses", counter(StatCounter::generateIonMassesCalls),
+		"calculate_mass", counter(StatCounter::calculateMassCalls),
+		"register_ion_types", counter(StatCounter::registerIonTypesCalls)));
+
+	setDictItem(result, "peptides", PyLong_FromUnsignedLongLong(counter(StatCounter::peptides)));
+
+	// Keyed by IonType value
+	PyObject* ions = PyDict_New();
+	for (size_t ii = 1; ii <= MAX_ION_TYPE; ii++) {
+		PyObject* key = PyLong_FromSize_t(ii);
+		PyObject* value = PyLong_FromUnsignedLongLong(snapshot.ions[ii]);
+		PyDict_SetItem(ions, key, value);
+		Py_DECREF(key);
+		Py_DECREF(value);
+	}
+	setDictItem(result, "ions", ions);
+
+	setDictItem(result, "time_ns", Py_BuildValue(
+		"{s:K,s:K,s:K,s:K,s:K}",
+		"dict_to_ion_type_map", timer(StatTimer::dictToIonTypeMap),
+		"list_to_double_vector", timer(StatTimer::listToDoubleVector),
+		"vector_to_list", timer(StatTimer::vectorToList),
+		"generation", timer(StatTimer::generation),
+		"merge", timer(StatTimer::merge)));
+
+	setDictItem(result, "label_cache", Py_BuildValue(
+		"{s:K,s:K}",
+		"hits", counter(StatCounter::labelCacheHits),
+		"misses", counter(StatCounter::labelCacheMisses)));
+
+	setDictItem(result, "ion_configs", Py_BuildValue(
+		"{s:K,s:K}",
+		"registered", counter(StatCounter::registeredConfigs),
+		"converted", counter(StatCounter::convertedConfigs)));
+
+	return result;
+}
+
+PyObject* python_resetStats(PyObject* module, PyObject* args) {
+	resetStats();
+	resetWorkspaceStats();
+	Py_RETURN_NONE;
+}
+
+PyObject* python_startTracing(PyObject* module, PyObject* args, PyObject* kwargs) {
+	static const char* keywords[] = {"buffer_size", NULL};
+	Py_ssize_t bufferSize = 65536;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|n", (char**) keywords, &bufferSize)) return NULL;
+	if (bufferSize < 1) {
+		PyErr_SetString(PyExc_ValueError, "buffer_size must be positive");
+		return NULL;
+	}
+	startTracing((size_t) bufferSize);
+	Py_RETURN_NONE;
+}
+
+PyObject* python_stopTracing(PyObject* module, PyObject* args) {
+	stopTracing();
+	Py_RETURN_NONE;
+}
+
+PyObject* python_traceJson(PyObject* module, PyObject* args) {
+	try {
+		std::string json = traceJson();
+		return PyUnicode_FromStringAndSize(json.data(), (Py_ssize_t) json.size());
+	}
+	catch (const std::exception& ex) {
+		PyErr_SetString(PyExc_RuntimeError, ex.what());
+		return NULL;
+	}
+}
+
+const KernelIsa KERNEL_ISAS[] = {KernelIsa::scalar, KernelIsa::sse2, KernelIsa::avx2, KernelIsa::avx512};
+
+PyObject* python_kernelIsas(PyObject* module, PyObject* args) {
+	PyObject* result = PyList_New(0);
+	if (result == NULL) return NULL;
+	for (KernelIsa isa : KERNEL_ISAS) {
+		if (!kernelIsaSupported(isa)) continue;
+		PyObject* name = PyUnicode_FromString(kernelIsaName(isa));
+		if (name == NULL || PyList_Append(result, name) < 0) {
+			Py_XDECREF(name);
+			Py_DECREF(result);
+			return NULL;
+		}
+		Py_DECREF(name);
+	}
+	return result;
+}
+
+PyObject* python_setKernelIsa(PyObject* module, PyObject* arg) {
+	const char* name;
+	if (!argumentToString(arg, "isa", name)) return NULL;
+	const char* previous = kernelIsaName(activeKernelIsa());
+	for (KernelIsa isa : KERNEL_ISAS) {
+		if (std::string(kernelIsaName(isa)) == name && setKernelIsa(isa)) {
+			return PyUnicode_FromString(previous);
+		}
+	}
+	PyErr_Format(PyExc_ValueError, "Unsupported kernel instruction set: %s", name);
+	return NULL;
+}
 
 // Boilerplate code for C++ extension
 
 static PyMethodDef cpepfrag_methods[] = {
-	{"generate_ions", python_generateIons, METH_VARARGS, "Fragment ion generation."},
-	{"calculate_mass", python_calculateMass, METH_VARARGS, "Peptide mass calculation"},
+	{"generate_ions", (PyCFunction) (void(*)(void)) python_generateIons, METH_FASTCALL | METH_KEYWORDS,
+	 "Fragment ion generation."},
+	{"generate_ion_masses", (PyCFunction) (void(*)(void)) python_generateIonMasses, METH_FASTCALL | METH_KEYWORDS,
+	 "Fragment ion generation, returning packed masses and positions without labels."},
+	{"calculate_mass", (PyCFunction) (void(*)(void)) python_calculateMass, METH_FASTCALL | METH_KEYWORDS,
+	 "Peptide mass calculation"},
+	{"fragment_peptides", (PyCFunction) (void(*)(void)) python_fragmentPeptides, METH_FASTCALL | METH_KEYWORDS,
+	 "Fragment ion generation for a sequence of peptides."},
+	{"register_ion_types", python_registerIonTypes, METH_O,
+	 "Register an ion type configuration, returning a handle for use with generate_ions."},
+	{"workspace_stats", python_workspaceStats, METH_NOARGS,
+	 "Allocation counters for the ion generation workspaces."},
+	{"reset_workspace_stats", python_resetWorkspaceStats, METH_NOARGS,
+	 "Reset the ion generation workspace allocation counters."},
+	{"stats", python_stats, METH_NOARGS,
+	 "Runtime instrumentation counters, populated when built with PEPFRAG_STATS."},
+	{"reset_stats", python_resetStats, METH_NOARGS,
+	 "Reset the runtime instrumentation and workspace allocation counters."},
+	{"start_tracing", (PyCFunction) (void(*)(void)) python_startTracing, METH_VARARGS | METH_KEYWORDS,
+	 "Start recording trace spans, keeping up to buffer_size spans per thread."},
+	{"stop_tracing", python_stopTracing, METH_NOARGS, "Stop recording trace spans."},
+	{"trace_json", python_traceJson, METH_NOARGS,
+	 "The recorded trace spans of all threads, as Chrome trace event JSON. Those of exited "
+	 "threads are only included in the first export."},
+	{"kernel_isas", python_kernelIsas, METH_NOARGS,
+	 "The names of the instruction sets of the fragment mass kernel supported by the CPU."},
+	{"set_kernel_isa", python_setKernelIsa, METH_O,
+	 "Select the fragment mass kernel instruction set by name, returning the name of the previous one."},
 	{NULL, NULL, 0, NULL} /* SENTINEL */
 };
 
@@ -122,5 +399,27 @@ static struct PyModuleDef cpepfragExt = {
 };
 
 PyMODINIT_FUNC PyInit_cpepfrag(void) {
-	return PyModule_Create(&cpepfragExt);
+	if (!generateIonsParameters.intern()
+			|| !generateIonMassesParameters.intern()
+			|| !calculateMassParameters.intern()
+			|| !initPeptideType()) return NULL;
+
+	PyObject* module = PyModule_Create(&cpepfragExt);
+	if (module == NULL) return NULL;
+
+	PyObject* capsule = createCApiCapsule();
+	if (capsule == NULL || PyModule_AddObject(module, "_C_API", capsule) < 0) {
+		Py_XDECREF(capsule);
+		Py_DECREF(module);
+		return NULL;
+	}
+
+	Py_INCREF(&PeptideBaseType);
+	if (PyModule_AddObject(module, "PeptideBase", (PyObject*) &PeptideBaseType) < 0) {
+		Py_DECREF(&PeptideBaseType);
+		Py_DECREF(module);
+		return NULL;
+	}
+
+	return module;
 }
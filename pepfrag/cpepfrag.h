@@ -3,8 +3,23 @@
 
 #include <Python.h>
 
+#include "iongenerator.h"
+#include "workspace.h"
+
+/*
+ * Generates the ions of the peptide whose masses and sequence are in the
+ * workspace into workspace.ions. ionTypes is either a dict of ion types to
+ * neutral losses or the handle of a registered configuration.
+ */
+void generateIons(
+	PyObject* ionTypes,
+	long charge,
+	bool radical,
+	const IonGenerationOptions& options,
+	Workspace& workspace);
+
 extern "C" {
 	PyMODINIT_FUNC PyInit_cpepfrag(void);
 }
 
-#endif // _PEPFRAG_CPEPFRAG_H
\ No newline at end of file
+#endif // _PEPFRAG_CPEPFRAG_H
@@ -0,0 +1,90 @@
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "fragment.h"
+
+void calculateIonMasses(
+	const std::vector<double>& peptideMasses,
+	double& precursorMass,
+	std::vector<double>& seqMasses,
+	std::vector<double>& bMasses,
+	std::vector<double>& yMasses)
+{
+	// The operations follow Peptide.mass and Peptide._ion_masses, so that the
+	// results are identical to those of the Python API
+	const double water = FIXED_MASSES.at("H2O");
+	size_t seqLen = peptideMasses.size() - 2;
+
+	double mass = 0.;
+	for (double m : peptideMasses) {
+		mass += m;
+	}
+	precursorMass = mass + water;
+
+	seqMasses.assign(peptideMasses.begin() + 1, peptideMasses.end() - 1);
+
+	bMasses.resize(seqLen);
+	yMasses.resize(seqLen);
+	double bBase = peptideMasses.front();
+	double yBase = water + peptideMasses.back();
+	for (size_t ii = 0; ii < seqLen; ii++) {
+		bBase += peptideMasses[ii + 1];
+		bMasses[ii] = bBase;
+		yBase += peptideMasses[seqLen - ii];
+		yMasses[ii] = yBase;
+	}
+}
+
+void setPeptideMasses(const std::vector<double>& peptideMasses, Workspace& workspace) {
+	double precursorMass;
+	calculateIonMasses(
+		peptideMasses, precursorMass, workspace.seqMasses, workspace.bMasses, workspace.yMasses);
+	workspace.precMasses.assign(1, precursorMass);
+}
+
+void fragmentPeptide(
+	const std::string& sequence,
+	const std::map<long, double>& modSiteMasses,
+	long charge,
+	const IonConfig& config,
+	bool radical,
+	long massType,
+	const IonGenerationOptions& options,
+	Workspace& workspace)
+{
+	workspace.sequence.assign(sequence);
+	setPeptideMasses(calculateMass(sequence, modSiteMasses, massType), workspace);
+	generateConfigIons(config, charge, radical, options, workspace);
+}
+
+void fragmentPeptideCharges(
+	const std::string& sequence,
+	const std::map<long, double>& modSiteMasses,
+	long maxCharge,
+	const IonConfig& config,
+	bool radical,
+	long massType,
+	const IonGenerationOptions& options,
+	Workspace& workspace)
+{
+	workspace.sequence.assign(sequence);
+	setPeptideMasses(calculateMass(sequence, modSiteMasses, massType), workspace);
+	generateChargeStates(config, maxCharge, radical, options, workspace);
+}
+
+Ions fragmentPeptide(
+	const std::string& sequence,
+	const std::map<long, double>& modSiteMasses,
+	long charge,
+	const IonTypeMap& ionTypes,
+	bool radical,
+	long massType)
+{
+	Workspace workspace;
+	fragmentPeptide(
+		sequence, modSiteMasses, charge, makeIonConfig(ionTypes), radical, massType,
+		IonGenerationOptions(), workspace);
+	return std::move(workspace.ions);
+}
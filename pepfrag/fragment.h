@@ -0,0 +1,94 @@
+#ifndef _PEPFRAG_FRAGMENT_H
+#define _PEPFRAG_FRAGMENT_H
+
+/*
+ * The native C++ API for peptide fragmentation. This, and the headers it
+ * includes, are independent of CPython and are built as the pepfrag_core
+ * library.
+ *
+ * For example:
+ *
+ *     IonConfig config = makeIonConfig({
+ *         {IonType::b, {{"H2O", FIXED_MASSES.at("H2O")}}},
+ *         {IonType::y, {}}
+ *     });
+ *     Workspace workspace;
+ *     fragmentPeptide("ACDEFGHIK", {{3, 57.021464}}, 2, config, false, 0,
+ *                     IonGenerationOptions(), workspace);
+ *     // The ions are now in workspace.ions
+ */
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ion.h"
+#include "ionconfig.h"
+#include "iongenerator.h"
+#include "mass.h"
+#include "workspace.h"
+
+/*
+ * Calculates the precursor mass and the residue, b and y mass lists used for
+ * ion generation from peptideMasses, the per-position masses returned by
+ * calculateMass.
+ */
+void calculateIonMasses(
+	const std::vector<double>& peptideMasses,
+	double& precursorMass,
+	std::vector<double>& seqMasses,
+	std::vector<double>& bMasses,
+	std::vector<double>& yMasses);
+
+/*
+ * Sets the precursor, residue, b and y mass lists of the workspace from
+ * peptideMasses, the per-position masses returned by calculateMass.
+ */
+void setPeptideMasses(const std::vector<double>& peptideMasses, Workspace& workspace);
+
+/*
+ * Generates the fragment ions of the peptide into workspace.ions.
+ *
+ * modSiteMasses maps sequence positions (1-based, with 0 for the N-terminus
+ * and sequence.size() + 1 for the C-terminus) to modification masses, and
+ * massType is 0 for monoisotopic or 1 for average masses.
+ */
+void fragmentPeptide(
+	const std::string& sequence,
+	const std::map<long, double>& modSiteMasses,
+	long charge,
+	const IonConfig& config,
+	bool radical,
+	long massType,
+	const IonGenerationOptions& options,
+	Workspace& workspace);
+
+/*
+ * Generates the fragment ions of the peptide at each charge state from 1 to
+ * maxCharge, e.g. for a precursor of unknown charge. The ions are generated
+ * once, at maxCharge, and workspace.chargeStateIons[z - 1] then points to
+ * the ions, in workspace.typeIons, that fragmentPeptide would give at charge
+ * z, in the same order.
+ */
+void fragmentPeptideCharges(
+	const std::string& sequence,
+	const std::map<long, double>& modSiteMasses,
+	long maxCharge,
+	const IonConfig& config,
+	bool radical,
+	long massType,
+	const IonGenerationOptions& options,
+	Workspace& workspace);
+
+/*
+ * Returns the fragment ions of the peptide, using a temporary workspace.
+ */
+Ions fragmentPeptide(
+	const std::string& sequence,
+	const std::map<long, double>& modSiteMasses,
+	long charge,
+	const IonTypeMap& ionTypes,
+	bool radical = false,
+	long massType = 0);
+
+#endif // _PEPFRAG_FRAGMENT_H
@@ -0,0 +1,284 @@
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+#include "fragmentkernel.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PEPFRAG_KERNEL_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang only permit intrinsics for instruction sets enabled for the
+// enclosing function, whereas MSVC permits them anywhere
+#if defined(__GNUC__)
+#define PEPFRAG_TARGET(isa) __attribute__((target(isa)))
+#else
+#define PEPFRAG_TARGET(isa)
+#endif
+
+using KernelFunction = void(*)(
+	const double*, size_t, double, double, const double*, size_t, const double*, const double*, long, double*);
+
+/*
+ * Each implementation below computes, for every position in the ladder, the
+ * base mass and each delta row, and writes each of these at every charge
+ * state. The arithmetic mirrors the scalar expressions exactly, so that all
+ * implementations produce identical results.
+ */
+
+void fillScalar(
+	const double* ladder,
+	size_t begin,
+	size_t n,
+	double firstOffset,
+	double secondOffset,
+	const double* deltas,
+	size_t nDeltas,
+	const double* hMasses,
+	const double* charges,
+	long maxCharge,
+	double* out)
+{
+	size_t nRows = nDeltas + 1;
+	for (size_t ii = begin; ii < n; ii++) {
+		double base = (ladder[ii] + firstOffset) + secondOffset;
+		for (size_t row = 0; row < nRows; row++) {
+			double mass = row == 0 ? base : base - deltas[row - 1];
+			out[row * n + ii] = mass;
+			for (long cs = 1; cs < maxCharge; cs++) {
+				out[(cs * nRows + row) * n + ii] = (mass + hMasses[cs]) / charges[cs];
+			}
+		}
+	}
+}
+
+void kernelScalar(
+	const double* ladder, size_t n, double firstOffset, double secondOffset,
+	const double* deltas, size_t nDeltas, const double* hMasses, const double* charges,
+	long maxCharge, double* out)
+{
+	fillScalar(ladder, 0, n, firstOffset, secondOffset, deltas, nDeltas, hMasses, charges, maxCharge, out);
+}
+
+#ifdef PEPFRAG_KERNEL_X86
+
+PEPFRAG_TARGET("sse2")
+void kernelSse2(
+	const double* ladder, size_t n, double firstOffset, double secondOffset,
+	const double* deltas, size_t nDeltas, const double* hMasses, const double* charges,
+	long maxCharge, double* out)
+{
+	size_t nRows = nDeltas + 1;
+	__m128d vFirst = _mm_set1_pd(firstOffset);
+	__m128d vSecond = _mm_set1_pd(secondOffset);
+	size_t ii = 0;
+	for (; ii + 2 <= n; ii += 2) {
+		__m128d base = _mm_add_pd(_mm_add_pd(_mm_loadu_pd(ladder + ii), vFirst), vSecond);
+		for (size_t row = 0; row < nRows; row++) {
+			__m128d mass = row == 0 ? base : _mm_sub_pd(base, _mm_set1_pd(deltas[row - 1]));
+			_mm_storeu_pd(out + row * n + ii, mass);
+			for (long cs = 1; cs < maxCharge; cs++) {
+				_mm_storeu_pd(
+					out + (cs * nRows + row) * n + ii,
+					_mm_div_pd(_mm_add_pd(mass, _mm_set1_pd(hMasses[cs])), _mm_set1_pd(charges[cs])));
+			}
+		}
+	}
+	fillScalar(ladder, ii, n, firstOffset, secondOffset, deltas, nDeltas, hMasses, charges, maxCharge, out);
+}
+
+PEPFRAG_TARGET("avx2")
+void kernelAvx2(
+	const double* ladder, size_t n, double firstOffset, double secondOffset,
+	const double* deltas, size_t nDeltas, const double* hMasses, const double* charges,
+	long maxCharge, double* out)
+{
+	size_t nRows = nDeltas + 1;
+	__m256d vFirst = _mm256_set1_pd(firstOffset);
+	__m256d vSecond = _mm256_set1_pd(secondOffset);
+	size_t ii = 0;
+	for (; ii + 4 <= n; ii += 4) {
+		__m256d base = _mm256_add_pd(_mm256_add_pd(_mm256_loadu_pd(ladder + ii), vFirst), vSecond);
+		for (size_t row = 0; row < nRows; row++) {
+			__m256d mass = row == 0 ? base : _mm256_sub_pd(base, _mm256_set1_pd(deltas[row - 1]));
+			_mm256_storeu_pd(out + row * n + ii, mass);
+			for (long cs = 1; cs < maxCharge; cs++) {
+				_mm256_storeu_pd(
+					out + (cs * nRows + row) * n + ii,
+					_mm256_div_pd(_mm256_add_pd(mass, _mm256_set1_pd(hMasses[cs])), _mm256_set1_pd(charges[cs])));
+			}
+		}
+	}
+	fillScalar(ladder, ii, n, firstOffset, secondOffset, deltas, nDeltas, hMasses, charges, maxCharge, out);
+}
+
+PEPFRAG_TARGET("avx512f")
+void kernelAvx512(
+	const double* ladder, size_t n, double firstOffset, double secondOffset,
+	const double* deltas, size_t nDeltas, const double* hMasses, const double* charges,
+	long maxCharge, double* out)
+{
+	size_t nRows = nDeltas + 1;
+	__m512d vFirst = _mm512_set1_pd(firstOffset);
+	__m512d vSecond = _mm512_set1_pd(secondOffset);
+	size_t ii = 0;
+	for (; ii + 8 <= n; ii += 8) {
+		__m512d base = _mm512_add_pd(_mm512_add_pd(_mm512_loadu_pd(ladder + ii), vFirst), vSecond);
+		for (size_t row = 0; row < nRows; row++) {
+			__m512d mass = row == 0 ? base : _mm512_sub_pd(base, _mm512_set1_pd(deltas[row - 1]));
+			_mm512_storeu_pd(out + row * n + ii, mass);
+			for (long cs = 1; cs < maxCharge; cs++) {
+				_mm512_storeu_pd(
+					out + (cs * nRows + row) * n + ii,
+					_mm512_div_pd(_mm512_add_pd(mass, _mm512_set1_pd(hMasses[cs])), _mm512_set1_pd(charges[cs])));
+			}
+		}
+	}
+	fillScalar(ladder, ii, n, firstOffset, secondOffset, deltas, nDeltas, hMasses, charges, maxCharge, out);
+}
+
+#if defined(_MSC_VER)
+bool cpuSupports(KernelIsa isa) {
+	int info[4];
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+	int leaf7Ebx = 0;
+	if (maxLeaf >= 7) {
+		__cpuidex(info, 7, 0);
+		leaf7Ebx = info[1];
+	}
+	switch (isa) {
+		case KernelIsa::scalar:
+		case KernelIsa::sse2:
+			return true;
+		case KernelIsa::avx2:
+			return avx && (xcr0 & 0x6) == 0x6 && (leaf7Ebx & (1 << 5)) != 0;
+		case KernelIsa::avx512:
+			return (xcr0 & 0xe6) == 0xe6 && (leaf7Ebx & (1 << 16)) != 0;
+	}
+	return false;
+}
+#else
+bool cpuSupports(KernelIsa isa) {
+	__builtin_cpu_init();
+	switch (isa) {
+		case KernelIsa::scalar:
+			return true;
+		case KernelIsa::sse2:
+			return __builtin_cpu_supports("sse2");
+		case KernelIsa::avx2:
+			return __builtin_cpu_supports("avx2");
+		case KernelIsa::avx512:
+			return __builtin_cpu_supports("avx512f");
+	}
+	return false;
+}
+#endif
+
+#else
+
+bool cpuSupports(KernelIsa isa) {
+	return isa == KernelIsa::scalar;
+}
+
+#endif // PEPFRAG_KERNEL_X86
+
+KernelFunction kernelFor(KernelIsa isa) {
+	switch (isa) {
+#ifdef PEPFRAG_KERNEL_X86
+		case KernelIsa::sse2:
+			return &kernelSse2;
+		case KernelIsa::avx2:
+			return &kernelAvx2;
+		case KernelIsa::avx512:
+			return &kernelAvx512;
+#endif
+		default:
+			return &kernelScalar;
+	}
+}
+
+KernelIsa detectKernelIsa() {
+	for (KernelIsa isa : {KernelIsa::avx512, KernelIsa::avx2, KernelIsa::sse2}) {
+		if (cpuSupports(isa)) {
+			return isa;
+		}
+	}
+	return KernelIsa::scalar;
+}
+
+/* Dispatch */
+
+// The kernel is looked up on each call, so that setKernelIsa only needs to
+// replace the instruction set
+std::atomic<KernelIsa> currentIsa{detectKernelIsa()};
+
+KernelIsa activeKernelIsa() {
+	return currentIsa.load(std::memory_order_relaxed);
+}
+
+bool kernelIsaSupported(KernelIsa isa) {
+	return cpuSupports(isa);
+}
+
+bool setKernelIsa(KernelIsa isa) {
+	if (!cpuSupports(isa)) {
+		return false;
+	}
+	currentIsa.store(isa, std::memory_order_relaxed);
+	return true;
+}
+
+const char* kernelIsaName(KernelIsa isa) {
+	switch (isa) {
+		case KernelIsa::scalar:
+			return "scalar";
+		case KernelIsa::sse2:
+			return "sse2";
+		case KernelIsa::avx2:
+			return "avx2";
+		case KernelIsa::avx512:
+			return "avx512";
+	}
+	return "unknown";
+}
+
+void computeFragmentMasses(
+	const double* ladder,
+	size_t nPositions,
+	double firstOffset,
+	double secondOffset,
+	const std::vector<double>& deltas,
+	long maxCharge,
+	double protonMass,
+	FragmentMassTable& table)
+{
+	if (maxCharge < 1) {
+		maxCharge = 1;
+	}
+
+	table.nPositions = nPositions;
+	table.nRows = deltas.size() + 1;
+	table.maxCharge = maxCharge;
+	table.masses.resize(nPositions * table.nRows * maxCharge);
+
+	// Index cs holds the values for charge state cs + 1
+	std::vector<double> hMasses(maxCharge);
+	std::vector<double> charges(maxCharge);
+	for (long cs = 0; cs < maxCharge; cs++) {
+		hMasses[cs] = protonMass * cs;
+		charges[cs] = (double) (cs + 1);
+	}
+
+	kernelFor(currentIsa.load(std::memory_order_relaxed))(
+		ladder, nPositions, firstOffset, secondOffset, deltas.data(), deltas.size(),
+		hMasses.data(), charges.data(), maxCharge, table.masses.data());
+}
@@ -0,0 +1,74 @@
+#ifndef _PEPFRAG_FRAGMENTKERNEL_H
+#define _PEPFRAG_FRAGMENTKERNEL_H
+
+#include <cstddef>
+#include <vector>
+
+/*
+ * Instruction sets for which the fragment mass kernel is implemented. The
+ * best instruction set supported by the running CPU is selected at startup.
+ */
+enum class KernelIsa {
+	scalar = 0,
+	sse2 = 1,
+	avx2 = 2,
+	avx512 = 3
+};
+
+/*
+ * Structure-of-arrays table of the fragment masses of one ion series.
+ *
+ * Row 0 holds the base ions and row r > 0 the base ions less deltas[r - 1].
+ * Masses are stored contiguously by charge state, then row, then ladder
+ * position, so that each (charge, row) pair is a dense array.
+ */
+struct FragmentMassTable {
+	size_t nPositions = 0;
+	size_t nRows = 0;
+	long maxCharge = 0;
+	std::vector<double> masses;
+
+	const double* row(long charge, size_t rowIndex) const {
+		return masses.data() + ((charge - 1) * nRows + rowIndex) * nPositions;
+	}
+
+	double at(long charge, size_t rowIndex, size_t position) const {
+		return row(charge, rowIndex)[position];
+	}
+};
+
+/*
+ * Computes the masses of all (row x charge) combinations for the given
+ * ladder of singly charged masses.
+ *
+ * The base ion mass at each position is (ladder[i] + firstOffset) + secondOffset,
+ * each row subtracts its delta from the base mass and charge state z is given
+ * by (mass + (z - 1) * protonMass) / z.
+ */
+void computeFragmentMasses(
+	const double* ladder,
+	size_t nPositions,
+	double firstOffset,
+	double secondOffset,
+	const std::vector<double>& deltas,
+	long maxCharge,
+	double protonMass,
+	FragmentMassTable& table);
+
+KernelIsa activeKernelIsa();
+
+bool kernelIsaSupported(KernelIsa isa);
+
+/*
+ * Overrides the instruction set used by computeFragmentMasses. Returns false,
+ * leaving the active instruction set unchanged, if it is not supported.
+ *
+ * May be called while other threads compute fragment masses: calls already
+ * in progress finish with the previous kernel. Since all kernels produce
+ * identical results, this is only of use for testing and benchmarks.
+ */
+bool setKernelIsa(KernelIsa isa);
+
+const char* kernelIsaName(KernelIsa isa);
+
+#endif // _PEPFRAG_FRAGMENTKERNEL_H
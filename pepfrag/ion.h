@@ -1,8 +1,9 @@
 #ifndef _PEPFRAG_ION_H
 #define _PEPFRAG_ION_H
 
-#include <Python.h>
+#include <cstddef>
 #include <string>
+#include <utility>
 #include <vector>
 
 enum class IonType {
@@ -13,9 +14,30 @@ enum class IonType {
 	a = 5,
 	c = 6,
 	z = 7,
-	x = 8
+	x = 8,
+	internal = 9,
+	d = 10,
+	v = 11,
+	w = 12
 };
 
+// The largest IonType value, e.g. to size per-type arrays. New types are
+// numbered after the last, which this must then name
+const size_t MAX_ION_TYPE = static_cast<size_t>(IonType::w);
+
+/*
+ * Storage formats for fragment masses returned in compact form. Masses are
+ * always calculated in double precision and only narrowed on output.
+ */
+enum class MassFormat {
+	float64 = 0,
+	float32 = 1,
+	// m/z multiplied by FIXED_POINT_SCALE and rounded to a 32-bit integer
+	fixed = 2
+};
+
+const double FIXED_POINT_SCALE = 10000.;
+
 // Forward declaration
 struct Ion;
 
@@ -26,22 +48,8 @@ struct Ion {
 	std::string label;
 	long position;
 	
-	Ion(double _mass, const std::string& _label, long _position)
-		: mass(_mass), label(_label), position(_position) {}
-		
-	explicit operator PyObject*() const {
-		PyObject* pMass = PyFloat_FromDouble(mass);
-		PyObject* pLabel = PyUnicode_FromString(label.c_str());
-		PyObject* pPosition = PyLong_FromLong(position);
-
-		PyObject* tuple = PyTuple_Pack(3, pMass, pLabel, pPosition);
-
-		Py_DECREF(pMass);
-		Py_DECREF(pLabel);
-		Py_DECREF(pPosition);
-
-		return tuple;
-	}
+	Ion(double _mass, std::string _label, long _position)
+		: mass(_mass), label(std::move(_label)), position(_position) {}
 };
 
 #endif // _PEPFRAG_ION_H
@@ -0,0 +1,195 @@
+#include <deque>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ionconfig.h"
+#include "iongenerator.h"
+#include "stats.h"
+#include "tracing.h"
+#include "workspace.h"
+
+const char* generationSpanName(IonType type) {
+	switch (type) {
+		case IonType::precursor:
+			return "generate precursor";
+		case IonType::immonium:
+			return "generate imm";
+		case IonType::b:
+			return "generate b";
+		case IonType::y:
+			return "generate y";
+		case IonType::a:
+			return "generate a";
+		case IonType::c:
+			return "generate c";
+		case IonType::z:
+			return "generate z";
+		case IonType::x:
+			return "generate x";
+		case IonType::internal:
+			return "generate internal";
+		case IonType::d:
+			return "generate d";
+		case IonType::v:
+			return "generate v";
+		case IonType::w:
+			return "generate w";
+	}
+	return "generate";
+}
+
+const std::vector<double>& ionTypeMasses(IonType type, const Workspace& workspace) {
+	switch (type) {
+		case IonType::b:
+		case IonType::a:
+		case IonType::c:
+		case IonType::d:
+			return workspace.bMasses;
+		case IonType::y:
+		case IonType::z:
+		case IonType::x:
+		case IonType::v:
+		case IonType::w:
+			return workspace.yMasses;
+		case IonType::immonium:
+		case IonType::internal:
+			return workspace.seqMasses;
+		case IonType::precursor:
+			return workspace.precMasses;
+	}
+	throw std::logic_error("Invalid ion type specified");
+}
+
+const std::vector<AppliedLosses>& configLosses(const IonConfig& config, size_t maxLosses) {
+	AppliedLossCache& cache = *config.lossCache;
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	auto it = cache.entries.find(maxLosses);
+	if (it != cache.entries.end()) {
+		return it->second;
+	}
+
+	std::vector<AppliedLosses> losses(config.ionTypes.size());
+	for (size_t ii = 0; ii < losses.size(); ii++) {
+		applyNeutralLosses(config.ionTypes[ii].second, maxLosses, losses[ii]);
+	}
+	// The map nodes, and so the returned references, remain valid as
+	// further entries are added
+	return cache.entries.emplace(maxLosses, std::move(losses)).first->second;
+}
+
+void generateConfigIons(
+	const IonConfig& config,
+	long charge,
+	bool radical,
+	const IonGenerationOptions& options,
+	Workspace& workspace)
+{
+	const std::vector<AppliedLosses>& losses = configLosses(config, options.maxLosses);
+	workspace.ions.clear();
+	for (size_t ii = 0; ii < config.ionTypes.size(); ii++) {
+		IonType type = config.ionTypes[ii].first;
+		workspace.generated.clear();
+		{
+			PEPFRAG_TIME(generation);
+			PEPFRAG_TRACE_SPAN(generationSpanName(type));
+			IonGenerator::get(type).generate(
+				ionTypeMasses(type, workspace), charge, losses[ii], radical, workspace.sequence, options,
+				workspace, workspace.generated);
+		}
+		PEPFRAG_COUNT_IONS(type, workspace.generated.size());
+
+		PEPFRAG_TIME(merge);
+		PEPFRAG_TRACE_SPAN("merge");
+		mergeIonVectors(workspace.ions, workspace.generated, workspace.mergeBuffer);
+	}
+}
+
+void generateChargeStates(
+	const IonConfig& config,
+	long maxCharge,
+	bool radical,
+	const IonGenerationOptions& options,
+	Workspace& workspace)
+{
+	const std::vector<AppliedLosses>& losses = configLosses(config, options.maxLosses);
+	size_t nTypes = config.ionTypes.size();
+	size_t nCharges = maxCharge > 0 ? (size_t) maxCharge : 0;
+	size_t stride = nCharges + 1;
+
+	Ions& ions = workspace.typeIons;
+	ions.clear();
+	workspace.typeChargeEnds.assign(nTypes * stride, 0);
+	for (size_t ii = 0; ii < nTypes; ii++) {
+		IonType type = config.ionTypes[ii].first;
+		size_t start = ions.size();
+		{
+			PEPFRAG_TIME(generation);
+			PEPFRAG_TRACE_SPAN(generationSpanName(type));
+			IonGenerator::get(type).generate(
+				ionTypeMasses(type, workspace), maxCharge, losses[ii], radical, workspace.sequence,
+				options, workspace, ions);
+		}
+		PEPFRAG_COUNT_IONS(type, ions.size() - start);
+
+		size_t* ends = &workspace.typeChargeEnds[ii * stride];
+		ends[0] = start;
+		for (size_t cs = 0; cs < nCharges; cs++) {
+			ends[cs + 1] = start + (cs < workspace.chargeEnds.size() ? workspace.chargeEnds[cs] : 0);
+		}
+	}
+
+	// The outer vector is only grown, so that the inner buffers keep their
+	// capacity
+	if (workspace.chargeStateIons.size() < nCharges) {
+		workspace.chargeStateIons.resize(nCharges);
+	}
+
+	// Each charge state merges the prefixes of the generator outputs which
+	// would have been generated at that charge, in the same way as the
+	// generation routines merge the outputs
+	PEPFRAG_TIME(merge);
+	PEPFRAG_TRACE_SPAN("merge");
+	for (size_t cs = 0; cs < nCharges; cs++) {
+		std::vector<const Ion*>& merged = workspace.chargeStateIons[cs];
+		merged.clear();
+		for (size_t ii = 0; ii < nTypes; ii++) {
+			const size_t* ends = &workspace.typeChargeEnds[ii * stride];
+			workspace.ionPointers.clear();
+			for (size_t kk = ends[0]; kk < ends[cs + 1]; kk++) {
+				workspace.ionPointers.push_back(&ions[kk]);
+			}
+			mergeIonPointers(merged, workspace.ionPointers, workspace.pointerBuffer);
+		}
+	}
+}
+
+IonConfig makeIonConfig(const IonTypeMap& ionTypes) {
+	return {ionTypes};
+}
+
+/* Registry */
+
+// A deque is used so that references to registered configurations remain
+// valid as further configurations are registered
+std::deque<IonConfig> registeredConfigs;
+
+std::mutex registryMutex;
+
+long registerIonConfig(const IonTypeMap& ionTypes) {
+	IonConfig config = makeIonConfig(ionTypes);
+	std::lock_guard<std::mutex> lock(registryMutex);
+	registeredConfigs.push_back(std::move(config));
+	return (long) registeredConfigs.size();
+}
+
+const IonConfig& getIonConfig(long handle) {
+	std::lock_guard<std::mutex> lock(registryMutex);
+	if (handle < 1 || handle > (long) registeredConfigs.size()) {
+		throw std::out_of_range("Unknown ion type configuration handle: " + std::to_string(handle));
+	}
+	return registeredConfigs[handle - 1];
+}
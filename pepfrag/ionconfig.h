@@ -0,0 +1,93 @@
+#ifndef _PEPFRAG_IONCONFIG_H
+#define _PEPFRAG_IONCONFIG_H
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ion.h"
+#include "iongenerator.h"
+#include "workspace.h"
+
+using IonTypeMap = std::vector<std::pair<IonType, std::vector<std::pair<std::string, double>>>>;
+
+/*
+ * The trace span name for the generation of the ion type.
+ */
+const char* generationSpanName(IonType type);
+
+/*
+ * The workspace mass list from which the ions of the type are generated.
+ */
+const std::vector<double>& ionTypeMasses(IonType type, const Workspace& workspace);
+
+/*
+ * The applied neutral losses of each ion type of a configuration, by
+ * maxLosses.
+ */
+struct AppliedLossCache {
+	std::mutex mutex;
+	std::map<size_t, std::vector<AppliedLosses>> entries;
+};
+
+/*
+ * An ion type configuration, as registered.
+ */
+struct IonConfig {
+	IonTypeMap ionTypes;
+	// Filled by configLosses, and shared by copies of the configuration
+	std::shared_ptr<AppliedLossCache> lossCache = std::make_shared<AppliedLossCache>();
+};
+
+/*
+ * Returns the neutral losses of each ion type of the configuration, in
+ * order, as set by applyNeutralLosses for maxLosses. They are computed on
+ * the first call for maxLosses, and may be used from any thread.
+ */
+const std::vector<AppliedLosses>& configLosses(const IonConfig& config, size_t maxLosses);
+
+/*
+ * Generates the ions for all ion types of the configuration into
+ * workspace.ions, taking the mass lists from the workspace.
+ */
+void generateConfigIons(
+	const IonConfig& config,
+	long charge,
+	bool radical,
+	const IonGenerationOptions& options,
+	Workspace& workspace);
+
+/*
+ * Generates the ions for all ion types of the configuration once, at
+ * maxCharge, into workspace.typeIons, then, for each charge state z up to
+ * maxCharge, sets workspace.chargeStateIons[z - 1] to the ions at z, in the
+ * order in which generateConfigIons would generate them at charge z.
+ */
+void generateChargeStates(
+	const IonConfig& config,
+	long maxCharge,
+	bool radical,
+	const IonGenerationOptions& options,
+	Workspace& workspace);
+
+/*
+ * Creates the configuration for the ion types.
+ */
+IonConfig makeIonConfig(const IonTypeMap& ionTypes);
+
+/*
+ * Registers the ion type configuration, as created by makeIonConfig,
+ * returning its handle.
+ */
+long registerIonConfig(const IonTypeMap& ionTypes);
+
+/*
+ * Returns the configuration registered with the handle. Throws
+ * std::out_of_range for an unknown handle.
+ */
+const IonConfig& getIonConfig(long handle);
+
+#endif // _PEPFRAG_IONCONFIG_H
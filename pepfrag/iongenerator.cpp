@@ -1,13 +1,20 @@
 #include <algorithm>
+#include <array>
+#include <cmath>
 #include <iterator>
+#include <limits>
 #include <memory>
+#include <stdexcept>
 #include <string>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include "fragmentkernel.h"
 #include "iongenerator.h"
 #include "ion.h"
+#include "mass.h"
+#include "stats.h"
 
 // Defined for use with std::upper_bound, called by std::inplace_merge
 bool operator<(const Ion& left, const Ion& right)
@@ -17,23 +24,36 @@ bool operator<(const Ion& left, const Ion& right)
 
 /* StringCache */
 
+/*
+ * The decimal representations of the positions and charge states in labels.
+ * Those of the common small values are built once, on first use, and never
+ * modified, so that labels may be built concurrently on any thread.
+ */
 class StringCache {
-    static std::unordered_map<long, std::string> cache;
-
-    public:
-
-        static std::string get(long n) {
-            auto it = cache.find(n);
-            if (it != cache.end()) {
-                return it->second;
-            }
-            std::string entry = std::to_string(n);
-            cache[n] = entry;
-            return entry;
-        }
-};
+	static const long SIZE = 4096;
+
+	static const std::vector<std::string>& table() {
+		static const std::vector<std::string> strings = []() {
+			std::vector<std::string> result;
+			result.reserve(SIZE);
+			for (long n = 0; n < SIZE; n++) {
+				result.push_back(std::to_string(n));
+			}
+			return result;
+		}();
+		return strings;
+	}
 
-std::unordered_map<long, std::string> StringCache::cache = std::unordered_map<long, std::string>();
+	public:
+		static std::string get(long n) {
+			if (n >= 0 && n < SIZE) {
+				PEPFRAG_COUNT(labelCacheHits);
+				return table()[n];
+			}
+			PEPFRAG_COUNT(labelCacheMisses);
+			return std::to_string(n);
+		}
+};
 
 const std::string RADICAL = "•";
 
@@ -59,170 +79,479 @@ IonGeneratorPtr IonGenerator::create(IonType type) {
 			return std::make_shared<PrecursorIonGenerator>(PrecursorIonGenerator());
 		case IonType::immonium:
 			return std::make_shared<ImmoniumIonGenerator>(ImmoniumIonGenerator());
+		case IonType::internal:
+			return std::make_shared<InternalIonGenerator>(InternalIonGenerator());
+		case IonType::d:
+			return std::make_shared<DIonGenerator>(DIonGenerator());
+		case IonType::v:
+			return std::make_shared<VIonGenerator>(VIonGenerator());
+		case IonType::w:
+			return std::make_shared<WIonGenerator>(WIonGenerator());
 	}
 	return NULL;
 }
 
+const IonGenerator& IonGenerator::get(IonType type) {
+	static const BIonGenerator bGenerator;
+	static const YIonGenerator yGenerator;
+	static const AIonGenerator aGenerator;
+	static const CIonGenerator cGenerator;
+	static const ZIonGenerator zGenerator;
+	static const XIonGenerator xGenerator;
+	static const PrecursorIonGenerator precursorGenerator;
+	static const ImmoniumIonGenerator immoniumGenerator;
+	static const InternalIonGenerator internalGenerator;
+	static const DIonGenerator dGenerator;
+	static const VIonGenerator vGenerator;
+	static const WIonGenerator wGenerator;
+
+	switch (type) {
+		case IonType::b:
+			return bGenerator;
+		case IonType::y:
+			return yGenerator;
+		case IonType::a:
+			return aGenerator;
+		case IonType::c:
+			return cGenerator;
+		case IonType::z:
+			return zGenerator;
+		case IonType::x:
+			return xGenerator;
+		case IonType::precursor:
+			return precursorGenerator;
+		case IonType::immonium:
+			return immoniumGenerator;
+		case IonType::internal:
+			return internalGenerator;
+		case IonType::d:
+			return dGenerator;
+		case IonType::v:
+			return vGenerator;
+		case IonType::w:
+			return wGenerator;
+	}
+	throw std::logic_error("Invalid ion type specified");
+}
+
 /* SimpleIonGenerator */
 
 SimpleIonGenerator::SimpleIonGenerator(const std::string& label) : IonGenerator(label) {};
 
-Ions SimpleIonGenerator::generate(
+void SimpleIonGenerator::generate(
 	const std::vector<double>& masses,
 	long charge,
-	const std::vector<NeutralLossPair>& neutralLosses,
+	const AppliedLosses& applied,
 	bool radical,
-	const std::string& sequence) const
+	const std::string& sequence,
+	const IonGenerationOptions& options,
+	Workspace& workspace,
+	Ions& ions) const
 {
 	std::pair<int, int> massIndices = preProcessMasses(masses);
-	
-	Ions ions;
-	ions.reserve(masses.size() * 10);
-	
-	for (int ii = massIndices.first; ii < massIndices.second; ii++) {
-		double ion_mass = fixMass(masses[ii]);
-		
-		ions.push_back(generateBaseIon(ion_mass, ii, sequence));
-		
-		if (radical) {
-			generateRadicalIons(ions, ion_mass, ii);
+	size_t nPositions = massIndices.second > massIndices.first
+		? (size_t) (massIndices.second - massIndices.first) : 0;
+
+	const std::vector<NeutralLossPair>& radicals = radicalLosses();
+	size_t nRadicals = radical ? radicals.size() : 0;
+
+	const std::vector<NeutralLossPair>* losses = &applied.losses;
+	const std::vector<unsigned>& requirements = applied.requirements;
+
+	// Each row of the mass table is the base ion less one of these deltas
+	std::vector<double>& deltas = workspace.deltas;
+	deltas.clear();
+	for (size_t ii = 0; ii < nRadicals; ii++) {
+		deltas.push_back(radicals[ii].second);
+	}
+	for (const NeutralLossPair& neutralLoss : *losses) {
+		deltas.push_back(neutralLoss.second);
+	}
+
+	// Compute all masses up front, so that the arithmetic is not interleaved
+	// with label construction
+	// With residue-aware losses, each loss requiring LossSites is only
+	// applied to the fragments containing them
+	bool filterLosses = false;
+	if (options.residueLosses) {
+		for (unsigned requirement : requirements) {
+			filterLosses = filterLosses || requirement > 0;
 		}
-		
-		if (!neutralLosses.empty()) {
-			generateNeutralLosses(ions, ion_mass, ii, neutralLosses);
+		if (filterLosses) {
+			countLossSites(sequence, workspace.seqMasses, workspace.lossSiteCounts);
 		}
 	}
-	
-	// Perform charging based on the singly charged ions in "ions" and update
-	// "chargedIons" so that doubly charged ions are not re-submitted to chargeIons
-	// since this results in ions like [23+]
-	Ions chargedIons;
-	chargedIons.reserve(ions.size() * charge);
-	chargedIons = ions;
-	for (long cs = 1; cs < charge; cs++) {
-		chargeIons(ions, chargedIons, cs + 1);
+
+	std::pair<double, double> offsets = massOffsets();
+	FragmentMassTable& table = workspace.table;
+	computeFragmentMasses(
+		masses.data() + massIndices.first, nPositions, offsets.first, offsets.second,
+		deltas, charge, PROTON_MASS, table);
+
+	size_t first = ions.size();
+	ions.reserve(first + nPositions * table.nRows * table.maxCharge);
+
+	// With the basic charge limit, the fragment at each position is only
+	// charged up to its number of basic sites
+	bool limitCharges = options.basicChargeLimit && charge > 1;
+	std::vector<long>& fragmentCharges = workspace.fragmentCharges;
+	if (limitCharges) {
+		countBasicSites(sequence, workspace.basicSiteCounts);
+		const std::vector<unsigned>& counts = workspace.basicSiteCounts;
+		fragmentCharges.resize(nPositions);
+		for (size_t ii = 0; ii < nPositions; ii++) {
+			std::pair<size_t, size_t> residues = fragmentResidues(massIndices.first + (long) ii, sequence.size());
+			size_t last = std::min(residues.second, sequence.size());
+			size_t firstResidue = std::min(residues.first, last);
+			fragmentCharges[ii] = fragmentBasicSites(counts, firstResidue, last);
+		}
 	}
 
-	return chargedIons;
-}
+	// The mass table cell of each singly charged ion, if losses are skipped
+	std::vector<size_t>& cells = workspace.lossCells;
+	cells.clear();
 
-std::pair<int, int> SimpleIonGenerator::preProcessMasses(const std::vector<double>& masses) const {
-	return std::make_pair(0, masses.size() - 1);
+	if (options.bounded()) {
+		// Every cell, less the skipped losses, is a candidate at each charge
+		// state, but ions are only built, with their labels, if kept
+		for (size_t ii = 0; ii < nPositions; ii++) {
+			std::pair<size_t, size_t> residues;
+			if (filterLosses) {
+				residues = fragmentResidues(massIndices.first + (long) ii, sequence.size());
+			}
+			for (size_t row = 0; row < table.nRows; row++) {
+				if (filterLosses && row > nRadicals && !hasLossSites(
+						workspace.lossSiteCounts, sequence.size(), &requirements[(row - nRadicals - 1) * N_LOSS_SITES],
+						residues.first, residues.second)) {
+					continue;
+				}
+				cells.push_back(ii * table.nRows + row);
+			}
+		}
+
+		size_t limit = options.maxIons > 0 ? options.maxIons : std::numeric_limits<size_t>::max();
+		const size_t notGenerated = std::numeric_limits<size_t>::max();
+		std::vector<size_t>& singleIndices = workspace.singleIndices;
+		std::vector<std::string>& singleLabels = workspace.singleLabels;
+		singleIndices.assign(cells.size(), notGenerated);
+		if (options.labels) {
+			singleLabels.assign(cells.size(), std::string());
+		}
+		for (size_t kk = 0; kk < cells.size() && ions.size() - first < limit; kk++) {
+			if (!options.inMzRange(table.at(1, cells[kk] % table.nRows, cells[kk] / table.nRows))) continue;
+			singleIndices[kk] = ions.size();
+			ions.push_back(singlyChargedIon(
+				table, cells[kk], massIndices.first, nRadicals, *losses, sequence, options.labels));
+		}
+		workspace.chargeEnds.assign(1, ions.size() - first);
+
+		for (long cs = 2; cs <= charge; cs++) {
+			long minPos = 2 * cs - 1;
+			std::string chargeStr = StringCache::get(cs) + "+";
+			for (size_t kk = 0; kk < cells.size() && ions.size() - first < limit; kk++) {
+				if (limitCharges && cs > fragmentCharges[cells[kk] / table.nRows]) continue;
+				double mass = table.at(cs, cells[kk] % table.nRows, cells[kk] / table.nRows);
+				if (!options.inMzRange(mass)) continue;
+
+				// Only the base ion's position depends on the generator, e.g.
+				// immonium ions have none, and it is built without a label
+				long position = massIndices.first + (long) (cells[kk] / table.nRows);
+				position = cells[kk] % table.nRows == 0
+					? generateBaseIon(0., position, sequence, false).position : position + 1;
+				if (position < minPos) continue;
+
+				std::string label;
+				if (options.labels) {
+					// The label of a singly charged ion outside the range is
+					// built once, for the first charge state needing it
+					size_t index = singleIndices[kk];
+					if (index == notGenerated && singleLabels[kk].empty()) {
+						singleLabels[kk] = singlyChargedIon(
+							table, cells[kk], massIndices.first, nRadicals, *losses, sequence, true).label;
+					}
+					const std::string& single = index != notGenerated ? ions[index].label : singleLabels[kk];
+					label = chargeLabel(single, single.find('+'), chargeStr);
+				}
+				ions.emplace_back(mass, std::move(label), position);
+			}
+			workspace.chargeEnds.push_back(ions.size() - first);
+		}
+		return;
+	}
+
+	for (size_t ii = 0; ii < nPositions; ii++) {
+		long position = massIndices.first + (long) ii;
+
+		ions.push_back(generateBaseIon(table.at(1, 0, ii), position, sequence, options.labels));
+
+		for (size_t jj = 0; jj < nRadicals; jj++) {
+			ions.emplace_back(
+				table.at(1, jj + 1, ii),
+				options.labels ? "[" + ionLabel + StringCache::get(position + 1) + radicals[jj].first : std::string(),
+				position + 1);
+		}
+
+		std::pair<size_t, size_t> residues;
+		if (filterLosses) {
+			residues = fragmentResidues(position, sequence.size());
+			for (size_t jj = 0; jj <= nRadicals; jj++) {
+				cells.push_back(ii * table.nRows + jj);
+			}
+		}
+
+		for (size_t jj = 0; jj < losses->size(); jj++) {
+			if (filterLosses) {
+				if (!hasLossSites(
+						workspace.lossSiteCounts, sequence.size(), &requirements[jj * N_LOSS_SITES],
+						residues.first, residues.second)) {
+					continue;
+				}
+				cells.push_back(ii * table.nRows + nRadicals + jj + 1);
+			}
+			ions.emplace_back(
+				table.at(1, nRadicals + jj + 1, ii),
+				options.labels ? neutralLossLabel(ionLabel, (*losses)[jj], position) : std::string(),
+				position + 1);
+		}
+	}
+
+	// Generate the multiply charged ions from the singly charged ions above,
+	// taking the masses from the table. The singly charged ions are ordered
+	// by position, then table row, so, unless losses were skipped, the kth
+	// is the kth cell of the table
+	size_t nSingle = ions.size() - first;
+	workspace.chargeEnds.assign(1, nSingle);
+	std::vector<size_t>& chargeIndices = workspace.chargeIndices;
+	chargeIndices.resize(charge > 1 && options.labels ? nSingle : 0);
+	for (size_t kk = 0; kk < chargeIndices.size(); kk++) {
+		chargeIndices[kk] = ions[first + kk].label.find('+');
+	}
+
+	for (long cs = 2; cs <= charge; cs++) {
+		long minPos = 2 * cs - 1;
+		std::string chargeStr = StringCache::get(cs) + "+";
+		for (size_t kk = 0; kk < nSingle; kk++) {
+			long position = ions[first + kk].position;
+			if (position < minPos) continue;
+			size_t cell = filterLosses ? cells[kk] : kk;
+			if (limitCharges && cs > fragmentCharges[cell / table.nRows]) continue;
+			std::string label = options.labels
+				? chargeLabel(ions[first + kk].label, chargeIndices[kk], chargeStr) : std::string();
+			ions.emplace_back(table.at(cs, cell % table.nRows, cell / table.nRows), std::move(label), position);
+		}
+		workspace.chargeEnds.push_back(ions.size() - first);
+	}
 }
 
-Ion SimpleIonGenerator::generateBaseIon(double mass, long position, const std::string& /*sequence*/) const {
-	return {mass, ionLabel + StringCache::get(position + 1) + "[+]", position + 1};
+Ion SimpleIonGenerator::singlyChargedIon(
+	const FragmentMassTable& table,
+	size_t cell,
+	long firstPosition,
+	size_t nRadicals,
+	const std::vector<NeutralLossPair>& neutralLosses,
+	const std::string& sequence,
+	bool labels) const
+{
+	size_t ii = cell / table.nRows;
+	size_t row = cell % table.nRows;
+	long position = firstPosition + (long) ii;
+	double mass = table.at(1, row, ii);
+
+	if (row == 0) {
+		return generateBaseIon(mass, position, sequence, labels);
+	}
+	if (row <= nRadicals) {
+		return {
+			mass,
+			labels ? "[" + ionLabel + StringCache::get(position + 1) + radicalLosses()[row - 1].first : std::string(),
+			position + 1
+		};
+	}
+	return {
+		mass,
+		labels ? neutralLossLabel(ionLabel, neutralLosses[row - nRadicals - 1], position) : std::string(),
+		position + 1
+	};
 }
 
-void SimpleIonGenerator::generateRadicalIons(Ions& ions, double mass, long position) const {
+long SimpleIonGenerator::massTable(
+	const std::vector<double>& masses,
+	const std::vector<NeutralLossPair>& neutralLosses,
+	bool radical,
+	std::vector<double>& deltas,
+	FragmentMassTable& table) const
+{
+	std::pair<int, int> massIndices = preProcessMasses(masses);
+	size_t nPositions = massIndices.second > massIndices.first
+		? (size_t) (massIndices.second - massIndices.first) : 0;
+
+	deltas.clear();
+	if (radical) {
+		for (const NeutralLossPair& radicalLoss : radicalLosses()) {
+			deltas.push_back(radicalLoss.second);
+		}
+	}
+	for (const NeutralLossPair& neutralLoss : neutralLosses) {
+		deltas.push_back(neutralLoss.second);
+	}
+
+	std::pair<double, double> offsets = massOffsets();
+	computeFragmentMasses(
+		masses.data() + massIndices.first, nPositions, offsets.first, offsets.second,
+		deltas, 1, PROTON_MASS, table);
+	return massIndices.first;
 }
 
-void SimpleIonGenerator::generateNeutralLosses(
-	Ions& ions,
-	double mass,
+std::string SimpleIonGenerator::label(
+	const std::string& sequence,
 	long position,
+	size_t row,
+	long charge,
+	bool radical,
 	const std::vector<NeutralLossPair>& neutralLosses) const
 {
-	for (NeutralLossPair neutralLoss : neutralLosses) {
-		ions.push_back(generateNeutralLossIon(ionLabel, neutralLoss, mass, position));
+	size_t nRadicals = radical ? radicalLosses().size() : 0;
+	std::string single;
+	if (row == 0) {
+		single = generateBaseIon(0., position, sequence, true).label;
+	}
+	else if (row <= nRadicals) {
+		single = "[" + ionLabel + StringCache::get(position + 1) + radicalLosses()[row - 1].first;
+	}
+	else {
+		single = neutralLossLabel(ionLabel, neutralLosses[row - nRadicals - 1], position);
 	}
+	return charge > 1 ? chargeLabel(single, single.find('+'), StringCache::get(charge) + "+") : single;
 }
 
-double SimpleIonGenerator::fixMass(double mass) const {
-	return mass;
+std::pair<int, int> SimpleIonGenerator::preProcessMasses(const std::vector<double>& masses) const {
+	return std::make_pair(0, masses.size() - 1);
+}
+
+Ion SimpleIonGenerator::generateBaseIon(
+	double mass,
+	long position,
+	const std::string& /*sequence*/,
+	bool labels) const
+{
+	return {mass, labels ? ionLabel + StringCache::get(position + 1) + "[+]" : std::string(), position + 1};
+}
+
+std::pair<size_t, size_t> SimpleIonGenerator::fragmentResidues(long position, size_t /*seqLen*/) const {
+	return std::make_pair(0, (size_t) position + 1);
+}
+
+const std::vector<NeutralLossPair>& SimpleIonGenerator::radicalLosses() const {
+	static const std::vector<NeutralLossPair> losses;
+	return losses;
+}
+
+std::pair<double, double> SimpleIonGenerator::massOffsets() const {
+	return std::make_pair(0., 0.);
+}
+
+/*
+ * The C-terminal residues up to position, for y, z and x ions.
+ */
+std::pair<size_t, size_t> cTerminalResidues(long position, size_t seqLen) {
+	size_t length = (size_t) position + 1;
+	return std::make_pair(seqLen > length ? seqLen - length : 0, seqLen);
 }
 
 /* BIonGenerator */
 
 BIonGenerator::BIonGenerator() : SimpleIonGenerator("b") {}
 
-void BIonGenerator::generateRadicalIons(Ions& ions, double mass, long position) const {
-	ions.emplace_back(
-		mass,
-		"[" + ionLabel + StringCache::get(position + 1) + "-H[" + RADICAL + "+]",
-		position + 1
-	);
+const std::vector<NeutralLossPair>& BIonGenerator::radicalLosses() const {
+	static const std::vector<NeutralLossPair> losses{
+		{"-H[" + RADICAL + "+]", 0.}
+	};
+	return losses;
 }
 
-double BIonGenerator::fixMass(double mass) const {
-	return mass + PROTON_MASS;
+std::pair<double, double> BIonGenerator::massOffsets() const {
+	return std::make_pair(PROTON_MASS, 0.);
 }
 
 /* YIonGenerator */
 
 YIonGenerator::YIonGenerator() : SimpleIonGenerator("y") {}
 
-double YIonGenerator::fixMass(double mass) const {
-	return mass + PROTON_MASS;
+std::pair<double, double> YIonGenerator::massOffsets() const {
+	return std::make_pair(PROTON_MASS, 0.);
+}
+
+std::pair<size_t, size_t> YIonGenerator::fragmentResidues(long position, size_t seqLen) const {
+	return cTerminalResidues(position, seqLen);
 }
 
 /* AIonGenerator */
 
 AIonGenerator::AIonGenerator() : SimpleIonGenerator("a") {}
 
-void AIonGenerator::generateRadicalIons(Ions& ions, double mass, long position) const {
-	ions.emplace_back(
-		mass - PROTON_MASS,
-		"[" + ionLabel + StringCache::get(position + 1) + "-H][" + RADICAL + "+]",
-		position + 1
-	);
-	ions.emplace_back(
-		mass + PROTON_MASS,
-		"[" + ionLabel + StringCache::get(position + 1) + "+H][" + RADICAL + "+]",
-		position + 1
-	);
+const std::vector<NeutralLossPair>& AIonGenerator::radicalLosses() const {
+	static const std::vector<NeutralLossPair> losses{
+		{"-H][" + RADICAL + "+]", PROTON_MASS},
+		{"+H][" + RADICAL + "+]", -PROTON_MASS}
+	};
+	return losses;
 }
 
-double AIonGenerator::fixMass(double mass) const {
-	return mass + PROTON_MASS - FIXED_MASSES.at("CO");
+std::pair<double, double> AIonGenerator::massOffsets() const {
+	return std::make_pair(PROTON_MASS, -FIXED_MASSES.at("CO"));
 }
 
 /* CIonGenerator */
 
 CIonGenerator::CIonGenerator() : SimpleIonGenerator("c") {}
 
-void CIonGenerator::generateRadicalIons(Ions& ions, double mass, long position) const {
-	ions.emplace_back(
-		mass + 2 * PROTON_MASS,
-		"[" + ionLabel + StringCache::get(position + 1) + "+2H][" + RADICAL + "+]",
-		position + 1
-	);
+const std::vector<NeutralLossPair>& CIonGenerator::radicalLosses() const {
+	static const std::vector<NeutralLossPair> losses{
+		{"+2H][" + RADICAL + "+]", -2 * PROTON_MASS}
+	};
+	return losses;
 }
 
-double CIonGenerator::fixMass(double mass) const {
-	return mass + 4 * PROTON_MASS + FIXED_MASSES.at("N");
+std::pair<double, double> CIonGenerator::massOffsets() const {
+	return std::make_pair(4 * PROTON_MASS, FIXED_MASSES.at("N"));
 }
 
 /* ZIonGenerator */
 
 ZIonGenerator::ZIonGenerator() : SimpleIonGenerator("z") {}
 
-void ZIonGenerator::generateRadicalIons(Ions& ions, double mass, long position) const {
-	ions.emplace_back(
-		mass - PROTON_MASS,
-		"[" + ionLabel + StringCache::get(position + 1) + "-H][" + RADICAL + "+]",
-		position + 1
-	);
+const std::vector<NeutralLossPair>& ZIonGenerator::radicalLosses() const {
+	static const std::vector<NeutralLossPair> losses{
+		{"-H][" + RADICAL + "+]", PROTON_MASS}
+	};
+	return losses;
+}
+
+std::pair<double, double> ZIonGenerator::massOffsets() const {
+	return std::make_pair(-FIXED_MASSES.at("N"), -1 * PROTON_MASS);
 }
 
-double ZIonGenerator::fixMass(double mass) const {
-	return mass - FIXED_MASSES.at("N") - 1 * PROTON_MASS;
+std::pair<size_t, size_t> ZIonGenerator::fragmentResidues(long position, size_t seqLen) const {
+	return cTerminalResidues(position, seqLen);
 }
 
 /* XIonGenerator */
 
 XIonGenerator::XIonGenerator() : SimpleIonGenerator("x") {}
 
-void XIonGenerator::generateRadicalIons(Ions& ions, double mass, long position) const {
-    ions.emplace_back(
-		mass,
-		"[" + ionLabel + StringCache::get(position + 1) + "-H[" + RADICAL + "+]",
-		position + 1
-	);
+const std::vector<NeutralLossPair>& XIonGenerator::radicalLosses() const {
+	static const std::vector<NeutralLossPair> losses{
+		{"-H[" + RADICAL + "+]", 0.}
+	};
+	return losses;
+}
+
+std::pair<double, double> XIonGenerator::massOffsets() const {
+	return std::make_pair(FIXED_MASSES.at("CO"), -PROTON_MASS);
 }
 
-double XIonGenerator::fixMass(double mass) const {
-    return mass + FIXED_MASSES.at("CO") - PROTON_MASS;
+std::pair<size_t, size_t> XIonGenerator::fragmentResidues(long position, size_t seqLen) const {
+	return cTerminalResidues(position, seqLen);
 }
 
 /* ImmoniumIonGenerator */
@@ -233,85 +562,701 @@ std::pair<int, int> ImmoniumIonGenerator::preProcessMasses(const std::vector<dou
 	return std::make_pair(0, masses.size());
 }
 
-Ion ImmoniumIonGenerator::generateBaseIon(double mass, long position, const std::string& sequence) const {
+Ion ImmoniumIonGenerator::generateBaseIon(
+	double mass,
+	long position,
+	const std::string& sequence,
+	bool labels) const
+{
 	return {
 		mass,
-		ionLabel + "(" + sequence[position] + ")",
+		labels ? ionLabel + "(" + sequence[position] + ")" : std::string(),
 		0
 	};
 }
-	
-double ImmoniumIonGenerator::fixMass(double mass) const {
-	return mass - FIXED_MASSES.at("CO") + PROTON_MASS;
+
+std::pair<double, double> ImmoniumIonGenerator::massOffsets() const {
+	return std::make_pair(-FIXED_MASSES.at("CO"), PROTON_MASS);
+}
+
+std::pair<size_t, size_t> ImmoniumIonGenerator::fragmentResidues(long position, size_t /*seqLen*/) const {
+	return std::make_pair((size_t) position, (size_t) position + 1);
+}
+
+/* SatelliteIonGenerator */
+
+// The monoisotopic and average masses of the formula CcHhNnOoSs
+std::pair<double, double> formulaMass(int c, int h, int n, int o, int s) {
+	return std::make_pair(
+		12. * c + 1.00782503207 * h + 14.0030740048 * n + 15.99491461956 * o + 31.97207100 * s,
+		12.0107 * c + 1.00794 * h + 14.0067 * n + 15.9994 * o + 32.065 * s);
+}
+
+const std::unordered_map<char, SideChain> SIDE_CHAINS = {
+	{'A', {formulaMass(1, 3, 0, 0, 0), {}}},
+	{'R', {formulaMass(4, 10, 3, 0, 0), {formulaMass(3, 8, 3, 0, 0)}}},
+	{'N', {formulaMass(2, 4, 1, 1, 0), {formulaMass(1, 2, 1, 1, 0)}}},
+	{'D', {formulaMass(2, 3, 0, 2, 0), {formulaMass(1, 1, 0, 2, 0)}}},
+	{'C', {formulaMass(1, 3, 0, 0, 1), {formulaMass(0, 1, 0, 0, 1)}}},
+	{'E', {formulaMass(3, 5, 0, 2, 0), {formulaMass(2, 3, 0, 2, 0)}}},
+	{'Q', {formulaMass(3, 6, 1, 1, 0), {formulaMass(2, 4, 1, 1, 0)}}},
+	{'H', {formulaMass(4, 5, 2, 0, 0), {formulaMass(3, 3, 2, 0, 0)}}},
+	// Ethyl, then methyl
+	{'I', {formulaMass(4, 9, 0, 0, 0), {formulaMass(2, 5, 0, 0, 0), formulaMass(1, 3, 0, 0, 0)}}},
+	{'L', {formulaMass(4, 9, 0, 0, 0), {formulaMass(3, 7, 0, 0, 0)}}},
+	{'K', {formulaMass(4, 10, 1, 0, 0), {formulaMass(3, 8, 1, 0, 0)}}},
+	{'M', {formulaMass(3, 7, 0, 0, 1), {formulaMass(2, 5, 0, 0, 1)}}},
+	{'F', {formulaMass(7, 7, 0, 0, 0), {formulaMass(6, 5, 0, 0, 0)}}},
+	{'S', {formulaMass(1, 3, 0, 1, 0), {formulaMass(0, 1, 0, 1, 0)}}},
+	// Methyl, then hydroxyl
+	{'T', {formulaMass(2, 5, 0, 1, 0), {formulaMass(1, 3, 0, 0, 0), formulaMass(0, 1, 0, 1, 0)}}},
+	{'W', {formulaMass(9, 8, 1, 0, 0), {formulaMass(8, 6, 1, 0, 0)}}},
+	{'Y', {formulaMass(7, 7, 0, 1, 0), {formulaMass(6, 5, 0, 1, 0)}}},
+	// The two methyl groups are equivalent
+	{'V', {formulaMass(3, 7, 0, 0, 0), {formulaMass(1, 3, 0, 0, 0)}}}
+};
+
+// The tolerance within which a residue mass is taken to be unmodified
+const double UNMODIFIED_TOLERANCE = 0.001;
+
+SatelliteIonGenerator::SatelliteIonGenerator(const std::string& label) : SimpleIonGenerator(label) {}
+
+void SatelliteIonGenerator::generate(
+	const std::vector<double>& masses,
+	long charge,
+	const AppliedLosses& applied,
+	bool /*radical*/,
+	const std::string& sequence,
+	const IonGenerationOptions& options,
+	Workspace& workspace,
+	Ions& ions) const
+{
+	std::pair<int, int> massIndices = preProcessMasses(masses);
+	size_t seqLen = sequence.size();
+	size_t first = ions.size();
+	workspace.chargeEnds.clear();
+
+	// The satellite ladder: the parent ladder mass of each position whose
+	// residue has a side chain cleavage, less each of its offsets
+	std::vector<double>& ladder = workspace.satelliteLadder;
+	std::vector<SatellitePosition>& positions = workspace.satellitePositions;
+	ladder.clear();
+	positions.clear();
+	const std::vector<double>& seqMasses = workspace.seqMasses;
+	for (long position = massIndices.first; position < massIndices.second; position++) {
+		size_t residue = satelliteResidue(position, seqLen);
+		if (residue >= seqLen || residue >= seqMasses.size()) continue;
+		auto sideChain = SIDE_CHAINS.find(sequence[residue]);
+		auto residueMasses = AA_MASSES.find(sequence[residue]);
+		if (sideChain == SIDE_CHAINS.end() || residueMasses == AA_MASSES.end()) continue;
+
+		// Modified side chains are skipped, since their cleavages differ
+		bool average = std::abs(seqMasses[residue] - residueMasses->second.second) < UNMODIFIED_TOLERANCE;
+		if (!average && std::abs(seqMasses[residue] - residueMasses->second.first) >= UNMODIFIED_TOLERANCE) continue;
+
+		double offsets[2];
+		size_t nOffsets = sideChainOffsets(sideChain->second, average, offsets);
+		for (size_t ii = 0; ii < nOffsets; ii++) {
+			ladder.push_back(masses[position] - offsets[ii]);
+			positions.push_back({(uint32_t) position, nOffsets > 1 ? (char) ('a' + ii) : '\0'});
+		}
+	}
+
+	const std::vector<NeutralLossPair>& losses = applied.losses;
+	const std::vector<unsigned>& requirements = applied.requirements;
+	std::vector<double>& deltas = workspace.deltas;
+	deltas.clear();
+	for (const NeutralLossPair& neutralLoss : losses) {
+		deltas.push_back(neutralLoss.second);
+	}
+
+	bool filterLosses = false;
+	if (options.residueLosses) {
+		for (unsigned requirement : requirements) {
+			filterLosses = filterLosses || requirement > 0;
+		}
+		if (filterLosses) {
+			countLossSites(sequence, seqMasses, workspace.lossSiteCounts);
+		}
+	}
+	bool limitCharges = options.basicChargeLimit && charge > 1;
+	if (limitCharges) {
+		countBasicSites(sequence, workspace.basicSiteCounts);
+	}
+
+	std::pair<double, double> massOffset = massOffsets();
+	FragmentMassTable& table = workspace.table;
+	computeFragmentMasses(
+		ladder.data(), ladder.size(), massOffset.first, massOffset.second, deltas, charge, PROTON_MASS, table);
+
+	// As for the parent series, the ions are ordered by charge state, then
+	// position, then table row
+	size_t limit = options.maxIons > 0 ? options.maxIons : std::numeric_limits<size_t>::max();
+	for (long cs = 1; cs <= charge; cs++) {
+		long minPos = 2 * cs - 1;
+		std::string chargeStr = options.labels ? (cs > 1 ? StringCache::get(cs) : "") + "+" : std::string();
+		for (size_t ii = 0; ii < positions.size() && ions.size() - first < limit; ii++) {
+			long position = (long) positions[ii].position;
+			if (position + 1 < minPos) continue;
+
+			std::pair<size_t, size_t> residues = fragmentResidues(position, seqLen);
+			size_t last = std::min(residues.second, seqLen);
+			size_t firstResidue = std::min(residues.first, last);
+			if (limitCharges) {
+				if (cs > fragmentBasicSites(workspace.basicSiteCounts, firstResidue, last)) continue;
+			}
+
+			for (size_t row = 0; row < table.nRows && ions.size() - first < limit; row++) {
+				if (row > 0 && filterLosses && !hasLossSites(
+						workspace.lossSiteCounts, seqLen, &requirements[(row - 1) * N_LOSS_SITES],
+						firstResidue, last)) {
+					continue;
+				}
+				double mz = table.at(cs, row, ii);
+				if (!options.inMzRange(mz)) continue;
+
+				std::string label;
+				if (options.labels) {
+					label = ionLabel;
+					if (positions[ii].variant != '\0') {
+						label += positions[ii].variant;
+					}
+					label += StringCache::get(position + 1);
+					label = row == 0
+						? label + "[" + chargeStr + "]"
+						: "[" + label + "-" + losses[row - 1].first + "][" + chargeStr + "]";
+				}
+				ions.emplace_back(mz, std::move(label), position + 1);
+			}
+		}
+		workspace.chargeEnds.push_back(ions.size() - first);
+	}
+}
+
+// The offsets of the beta substituents of the side chain
+size_t betaSubstituentOffsets(const SideChain& sideChain, bool average, double shift, double* offsets) {
+	size_t nOffsets = std::min(sideChain.betaSubstituents.size(), (size_t) 2);
+	for (size_t ii = 0; ii < nOffsets; ii++) {
+		const std::pair<double, double>& mass = sideChain.betaSubstituents[ii];
+		offsets[ii] = (average ? mass.second : mass.first) + shift;
+	}
+	return nOffsets;
+}
+
+/* DIonGenerator */
+
+DIonGenerator::DIonGenerator() : SatelliteIonGenerator("d") {}
+
+std::pair<double, double> DIonGenerator::massOffsets() const {
+	return std::make_pair(PROTON_MASS, -FIXED_MASSES.at("CO"));
+}
+
+size_t DIonGenerator::satelliteResidue(long position, size_t /*seqLen*/) const {
+	return (size_t) position;
+}
+
+size_t DIonGenerator::sideChainOffsets(const SideChain& sideChain, bool average, double* offsets) const {
+	// The a ion gains a hydrogen
+	return betaSubstituentOffsets(sideChain, average, -PROTON_MASS, offsets);
+}
+
+/* VIonGenerator */
+
+VIonGenerator::VIonGenerator() : SatelliteIonGenerator("v") {}
+
+std::pair<double, double> VIonGenerator::massOffsets() const {
+	return std::make_pair(PROTON_MASS, 0.);
+}
+
+std::pair<size_t, size_t> VIonGenerator::fragmentResidues(long position, size_t seqLen) const {
+	return cTerminalResidues(position, seqLen);
+}
+
+size_t VIonGenerator::satelliteResidue(long position, size_t seqLen) const {
+	return cTerminalResidues(position, seqLen).first;
+}
+
+size_t VIonGenerator::sideChainOffsets(const SideChain& sideChain, bool average, double* offsets) const {
+	offsets[0] = (average ? sideChain.mass.second : sideChain.mass.first) - PROTON_MASS;
+	return 1;
+}
+
+/* WIonGenerator */
+
+WIonGenerator::WIonGenerator() : SatelliteIonGenerator("w") {}
+
+std::pair<double, double> WIonGenerator::massOffsets() const {
+	return std::make_pair(-FIXED_MASSES.at("N"), -1 * PROTON_MASS);
+}
+
+std::pair<size_t, size_t> WIonGenerator::fragmentResidues(long position, size_t seqLen) const {
+	return cTerminalResidues(position, seqLen);
+}
+
+size_t WIonGenerator::satelliteResidue(long position, size_t seqLen) const {
+	return cTerminalResidues(position, seqLen).first;
+}
+
+size_t WIonGenerator::sideChainOffsets(const SideChain& sideChain, bool average, double* offsets) const {
+	return betaSubstituentOffsets(sideChain, average, 0., offsets);
+}
+
+/* InternalIonGenerator */
+
+InternalIonGenerator::InternalIonGenerator() : IonGenerator("int") {}
+
+// Orders a heap of internal fragments with the lightest first, breaking
+// ties by start residue, then row
+bool heavierFragment(const InternalFragment& left, const InternalFragment& right) {
+	if (left.mass != right.mass) return left.mass > right.mass;
+	if (left.start != right.start) return left.start > right.start;
+	return left.row > right.row;
+}
+
+void InternalIonGenerator::generate(
+	const std::vector<double>& masses,
+	long charge,
+	const AppliedLosses& applied,
+	bool /*radical*/,
+	const std::string& sequence,
+	const IonGenerationOptions& options,
+	Workspace& workspace,
+	Ions& ions) const
+{
+	size_t first = ions.size();
+	workspace.chargeEnds.clear();
+	size_t seqLen = masses.size();
+	if (charge < 1) return;
+
+	const std::vector<NeutralLossPair>& losses = applied.losses;
+	const std::vector<unsigned>& requirements = applied.requirements;
+	bool filterLosses = false;
+	if (options.residueLosses) {
+		for (unsigned requirement : requirements) {
+			filterLosses = filterLosses || requirement > 0;
+		}
+		if (filterLosses) {
+			countLossSites(sequence, masses, workspace.lossSiteCounts);
+		}
+	}
+	bool limitCharges = options.basicChargeLimit && charge > 1;
+	if (limitCharges) {
+		countBasicSites(sequence, workspace.basicSiteCounts);
+	}
+
+	// The rows of fragments: by, ay, then by less each loss
+	std::vector<double>& deltas = workspace.deltas;
+	deltas.assign({0., FIXED_MASSES.at("CO")});
+	for (const NeutralLossPair& loss : losses) {
+		deltas.push_back(loss.second);
+	}
+
+	std::vector<double>& prefix = workspace.prefixMasses;
+	prefix.resize(seqLen + 1);
+	prefix[0] = 0.;
+	for (size_t ii = 0; ii < seqLen; ii++) {
+		prefix[ii + 1] = prefix[ii] + masses[ii];
+	}
+
+	// Fragments of residues [start, end), excluding the terminal residues
+	size_t minLength = std::max(options.minInternalLength, (size_t) 1);
+	size_t maxLength = options.maxInternalLength > 0 ? options.maxInternalLength : seqLen;
+	size_t lastEnd = seqLen > 1 ? seqLen - 1 : 0;
+
+	std::vector<InternalFragment>& heap = workspace.fragmentHeap;
+	heap.clear();
+	for (size_t start = 1; start + minLength <= lastEnd; start++) {
+		size_t end = start + minLength;
+		for (size_t row = 0; row < deltas.size(); row++) {
+			heap.push_back({
+				prefix[end] - prefix[start] - deltas[row], (uint32_t) start, (uint32_t) end, (uint32_t) row});
+		}
+	}
+	std::make_heap(heap.begin(), heap.end(), &heavierFragment);
+
+	// A fragment's m/z is lowest at the highest charge state, so once that
+	// exceeds the range, so does that of every heavier fragment. Fragments
+	// below the range when singly charged are below it at every charge.
+	std::vector<InternalFragment>& fragments = workspace.internalFragments;
+	fragments.clear();
+	double maxCharge = (double) charge;
+	while (!heap.empty()) {
+		std::pop_heap(heap.begin(), heap.end(), &heavierFragment);
+		InternalFragment& fragment = heap.back();
+		if ((fragment.mass + maxCharge * PROTON_MASS) / maxCharge > options.maxMz) break;
+
+		bool eligible = fragment.mass + PROTON_MASS >= options.minMz;
+		if (eligible && filterLosses && fragment.row > 1) {
+			eligible = hasLossSites(
+				workspace.lossSiteCounts, seqLen, &requirements[(fragment.row - 2) * N_LOSS_SITES],
+				fragment.start, fragment.end);
+		}
+		if (eligible) {
+			fragments.push_back(fragment);
+		}
+
+		// The next fragment from the same start residue and row
+		if (fragment.end < lastEnd && fragment.end - fragment.start < maxLength) {
+			fragment.end++;
+			fragment.mass = prefix[fragment.end] - prefix[fragment.start] - deltas[fragment.row];
+			std::push_heap(heap.begin(), heap.end(), &heavierFragment);
+		}
+		else {
+			heap.pop_back();
+		}
+	}
+
+	// The fragments are ordered by mass, so by m/z at each charge state
+	size_t limit = options.maxIons > 0 ? options.maxIons : std::numeric_limits<size_t>::max();
+	for (long cs = 1; cs <= charge; cs++) {
+		size_t minPos = (size_t) (2 * cs - 1);
+		std::string chargeStr = options.labels ? (cs > 1 ? StringCache::get(cs) : "") + "+" : std::string();
+		for (size_t ii = 0; ii < fragments.size() && ions.size() - first < limit; ii++) {
+			const InternalFragment& fragment = fragments[ii];
+			size_t length = fragment.end - fragment.start;
+			if (length < minPos) continue;
+			if (limitCharges) {
+				if (cs > fragmentBasicSites(workspace.basicSiteCounts, fragment.start, fragment.end)) continue;
+			}
+			double mz = (fragment.mass + (double) cs * PROTON_MASS) / (double) cs;
+			if (!options.inMzRange(mz)) continue;
+			ions.emplace_back(
+				mz,
+				options.labels ? label(sequence, fragment, losses, chargeStr) : std::string(),
+				(long) length);
+		}
+		workspace.chargeEnds.push_back(ions.size() - first);
+	}
+}
+
+std::string InternalIonGenerator::label(
+	const std::string& sequence,
+	const InternalFragment& fragment,
+	const std::vector<NeutralLossPair>& neutralLosses,
+	const std::string& chargeStr) const
+{
+	std::string residues = sequence.substr(fragment.start, fragment.end - fragment.start);
+	if (fragment.row == 0) {
+		return "by(" + residues + ")[" + chargeStr + "]";
+	}
+	if (fragment.row == 1) {
+		return "ay(" + residues + ")[" + chargeStr + "]";
+	}
+	return "[by(" + residues + ")-" + neutralLosses[fragment.row - 2].first + "][" + chargeStr + "]";
 }
 
 /* PrecursorIonGenerator */
 
 PrecursorIonGenerator::PrecursorIonGenerator() : IonGenerator("M") {}
 
-Ions PrecursorIonGenerator::generate(
+void PrecursorIonGenerator::generate(
 	const std::vector<double>& masses,
 	long charge,
-	const std::vector<NeutralLossPair>& neutralLosses,
+	const AppliedLosses& applied,
 	bool radical,
-	const std::string& sequence) const
-{
-	Ions ions;
-	ions.reserve(20);
-	
+	const std::string& sequence,
+	const IonGenerationOptions& options,
+	Workspace& workspace,
+	Ions& ions) const
+{	
 	// Only use one mass - if multiple masses are passed to the PrecursorIonGenerator,
 	// an exception needs to be thrown
 	double mass = masses[0];
 	
 	long seqLen = (long) sequence.size();
+	size_t first = ions.size();
+	workspace.chargeEnds.clear();
+
+	const std::vector<NeutralLossPair>* losses = &applied.losses;
+	const std::vector<unsigned>& requirements = applied.requirements;
+
+	// With residue-aware losses, the precursor has each loss requiring
+	// LossSites only if it contains them
+	std::vector<NeutralLossPair> applicableLosses;
+	if (options.residueLosses) {
+		countLossSites(sequence, workspace.seqMasses, workspace.lossSiteCounts);
+		for (size_t ii = 0; ii < losses->size(); ii++) {
+			if (hasLossSites(
+					workspace.lossSiteCounts, sequence.size(), &requirements[ii * N_LOSS_SITES],
+					0, sequence.size())) {
+				applicableLosses.push_back((*losses)[ii]);
+			}
+		}
+		losses = &applicableLosses;
+	}
 	
+	// Whether to keep an ion, within the m/z range and ion limit
+	size_t limit = options.maxIons > 0 ? options.maxIons : std::numeric_limits<size_t>::max();
+	auto keep = [&](double mz) {
+		return ions.size() - first < limit && options.inMzRange(mz);
+	};
+
 	for (long cs = 1; cs < charge + 1; cs++) {
-		std::string chargeSymbol = (radical ? RADICAL : "") + (cs > 1 ? StringCache::get(cs) : "") + "+";
+		std::string chargeSymbol = options.labels
+			? (radical ? RADICAL : "") + (cs > 1 ? StringCache::get(cs) : "") + "+" : std::string();
 		
-		ions.emplace_back(
-			(mass / (double) cs) + PROTON_MASS,
-			"[" + ionLabel + "+H][" + chargeSymbol + "]",
-			seqLen
-		);
+		double mz = (mass / (double) cs) + PROTON_MASS;
+		if (keep(mz)) {
+			ions.emplace_back(
+				mz,
+				options.labels ? "[" + ionLabel + "+H][" + chargeSymbol + "]" : std::string(),
+				seqLen
+			);
+		}
 
-		if (radical) {
+		if (radical && keep(mass / (double) cs)) {
 			ions.emplace_back(
 				mass / (double) cs,
-				ionLabel + "[" + chargeSymbol + "]",
+				options.labels ? ionLabel + "[" + chargeSymbol + "]" : std::string(),
 				seqLen
 			);
 		}
 		
-		for (NeutralLossPair neutralLoss : neutralLosses) {
+		for (const NeutralLossPair& neutralLoss : *losses) {
+			mz = (mass - neutralLoss.second) / (double) cs + PROTON_MASS;
+			if (!keep(mz)) continue;
 			ions.emplace_back(
-				(mass - neutralLoss.second) / (double) cs + PROTON_MASS,
-				"[" + ionLabel + "-" + neutralLoss.first + "][" + chargeSymbol + "]",
+				mz,
+				options.labels ? "[" + ionLabel + "-" + neutralLoss.first + "][" + chargeSymbol + "]" : std::string(),
 				seqLen);
 		}
+		workspace.chargeEnds.push_back(ions.size() - first);
 	}
-	
-	return ions;
 }
 
-/* Utility functions */
+/* Residue-aware neutral losses */
+
+LossSite lossSite(const std::string& lossLabel) {
+	if (lossLabel == "H2O") return LossSite::hydroxylOrAcid;
+	if (lossLabel == "NH3") return LossSite::basicOrAmide;
+	if (lossLabel == "H3PO4") return LossSite::phosphorylated;
+	return LossSite::any;
+}
+
+// The monoisotopic and average masses of HPO3, the phosphorylation
+// modification, and the tolerance within which a residue mass is taken to
+// carry it
+const double PHOSPHO_MASSES[2] = {79.96633052075, 79.979901};
+const double PHOSPHO_TOLERANCE = 0.005;
+
+bool isPhosphorylated(char residue, double residueMass) {
+	auto it = AA_MASSES.find(residue);
+	if (it == AA_MASSES.end()) return false;
+	return std::abs(residueMass - it->second.first - PHOSPHO_MASSES[0]) < PHOSPHO_TOLERANCE
+		|| std::abs(residueMass - it->second.second - PHOSPHO_MASSES[1]) < PHOSPHO_TOLERANCE;
+}
 
-void chargeIons(const Ions& sourceIons, Ions& target, long chargeState) {
-	double hMass = PROTON_MASS * (chargeState - 1);
-	long minPos = 2 * chargeState - 1;
-	std::string chargeStr = StringCache::get(chargeState) + "+";
-	for (const Ion& ion : sourceIons) {
-		if (ion.position >= minPos) {
-			std::string label = ion.label;
-			target.emplace_back(
-				(ion.mass + hMass) / (double) chargeState,
-				label.replace(ion.label.find('+'), 1, chargeStr),
-				ion.position);
+void countLossSites(
+	const std::string& sequence,
+	const std::vector<double>& seqMasses,
+	std::vector<unsigned>& counts)
+{
+	size_t stride = sequence.size() + 1;
+	counts.assign(N_LOSS_SITES * stride, 0);
+	unsigned* hydroxylOrAcid = &counts[static_cast<int>(LossSite::hydroxylOrAcid) * stride];
+	unsigned* basicOrAmide = &counts[static_cast<int>(LossSite::basicOrAmide) * stride];
+	unsigned* phosphorylated = &counts[static_cast<int>(LossSite::phosphorylated) * stride];
+
+	for (size_t ii = 0; ii < sequence.size(); ii++) {
+		char residue = sequence[ii];
+		bool water = residue == 'S' || residue == 'T' || residue == 'E' || residue == 'D';
+		bool ammonia = residue == 'R' || residue == 'K' || residue == 'N' || residue == 'Q';
+		bool phosphate = ii < seqMasses.size() && isPhosphorylated(residue, seqMasses[ii]);
+		hydroxylOrAcid[ii + 1] = hydroxylOrAcid[ii] + (water ? 1 : 0);
+		basicOrAmide[ii + 1] = basicOrAmide[ii] + (ammonia ? 1 : 0);
+		phosphorylated[ii + 1] = phosphorylated[ii] + (phosphate ? 1 : 0);
+	}
+}
+
+void lossRequirements(const std::vector<NeutralLossPair>& neutralLosses, std::vector<unsigned>& requirements) {
+	for (const NeutralLossPair& neutralLoss : neutralLosses) {
+		LossSite site = lossSite(neutralLoss.first);
+		for (size_t ii = 0; ii < N_LOSS_SITES; ii++) {
+			requirements.push_back(static_cast<int>(site) == (int) ii ? 1 : 0);
 		}
 	}
 }
 
+// The tolerance within which two stacked losses are taken to have the same
+// mass
+const double STACKED_LOSS_TOLERANCE = 1e-6;
+
+/*
+ * Appends the combinations of n of neutralLosses[index:], following those
+ * already chosen, given by their mass, label and requirements.
+ */
+void stackLosses(
+	const std::vector<NeutralLossPair>& neutralLosses,
+	const std::vector<unsigned>& singleRequirements,
+	size_t index,
+	size_t n,
+	double mass,
+	const std::string& label,
+	const std::array<unsigned, N_LOSS_SITES>& chosen,
+	std::vector<NeutralLossPair>& losses,
+	std::vector<unsigned>& requirements)
+{
+	if (n == 0) {
+		for (const NeutralLossPair& loss : losses) {
+			if (std::abs(loss.second - mass) < STACKED_LOSS_TOLERANCE) return;
+		}
+		losses.emplace_back(label, mass);
+		requirements.insert(requirements.end(), chosen.begin(), chosen.end());
+		return;
+	}
+
+	for (size_t ii = index; ii < neutralLosses.size(); ii++) {
+		// Repeats of a loss are taken together, so that they share a label,
+		// and the remaining losses follow this one in the list, so that each
+		// combination is produced once
+		std::string prefix = label.empty() ? label : label + "-";
+		for (size_t count = n; count >= 1; count--) {
+			if (count < n && ii + 1 == neutralLosses.size()) break;
+			std::array<unsigned, N_LOSS_SITES> stacked = chosen;
+			for (size_t site = 0; site < N_LOSS_SITES; site++) {
+				stacked[site] += (unsigned) count * singleRequirements[ii * N_LOSS_SITES + site];
+			}
+			stackLosses(
+				neutralLosses, singleRequirements, ii + 1, n - count,
+				mass + (double) count * neutralLosses[ii].second,
+				prefix + (count > 1 ? StringCache::get((long) count) : "") + neutralLosses[ii].first,
+				stacked, losses, requirements);
+		}
+	}
+}
+
+void stackNeutralLosses(
+	const std::vector<NeutralLossPair>& neutralLosses,
+	size_t maxLosses,
+	std::vector<NeutralLossPair>& losses,
+	std::vector<unsigned>& requirements)
+{
+	std::vector<unsigned> singleRequirements;
+	lossRequirements(neutralLosses, singleRequirements);
+
+	losses.clear();
+	requirements.clear();
+	for (size_t n = 1; n <= maxLosses; n++) {
+		stackLosses(neutralLosses, singleRequirements, 0, n, 0., "", {}, losses, requirements);
+	}
+}
+
+void applyNeutralLosses(
+	const std::vector<NeutralLossPair>& neutralLosses,
+	size_t maxLosses,
+	AppliedLosses& applied)
+{
+	if (maxLosses > 1) {
+		stackNeutralLosses(neutralLosses, maxLosses, applied.losses, applied.requirements);
+		return;
+	}
+	applied.losses = neutralLosses;
+	applied.requirements.clear();
+	lossRequirements(neutralLosses, applied.requirements);
+}
+
+bool hasLossSites(
+	const std::vector<unsigned>& counts,
+	size_t seqLen,
+	const unsigned* requirements,
+	size_t first,
+	size_t last)
+{
+	last = std::min(last, seqLen);
+	for (size_t site = 0; site < N_LOSS_SITES; site++) {
+		if (requirements[site] == 0) continue;
+		if (first >= last) return false;
+		const unsigned* siteCounts = &counts[site * (seqLen + 1)];
+		if (siteCounts[last] - siteCounts[first] < requirements[site]) return false;
+	}
+	return true;
+}
+
+/* Basic charge limit */
+
+void countBasicSites(const std::string& sequence, std::vector<unsigned>& counts) {
+	counts.assign(sequence.size() + 1, 0);
+	for (size_t ii = 0; ii < sequence.size(); ii++) {
+		char residue = sequence[ii];
+		bool basic = residue == 'K' || residue == 'R' || residue == 'H';
+		counts[ii + 1] = counts[ii] + (basic ? 1 : 0);
+	}
+}
+
+long fragmentBasicSites(const std::vector<unsigned>& counts, size_t first, size_t last) {
+	return (long) (counts[last] - counts[first]) + 1;
+}
+
+/* Utility functions */
+
+std::string chargeLabel(const std::string& label, size_t chargeIndex, const std::string& chargeStr) {
+	std::string charged;
+	charged.reserve(label.size() + chargeStr.size());
+	charged.append(label, 0, chargeIndex).append(chargeStr).append(label, chargeIndex + 1, std::string::npos);
+	return charged;
+}
+
 void mergeIonVectors(Ions& target, const Ions& source) {
 	size_t n = target.size();
 	target.insert(target.end(), std::make_move_iterator(source.begin()), std::make_move_iterator(source.end()));
 	std::inplace_merge(target.begin(), target.begin() + n, target.end());
 }
+
+/*
+ * Merges source into target, as std::inplace_merge with a sufficient buffer
+ * would, moving the shorter range into the buffer. Immonium ions are not
+ * ordered by position, so this keeps the output identical to the unbuffered
+ * version.
+ */
+template<typename T, typename Less>
+void bufferedMerge(std::vector<T>& target, std::vector<T>& source, std::vector<T>& buffer, Less less) {
+	size_t n = target.size();
+	buffer.clear();
+	if (n <= source.size()) {
+		buffer.insert(buffer.end(), std::make_move_iterator(target.begin()), std::make_move_iterator(target.end()));
+		target.clear();
+		std::merge(
+			std::make_move_iterator(buffer.begin()), std::make_move_iterator(buffer.end()),
+			std::make_move_iterator(source.begin()), std::make_move_iterator(source.end()),
+			std::back_inserter(target), less);
+		return;
+	}
+
+	if (source.empty()) return;
+
+	buffer.insert(buffer.end(), std::make_move_iterator(source.begin()), std::make_move_iterator(source.end()));
+	// Extend target using the moved-from elements as placeholders
+	target.insert(target.end(), std::make_move_iterator(source.begin()), std::make_move_iterator(source.end()));
+
+	// Merge backwards from the end of target, taking from buffer on ties
+	auto result = target.end();
+	auto last1 = target.begin() + n - 1;
+	auto last2 = buffer.end() - 1;
+	while (true) {
+		if (less(*last2, *last1)) {
+			*--result = std::move(*last1);
+			if (last1 == target.begin()) {
+				std::move_backward(buffer.begin(), last2 + 1, result);
+				return;
+			}
+			--last1;
+		}
+		else {
+			*--result = std::move(*last2);
+			if (last2 == buffer.begin()) return;
+			--last2;
+		}
+	}
+}
+
+void mergeIonVectors(Ions& target, Ions& source, Ions& buffer) {
+	bufferedMerge(target, source, buffer, [](const Ion& left, const Ion& right) { return left < right; });
+}
+
+void mergeIonPointers(
+	std::vector<const Ion*>& target,
+	std::vector<const Ion*>& source,
+	std::vector<const Ion*>& buffer)
+{
+	bufferedMerge(target, source, buffer, [](const Ion* left, const Ion* right) { return *left < *right; });
+}
@@ -1,6 +1,7 @@
 #ifndef _PEPFRAG_IONGENERATOR_H
 #define _PEPFRAG_IONGENERATOR_H
 
+#include <limits>
 #include <memory>
 #include <string>
 #include <unordered_map>
@@ -8,6 +9,7 @@
 #include <vector>
 
 #include "ion.h"
+#include "workspace.h"
 
 using NeutralLossPair = std::pair<std::string, double>;
 
@@ -24,6 +26,149 @@ const std::unordered_map<std::string, double> FIXED_MASSES = {
 
 const double PROTON_MASS = FIXED_MASSES.at("H");
 
+/*
+ * Options controlling the ions produced by IonGenerator::generate.
+ */
+struct IonGenerationOptions {
+	// Whether to build ion labels. If false, all labels are left empty
+	bool labels = true;
+	// Whether to apply the H2O, NH3 and H3PO4 neutral losses only to the
+	// fragments containing a residue from which they can occur (see
+	// LossSite). Other losses are applied to all fragments
+	bool residueLosses = false;
+	// The maximum number of neutral losses combined in one fragment. If
+	// greater than 1, the losses are stacked by stackNeutralLosses
+	size_t maxLosses = 1;
+	// The m/z range [minMz, maxMz] of the ions to generate. Ions outside it
+	// are skipped before their labels are built. Unbounded by default, as
+	// losses can give ions of negative m/z
+	double minMz = -std::numeric_limits<double>::infinity();
+	double maxMz = std::numeric_limits<double>::infinity();
+	// The maximum number of ions generated by each IonGenerator::generate
+	// call, keeping the first in the order generated, i.e. the lowest charge
+	// states. 0 for no limit
+	size_t maxIons = 0;
+
+	// Whether to limit the charge of each fragment to its number of basic
+	// sites, i.e. K, R and H residues and its N-terminal amine
+	bool basicChargeLimit = false;
+	// The range of the number of residues of internal fragments. A
+	// maxInternalLength of 0 allows any length
+	size_t minInternalLength = 2;
+	size_t maxInternalLength = 0;
+
+	// Whether the m/z range or ion limit may skip ions
+	bool bounded() const {
+		return minMz > -std::numeric_limits<double>::infinity()
+			|| maxMz < std::numeric_limits<double>::infinity() || maxIons > 0;
+	}
+
+	bool inMzRange(double mz) const {
+		return mz >= minMz && mz <= maxMz;
+	}
+};
+
+/*
+ * The residues from which a neutral loss can occur, for residue-aware
+ * losses.
+ */
+enum class LossSite {
+	// Any fragment, for losses without residue requirements
+	any = -1,
+	// S, T, E or D, for H2O
+	hydroxylOrAcid = 0,
+	// R, K, N or Q, for NH3
+	basicOrAmide = 1,
+	// A residue carrying a phosphate (HPO3) modification, for H3PO4
+	phosphorylated = 2
+};
+
+const size_t N_LOSS_SITES = 3;
+
+/*
+ * The residues from which the neutral loss with the label can occur.
+ */
+LossSite lossSite(const std::string& lossLabel);
+
+/*
+ * Sets counts to the number of residues of each LossSite (other than any)
+ * preceding each position 0 to sequence.size() of the sequence, at
+ * counts[site * (sequence.size() + 1) + position]. Phosphorylation is
+ * identified from the residue masses, seqMasses, which include any
+ * modifications.
+ */
+void countLossSites(
+	const std::string& sequence,
+	const std::vector<double>& seqMasses,
+	std::vector<unsigned>& counts);
+
+/*
+ * Appends, for each of the neutral losses, the number of residues of each
+ * LossSite (other than any) it requires to requirements.
+ */
+void lossRequirements(const std::vector<NeutralLossPair>& neutralLosses, std::vector<unsigned>& requirements);
+
+/*
+ * Sets losses to the combinations of up to maxLosses of the neutral losses,
+ * with repetition: the single losses, then each pair, and so on, each in
+ * order of the neutral losses. Combinations whose mass matches that of an
+ * earlier one are skipped. The labels join those of the losses with "-",
+ * prefixing repeated losses with their count, e.g. "2H2O-NH3". requirements
+ * is set as by lossRequirements for the combinations.
+ */
+void stackNeutralLosses(
+	const std::vector<NeutralLossPair>& neutralLosses,
+	size_t maxLosses,
+	std::vector<NeutralLossPair>& losses,
+	std::vector<unsigned>& requirements);
+
+/*
+ * The neutral losses as applied to the fragments by IonGenerator::generate.
+ */
+struct AppliedLosses {
+	// The neutral losses, stacked if maxLosses is greater than 1
+	std::vector<NeutralLossPair> losses;
+	// The requirements of the losses, as set by lossRequirements, used for
+	// residue-aware losses
+	std::vector<unsigned> requirements;
+};
+
+/*
+ * Sets applied to the neutral losses, stacked by stackNeutralLosses if
+ * maxLosses is greater than 1, and their requirements.
+ */
+void applyNeutralLosses(
+	const std::vector<NeutralLossPair>& neutralLosses,
+	size_t maxLosses,
+	AppliedLosses& applied);
+
+/*
+ * Returns whether residues [first, last) of a sequence of length seqLen
+ * include as many of each LossSite as requirements, N_LOSS_SITES counts as
+ * set by lossRequirements, using the counts from countLossSites.
+ */
+bool hasLossSites(
+	const std::vector<unsigned>& counts,
+	size_t seqLen,
+	const unsigned* requirements,
+	size_t first,
+	size_t last);
+
+/*
+ * Sets counts to the prefix counts of the basic residues, K, R and H, of the
+ * sequence, such that residues [first, last) include
+ * counts[last] - counts[first] of them.
+ */
+void countBasicSites(const std::string& sequence, std::vector<unsigned>& counts);
+
+/*
+ * Returns the number of basic sites of the fragment of residues
+ * [first, last), using the counts from countBasicSites: its basic residues
+ * and its own N-terminal amine, which every N-terminal, C-terminal and
+ * internal fragment has.
+ */
+long fragmentBasicSites(const std::vector<unsigned>& counts, size_t first, size_t last);
+
 // Forward declaration
 class IonGenerator;
 
@@ -40,12 +185,30 @@ class IonGenerator {
 
         static IonGeneratorPtr create(IonType type);
 
-        virtual Ions generate(
+        /*
+         * Returns the shared generator instance for the ion type. Generators
+         * are stateless, so the instance may be used from any thread.
+         */
+        static const IonGenerator& get(IonType type);
+
+        /*
+         * Appends the generated ions to ions, using the workspace buffers for
+         * any intermediate storage. The ions are appended in charge state
+         * order, and workspace.chargeEnds is set to the number appended up to
+         * and including each charge state, so that the ions generated at a
+         * lower charge are a prefix of those generated at a higher charge.
+         * losses are the neutral losses as set by applyNeutralLosses for
+         * options.maxLosses.
+         */
+        virtual void generate(
             const std::vector<double>& masses,
             long charge,
-            const std::vector<NeutralLossPair>& neutralLosses,
+            const AppliedLosses& losses,
             bool radical,
-            const std::string& sequence) const = 0;
+            const std::string& sequence,
+            const IonGenerationOptions& options,
+            Workspace& workspace,
+            Ions& ions) const = 0;
 };
 
 /*
@@ -56,34 +219,83 @@ class SimpleIonGenerator : public IonGenerator {
     public:
         explicit SimpleIonGenerator(const std::string& label);
 
-        virtual Ions generate(
+        virtual void generate(
             const std::vector<double>& masses,
             long charge,
-            const std::vector<NeutralLossPair>& neutralLosses,
+            const AppliedLosses& losses,
             bool radical,
-            const std::string& sequence) const override;
+            const std::string& sequence,
+            const IonGenerationOptions& options,
+            Workspace& workspace,
+            Ions& ions) const override;
+
+		/*
+		 * Computes the singly charged masses of the series, as generated,
+		 * into table, with a row for each radical ion if radical, then for
+		 * each of the neutral losses. Returns the index of the input masses
+		 * of the first table position.
+		 */
+		long massTable(
+			const std::vector<double>& masses,
+			const std::vector<NeutralLossPair>& neutralLosses,
+			bool radical,
+			std::vector<double>& deltas,
+			FragmentMassTable& table) const;
+
+		/*
+		 * The label of the ion at position, an index of the input masses,
+		 * in row of the massTable and at charge, as generated.
+		 */
+		std::string label(
+			const std::string& sequence,
+			long position,
+			size_t row,
+			long charge,
+			bool radical,
+			const std::vector<NeutralLossPair>& neutralLosses) const;
 
-	private:
+	protected:
 		virtual std::pair<int, int> preProcessMasses(
 			const std::vector<double>& masses) const;
 	
 		virtual Ion generateBaseIon(
 			double mass,
 			long position,
-			const std::string& sequence) const;
-			
-		virtual void generateRadicalIons(
-			Ions& ions,
-			double mass,
-			long position) const;
-			
-		virtual void generateNeutralLosses(
-			Ions& ions,
-			double mass,
-			long position,
-			const std::vector<NeutralLossPair>& neutralLosses) const;
-			
-		virtual double fixMass(double mass) const;
+			const std::string& sequence,
+			bool labels) const;
+
+		/*
+		 * The singly charged ion of the cell of the mass table, as generated
+		 * from its row: the base ion, then the radical ions, then the ions
+		 * with each of the neutral losses.
+		 */
+		Ion singlyChargedIon(
+			const FragmentMassTable& table,
+			size_t cell,
+			long firstPosition,
+			size_t nRadicals,
+			const std::vector<NeutralLossPair>& neutralLosses,
+			const std::string& sequence,
+			bool labels) const;
+
+		/*
+		 * The radical ions generated alongside each base ion, as pairs of
+		 * label suffix and the mass to be subtracted from the base ion mass.
+		 */
+		virtual const std::vector<NeutralLossPair>& radicalLosses() const;
+
+		/*
+		 * The offsets added, in order, to the input masses to give the base
+		 * ion masses.
+		 */
+		virtual std::pair<double, double> massOffsets() const;
+
+		/*
+		 * The residues [first, last) of a sequence of length seqLen in the
+		 * fragment at position, an index of the input masses. By default,
+		 * the N-terminal residues up to position.
+		 */
+		virtual std::pair<size_t, size_t> fragmentResidues(long position, size_t seqLen) const;
 };
 
 class BIonGenerator : public SimpleIonGenerator
@@ -94,12 +306,9 @@ class BIonGenerator : public SimpleIonGenerator
 		~BIonGenerator() override = default;
 		
 	private:
-		void generateRadicalIons(
-			Ions& ions,
-			double mass,
-			long position) const override;
-			
-		double fixMass(double mass) const override;
+		const std::vector<NeutralLossPair>& radicalLosses() const override;
+
+		std::pair<double, double> massOffsets() const override;
 };
 
 class YIonGenerator : public SimpleIonGenerator
@@ -110,8 +319,9 @@ class YIonGenerator : public SimpleIonGenerator
 		~YIonGenerator() override = default;
 		
 	private:
-			
-		double fixMass(double mass) const override;
+		std::pair<double, double> massOffsets() const override;
+
+		std::pair<size_t, size_t> fragmentResidues(long position, size_t seqLen) const override;
 };
 
 class AIonGenerator : public SimpleIonGenerator
@@ -122,12 +332,9 @@ class AIonGenerator : public SimpleIonGenerator
 		~AIonGenerator() override = default;
 		
 	private:
-		void generateRadicalIons(
-			Ions& ions,
-			double mass,
-			long position) const override;
-			
-		double fixMass(double mass) const override;
+		const std::vector<NeutralLossPair>& radicalLosses() const override;
+
+		std::pair<double, double> massOffsets() const override;
 };
 
 class CIonGenerator : public SimpleIonGenerator
@@ -138,12 +345,9 @@ class CIonGenerator : public SimpleIonGenerator
 		~CIonGenerator() override = default;
 		
 	private:
-		void generateRadicalIons(
-			Ions& ions,
-			double mass,
-			long position) const override;
-			
-		double fixMass(double mass) const override;
+		const std::vector<NeutralLossPair>& radicalLosses() const override;
+
+		std::pair<double, double> massOffsets() const override;
 };
 
 class ZIonGenerator : public SimpleIonGenerator
@@ -154,12 +358,11 @@ class ZIonGenerator : public SimpleIonGenerator
 		~ZIonGenerator() override = default;
 		
 	private:
-		void generateRadicalIons(
-			Ions& ions,
-			double mass,
-			long position) const override;
-			
-		double fixMass(double mass) const override;
+		const std::vector<NeutralLossPair>& radicalLosses() const override;
+
+		std::pair<double, double> massOffsets() const override;
+
+		std::pair<size_t, size_t> fragmentResidues(long position, size_t seqLen) const override;
 };
 
 class XIonGenerator : public SimpleIonGenerator
@@ -170,12 +373,11 @@ class XIonGenerator : public SimpleIonGenerator
 		~XIonGenerator() override = default;
 
 	private:
-		void generateRadicalIons(
-			Ions& ions,
-			double mass,
-			long position) const override;
+		const std::vector<NeutralLossPair>& radicalLosses() const override;
 
-		double fixMass(double mass) const override;
+		std::pair<double, double> massOffsets() const override;
+
+		std::pair<size_t, size_t> fragmentResidues(long position, size_t seqLen) const override;
 };
 
 class ImmoniumIonGenerator : public SimpleIonGenerator
@@ -192,9 +394,128 @@ class ImmoniumIonGenerator : public SimpleIonGenerator
 		Ion generateBaseIon(
 			double mass,
 			long position,
-			const std::string& sequence) const override;
-			
-		double fixMass(double mass) const override;
+			const std::string& sequence,
+			bool labels) const override;
+
+		std::pair<double, double> massOffsets() const override;
+
+		std::pair<size_t, size_t> fragmentResidues(long position, size_t seqLen) const override;
+};
+
+/*
+ * The side chain of a residue, for satellite ions, as pairs of monoisotopic
+ * and average masses: the whole side chain, lost by v ions, and the groups
+ * bonded to its beta carbon, lost by d and w ions by cleavage of the bond
+ * between the beta and gamma carbons.
+ */
+struct SideChain {
+	std::pair<double, double> mass;
+	std::vector<std::pair<double, double>> betaSubstituents;
+};
+
+/*
+ * The side chains of the standard residues. G and P have no entries, and A
+ * no beta substituents.
+ */
+extern const std::unordered_map<char, SideChain> SIDE_CHAINS;
+
+/*
+ * Generates satellite ions, the ions of a series formed by a further side
+ * chain cleavage at one residue of each fragment. The ladder positions
+ * whose residue is unmodified and has a side chain in SIDE_CHAINS are
+ * gathered, once for each of its offsets, into a satellite ladder whose
+ * masses are computed as for the parent series. The ions are labelled with
+ * a letter for the substituent lost where a residue has more than one, e.g.
+ * "wa3" and "wb3" for the ethyl and methyl losses of isoleucine.
+ */
+class SatelliteIonGenerator : public SimpleIonGenerator {
+	public:
+		explicit SatelliteIonGenerator(const std::string& label);
+
+		void generate(
+			const std::vector<double>& masses,
+			long charge,
+			const AppliedLosses& losses,
+			bool radical,
+			const std::string& sequence,
+			const IonGenerationOptions& options,
+			Workspace& workspace,
+			Ions& ions) const override;
+
+	private:
+		/*
+		 * The index of the residue of the fragment at position, an index of
+		 * the input masses, whose side chain is cleaved.
+		 */
+		virtual size_t satelliteResidue(long position, size_t seqLen) const = 0;
+
+		/*
+		 * Sets offsets to the masses subtracted from the parent ion for the
+		 * side chain, using its average masses if average is true, and
+		 * returns their number, at most two.
+		 */
+		virtual size_t sideChainOffsets(const SideChain& sideChain, bool average, double* offsets) const = 0;
+};
+
+/*
+ * d ions: a + H less a beta substituent of the C-terminal residue of the
+ * a fragment.
+ */
+class DIonGenerator : public SatelliteIonGenerator
+{
+	public:
+		DIonGenerator();
+
+		~DIonGenerator() override = default;
+
+	private:
+		std::pair<double, double> massOffsets() const override;
+
+		size_t satelliteResidue(long position, size_t seqLen) const override;
+
+		size_t sideChainOffsets(const SideChain& sideChain, bool average, double* offsets) const override;
+};
+
+/*
+ * v ions: y less the side chain of the N-terminal residue of the y
+ * fragment, plus H.
+ */
+class VIonGenerator : public SatelliteIonGenerator
+{
+	public:
+		VIonGenerator();
+
+		~VIonGenerator() override = default;
+
+	private:
+		std::pair<double, double> massOffsets() const override;
+
+		std::pair<size_t, size_t> fragmentResidues(long position, size_t seqLen) const override;
+
+		size_t satelliteResidue(long position, size_t seqLen) const override;
+
+		size_t sideChainOffsets(const SideChain& sideChain, bool average, double* offsets) const override;
+};
+
+/*
+ * w ions: z less a beta substituent of the N-terminal residue of the z
+ * fragment.
+ */
+class WIonGenerator : public SatelliteIonGenerator
+{
+	public:
+		WIonGenerator();
+
+		~WIonGenerator() override = default;
+
+	private:
+		std::pair<double, double> massOffsets() const override;
+
+		std::pair<size_t, size_t> fragmentResidues(long position, size_t seqLen) const override;
+
+		size_t satelliteResidue(long position, size_t seqLen) const override;
+
+		size_t sideChainOffsets(const SideChain& sideChain, bool average, double* offsets) const override;
 };
 
 class PrecursorIonGenerator : public IonGenerator
@@ -204,15 +525,63 @@ class PrecursorIonGenerator : public IonGenerator
 
 		~PrecursorIonGenerator() override = default;
 		
-		Ions generate(
+		void generate(
 			const std::vector<double>& masses,
 			long charge,
-			const std::vector<NeutralLossPair>& neutralLosses,
+			const AppliedLosses& losses,
+			bool radical,
+			const std::string& sequence,
+			const IonGenerationOptions& options,
+			Workspace& workspace,
+			Ions& ions) const override;
+};
+
+/*
+ * Generates the internal fragments, those formed by two backbone cleavages,
+ * of each run of residues excluding the terminal residues: by-type ions,
+ * ay-type ions and by-type ions less each neutral loss. The masses are the
+ * residue masses, from whose prefix sums the fragments are enumerated in
+ * order of mass, by a heap merge of the fragments of each start residue and
+ * row, which increase in mass with their length. The ions of each charge
+ * state are therefore ordered by mass, and have as position their number
+ * of residues.
+ */
+class InternalIonGenerator : public IonGenerator
+{
+	public:
+		InternalIonGenerator();
+
+		void generate(
+			const std::vector<double>& masses,
+			long charge,
+			const AppliedLosses& losses,
 			bool radical,
-			const std::string& sequence) const override;
+			const std::string& sequence,
+			const IonGenerationOptions& options,
+			Workspace& workspace,
+			Ions& ions) const override;
+
+	private:
+		std::string label(
+			const std::string& sequence,
+			const InternalFragment& fragment,
+			const std::vector<NeutralLossPair>& neutralLosses,
+			const std::string& chargeStr) const;
 };
 
-void chargeIons(const Ions& sourceIons, Ions& target, long chargeState);
+/*
+ * Builds the label of a multiply charged ion by replacing the "+" at
+ * chargeIndex in its singly charged label with chargeStr.
+ */
+std::string chargeLabel(const std::string& label, size_t chargeIndex, const std::string& chargeStr);
+
+inline std::string neutralLossLabel(
+	const std::string& typeChar,
+	const NeutralLossPair& neutralLoss,
+	long position)
+{
+	return "[" + typeChar + std::to_string(position + 1) + "-" + neutralLoss.first + "][+]";
+}
 
 inline Ion generateNeutralLossIon(
 	const std::string& typeChar,
@@ -222,11 +591,26 @@ inline Ion generateNeutralLossIon(
 {
 	return {
 		mass - neutralLoss.second,
-		"[" + typeChar + std::to_string(position + 1) + "-" + neutralLoss.first + "][+]",
+		neutralLossLabel(typeChar, neutralLoss, position),
 		position + 1
 	};
 }
 
 void mergeIonVectors(Ions& target, const Ions& source);
 
+/*
+ * Merges source into target, ordered by position, using buffer as scratch
+ * space in place of a temporary allocation. The ions in source are moved from.
+ */
+void mergeIonVectors(Ions& target, Ions& source, Ions& buffer);
+
+/*
+ * Merges source into target as mergeIonVectors, for pointers to ions, giving
+ * the same order as mergeIonVectors would for the ions pointed to.
+ */
+void mergeIonPointers(
+	std::vector<const Ion*>& target,
+	std::vector<const Ion*>& source,
+	std::vector<const Ion*>& buffer);
+
 #endif // _PEPFRAG_IONGENERATOR_H
@@ -0,0 +1,271 @@
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "ionconfig.h"
+#include "iongenerator.h"
+#include "isotope.h"
+
+/*
+ * A stable isotope of an element, with its nominal and exact mass shifts
+ * from the lightest isotope and its natural abundance.
+ */
+struct ElementIsotope {
+	size_t nominalShift;
+	double shift;
+	double abundance;
+};
+
+// The stable isotopes of each Element, from the IUPAC representative
+// isotopic compositions
+const std::array<std::vector<ElementIsotope>, N_ELEMENTS> ELEMENT_ISOTOPES{{
+	// C
+	{{0, 0., 0.9893}, {1, 13.00335483507 - 12., 0.0107}},
+	// H
+	{{0, 0., 0.999885}, {1, 2.01410177812 - 1.00782503207, 0.000115}},
+	// N
+	{{0, 0., 0.99636}, {1, 15.0001088982 - 14.0030740048, 0.00364}},
+	// O
+	{{0, 0., 0.99757}, {1, 16.99913170 - 15.99491461956, 0.00038},
+	 {2, 17.9991610 - 15.99491461956, 0.00205}},
+	// S
+	{{0, 0., 0.9499}, {1, 32.97145876 - 31.97207100, 0.0075},
+	 {2, 33.96786690 - 31.97207100, 0.0425}, {4, 35.96708076 - 31.97207100, 0.0001}}
+}};
+
+/*
+ * Sets the first nPeaks of the output distribution to the product of the
+ * left and right distributions. The output must not overlap the inputs.
+ */
+void convolvePatterns(
+	const double* leftAbundances,
+	const double* leftShiftSums,
+	const double* rightAbundances,
+	const double* rightShiftSums,
+	size_t nPeaks,
+	double* abundances,
+	double* shiftSums)
+{
+	for (size_t peak = 0; peak < nPeaks; peak++) {
+		double abundance = 0.;
+		double shiftSum = 0.;
+		for (size_t ii = 0; ii <= peak; ii++) {
+			abundance += leftAbundances[ii] * rightAbundances[peak - ii];
+			shiftSum += leftShiftSums[ii] * rightAbundances[peak - ii]
+				+ leftAbundances[ii] * rightShiftSums[peak - ii];
+		}
+		abundances[peak] = abundance;
+		shiftSums[peak] = shiftSum;
+	}
+}
+
+/* IsotopeCalculator */
+
+void IsotopeCalculator::growPowers(size_t element, size_t count) {
+	std::vector<double>& abundances = powerAbundances[element];
+	std::vector<double>& shiftSums = powerShiftSums[element];
+	size_t cached = abundances.size() / width;
+	if (count < cached) return;
+
+	// Each count's distribution adds one atom to that of the count before,
+	// one isotope at a time
+	abundances.resize((count + 1) * width, 0.);
+	shiftSums.resize((count + 1) * width, 0.);
+	for (size_t n = cached; n <= count; n++) {
+		const double* previousAbundances = abundances.data() + (n - 1) * width;
+		const double* previousShiftSums = shiftSums.data() + (n - 1) * width;
+		double* nextAbundances = abundances.data() + n * width;
+		double* nextShiftSums = shiftSums.data() + n * width;
+		for (const ElementIsotope& isotope : ELEMENT_ISOTOPES[element]) {
+			for (size_t peak = isotope.nominalShift; peak < width; peak++) {
+				double abundance = previousAbundances[peak - isotope.nominalShift];
+				nextAbundances[peak] += abundance * isotope.abundance;
+				nextShiftSums[peak] += (previousShiftSums[peak - isotope.nominalShift]
+					+ abundance * isotope.shift) * isotope.abundance;
+			}
+		}
+	}
+}
+
+void IsotopeCalculator::pattern(const Composition& composition, size_t nPeaks, IsotopePattern& result) {
+	// Wider distributions are cached from scratch, doubling the width to
+	// limit the number of times the cache is rebuilt
+	if (nPeaks > width) {
+		width = std::max(nPeaks, 2 * width);
+		for (size_t element = 0; element < N_ELEMENTS; element++) {
+			// The distribution of no atoms
+			powerAbundances[element].assign(width, 0.);
+			powerAbundances[element][0] = 1.;
+			powerShiftSums[element].assign(width, 0.);
+		}
+	}
+
+	result.abundances.assign(nPeaks, 0.);
+	result.shiftSums.assign(nPeaks, 0.);
+	result.abundances[0] = 1.;
+	scratch.abundances.resize(nPeaks);
+	scratch.shiftSums.resize(nPeaks);
+
+	bool empty = true;
+	for (size_t element = 0; element < N_ELEMENTS; element++) {
+		long count = composition[element];
+		if (count < 0) {
+			throw std::invalid_argument("Negative element count in composition: " + std::to_string(count));
+		}
+		if (count == 0) continue;
+
+		growPowers(element, (size_t) count);
+		const double* abundances = powerAbundances[element].data() + count * width;
+		const double* shiftSums = powerShiftSums[element].data() + count * width;
+		// The distribution of the first element present is that of its atoms
+		if (empty) {
+			std::copy(abundances, abundances + nPeaks, result.abundances.begin());
+			std::copy(shiftSums, shiftSums + nPeaks, result.shiftSums.begin());
+			empty = false;
+			continue;
+		}
+		convolvePatterns(
+			result.abundances.data(), result.shiftSums.data(), abundances, shiftSums,
+			nPeaks, scratch.abundances.data(), scratch.shiftSums.data());
+		std::swap(result.abundances, scratch.abundances);
+		std::swap(result.shiftSums, scratch.shiftSums);
+	}
+}
+
+/*
+ * The composition of the ion less its residues and charging protons, i.e.
+ * of its termini and the atoms gained or lost in its formation.
+ */
+Composition ionCompositionDelta(IonType type) {
+	switch (type) {
+		case IonType::precursor:
+		case IonType::y:
+			return {0, 2, 0, 1, 0};
+		case IonType::b:
+			return {0, 0, 0, 0, 0};
+		case IonType::a:
+			return {-1, 0, 0, -1, 0};
+		case IonType::c:
+			return {0, 3, 1, 0, 0};
+		case IonType::z:
+			return {0, 0, -1, 1, 0};
+		case IonType::x:
+			return {1, 0, 0, 2, 0};
+		default:
+			throw std::invalid_argument(
+				"Ion type not supported for isotope distributions: "
+				+ std::to_string(static_cast<int>(type)));
+	}
+}
+
+/*
+ * The mean nominal mass shift of the isotopes of the composition.
+ */
+double meanNominalShift(const Composition& composition) {
+	double shift = 0.;
+	for (size_t element = 0; element < N_ELEMENTS; element++) {
+		for (const ElementIsotope& isotope : ELEMENT_ISOTOPES[element]) {
+			shift += (double) composition[element] * (double) isotope.nominalShift * isotope.abundance;
+		}
+	}
+	return shift;
+}
+
+/*
+ * Appends the nPeaks most abundant peaks of the ion with the composition and
+ * monoisotopic m/z, in order of m/z.
+ */
+void appendIonPeaks(
+	const Composition& composition,
+	double monoMz,
+	long charge,
+	size_t nPeaks,
+	IsotopeCalculator& calculator,
+	IsotopePattern& pattern,
+	std::vector<size_t>& order,
+	std::vector<double>& mz,
+	std::vector<double>& abundances)
+{
+	// The most abundant peak is within one of the mean shift, so the nPeaks
+	// around it are within nPeaks of the mean
+	size_t window = (size_t) std::ceil(meanNominalShift(composition)) + nPeaks + 1;
+	calculator.pattern(composition, window, pattern);
+
+	order.resize(window);
+	std::iota(order.begin(), order.end(), (size_t) 0);
+	std::partial_sort(order.begin(), order.begin() + nPeaks, order.end(), [&](size_t left, size_t right) {
+		return pattern.abundances[left] > pattern.abundances[right]
+			|| (pattern.abundances[left] == pattern.abundances[right] && left < right);
+	});
+	std::sort(order.begin(), order.begin() + nPeaks);
+
+	for (size_t ii = 0; ii < nPeaks; ii++) {
+		mz.push_back(monoMz + pattern.shift(order[ii]) / (double) charge);
+		abundances.push_back(pattern.abundances[order[ii]]);
+	}
+}
+
+void ionIsotopes(
+	IonType type,
+	long charge,
+	size_t nPeaks,
+	IsotopeCalculator& calculator,
+	Workspace& workspace,
+	std::vector<double>& mz,
+	std::vector<double>& abundances)
+{
+	Composition delta = ionCompositionDelta(type);
+	delta[static_cast<size_t>(Element::H)] += charge;
+
+	mz.clear();
+	abundances.clear();
+
+	// The composition of the residues before each position of the sequence
+	const std::string& sequence = workspace.sequence;
+	std::vector<Composition> prefixes(sequence.size() + 1, Composition{});
+	for (size_t ii = 0; ii < sequence.size(); ii++) {
+		const Composition& residue = AA_COMPOSITIONS.at(sequence[ii]);
+		for (size_t element = 0; element < N_ELEMENTS; element++) {
+			prefixes[ii + 1][element] = prefixes[ii][element] + residue[element];
+		}
+	}
+
+	IsotopePattern pattern;
+	std::vector<size_t> order;
+	Composition composition;
+	if (type == IonType::precursor) {
+		for (size_t element = 0; element < N_ELEMENTS; element++) {
+			composition[element] = prefixes.back()[element] + delta[element];
+		}
+		double monoMz = workspace.precMasses[0] / (double) charge + PROTON_MASS;
+		appendIonPeaks(composition, monoMz, charge, nPeaks, calculator, pattern, order, mz, abundances);
+		return;
+	}
+
+	bool nTerminal = type == IonType::b || type == IonType::a || type == IonType::c;
+	const SimpleIonGenerator& generator = static_cast<const SimpleIonGenerator&>(IonGenerator::get(type));
+	FragmentMassTable& table = workspace.table;
+	long firstIndex = generator.massTable(
+		ionTypeMasses(type, workspace), {}, false, workspace.deltas, table);
+
+	size_t seqLen = sequence.size();
+	const double* masses = table.row(1, 0);
+	for (size_t ii = 0; ii < table.nPositions; ii++) {
+		// The fragment at ladder index i has i + 1 residues
+		size_t nResidues = (size_t) firstIndex + ii + 1;
+		const Composition& begin = nTerminal ? prefixes[0] : prefixes[seqLen - nResidues];
+		const Composition& end = nTerminal ? prefixes[nResidues] : prefixes[seqLen];
+		for (size_t element = 0; element < N_ELEMENTS; element++) {
+			composition[element] = end[element] - begin[element] + delta[element];
+		}
+
+		// As computeFragmentMasses charges the singly charged masses
+		double monoMz = charge > 1
+			? (masses[ii] + PROTON_MASS * (double) (charge - 1)) / (double) charge : masses[ii];
+		appendIonPeaks(composition, monoMz, charge, nPeaks, calculator, pattern, order, mz, abundances);
+	}
+}
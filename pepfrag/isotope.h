@@ -0,0 +1,89 @@
+#ifndef _PEPFRAG_ISOTOPE_H
+#define _PEPFRAG_ISOTOPE_H
+
+#include <array>
+#include <cstddef>
+#include <vector>
+
+#include "ion.h"
+#include "mass.h"
+#include "workspace.h"
+
+/*
+ * An isotope distribution, truncated to the peaks at nominal mass shifts of
+ * 0 to size() - 1 from the monoisotopic mass. Each peak aggregates the
+ * isotopic variants at its nominal shift, with their total abundance and the
+ * abundance-weighted sum of their exact mass shifts.
+ */
+struct IsotopePattern {
+	std::vector<double> abundances;
+	std::vector<double> shiftSums;
+
+	size_t size() const { return abundances.size(); }
+
+	// The mean exact mass shift of the variants of the peak
+	double shift(size_t peak) const {
+		return abundances[peak] > 0. ? shiftSums[peak] / abundances[peak] : (double) peak;
+	}
+};
+
+/*
+ * Computes the isotope distributions of elemental compositions, from the
+ * monoisotopic peak, as the product of the distributions of the atoms of
+ * each element. The distribution of each count of each element is cached
+ * once computed, so that the distribution of any composition costs one
+ * truncated convolution per element.
+ *
+ * The cache grows with the largest count of each element and the largest
+ * number of peaks requested, so an IsotopeCalculator must not be shared
+ * between threads.
+ */
+class IsotopeCalculator {
+	public:
+		/*
+		 * Sets result to the first nPeaks peaks of the distribution of the
+		 * composition. Throws std::invalid_argument for negative element
+		 * counts.
+		 */
+		void pattern(const Composition& composition, size_t nPeaks, IsotopePattern& result);
+
+	private:
+		// Extends the cache of the element to count atoms
+		void growPowers(size_t element, size_t count);
+
+		// The number of peaks of each cached distribution
+		size_t width = 0;
+		// The abundances and shift sums of the distribution of n atoms of
+		// each element, at offset n * width
+		std::array<std::vector<double>, N_ELEMENTS> powerAbundances;
+		std::array<std::vector<double>, N_ELEMENTS> powerShiftSums;
+		IsotopePattern scratch;
+};
+
+/*
+ * Sets mz and abundances to the nPeaks most abundant isotope peaks, in order
+ * of m/z, of the ions of the type at the charge state, taking the sequence
+ * and masses from the workspace, e.g. as set by setPeptideMasses. For the
+ * precursor, there is one set of peaks; for the b, a and c and y, z and x
+ * series, there is one for each fragment, in order of position.
+ *
+ * Each ion's composition is accumulated from AA_COMPOSITIONS along its
+ * ladder, including the protons charging it, and its distribution computed
+ * up to nPeaks past its mean nominal mass shift, which bounds its most
+ * abundant peaks. The peaks are at the m/z of the monoisotopic ion, as
+ * generated, plus the mean mass shift of each peak over the charge, and
+ * their abundances are fractions of all of the ion's isotopic variants.
+ * Modifications have no composition, so they shift the peaks without
+ * changing their abundances, and the masses must be monoisotopic. Throws
+ * std::invalid_argument for other ion types.
+ */
+void ionIsotopes(
+	IonType type,
+	long charge,
+	size_t nPeaks,
+	IsotopeCalculator& calculator,
+	Workspace& workspace,
+	std::vector<double>& mz,
+	std::vector<double>& abundances);
+
+#endif // _PEPFRAG_ISOTOPE_H
@@ -7,6 +7,7 @@
 #include <vector>
 
 #include "mass.h"
+#include "tracing.h"
 
 const std::unordered_map< char, std::pair<double, double> > AA_MASSES{
 	{'G', std::pair<double, double> {57.02146372069, 57.051402191402}},
@@ -31,6 +32,30 @@ const std::unordered_map< char, std::pair<double, double> > AA_MASSES{
 	{'W', std::pair<double, double> {186.07931295073, 186.210313751855}}
 };
 
+// C, H, N, O and S counts
+const std::unordered_map<char, Composition> AA_COMPOSITIONS{
+	{'G', Composition{2, 3, 1, 1, 0}},
+	{'A', Composition{3, 5, 1, 1, 0}},
+	{'S', Composition{3, 5, 1, 2, 0}},
+	{'P', Composition{5, 7, 1, 1, 0}},
+	{'V', Composition{5, 9, 1, 1, 0}},
+	{'T', Composition{4, 7, 1, 2, 0}},
+	{'C', Composition{3, 5, 1, 1, 1}},
+	{'I', Composition{6, 11, 1, 1, 0}},
+	{'L', Composition{6, 11, 1, 1, 0}},
+	{'N', Composition{4, 6, 2, 2, 0}},
+	{'D', Composition{4, 5, 1, 3, 0}},
+	{'Q', Composition{5, 8, 2, 2, 0}},
+	{'K', Composition{6, 12, 2, 1, 0}},
+	{'E', Composition{5, 7, 1, 3, 0}},
+	{'M', Composition{5, 9, 1, 1, 1}},
+	{'H', Composition{6, 7, 3, 1, 0}},
+	{'F', Composition{9, 9, 1, 1, 0}},
+	{'R', Composition{6, 12, 4, 1, 0}},
+	{'Y', Composition{9, 9, 1, 2, 0}},
+	{'W', Composition{11, 10, 2, 1, 0}}
+};
+
 const std::vector< std::function<double(char)> > GET_MASS_FUNCTIONS{
     [](char r) { return AA_MASSES.at(r).first; },
     [](char r) { return AA_MASSES.at(r).second; }
@@ -44,6 +69,8 @@ std::vector<double> calculateMass(
     const std::map<long, double>& modSiteMasses,
     long massType
 ) {
+    PEPFRAG_TRACE_SPAN("calculateMass");
+
     auto massGetter = GET_MASS_FUNCTIONS[massType];
 
 	size_t seqLen = sequence.size();
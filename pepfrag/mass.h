@@ -1,10 +1,43 @@
 #ifndef _PEPFRAG_MASS_H
 #define _PEPFRAG_MASS_H
 
+#include <array>
+#include <cstddef>
 #include <map>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+/*
+ * The monoisotopic and average masses of each residue.
+ */
+extern const std::unordered_map<char, std::pair<double, double>> AA_MASSES;
+
+/*
+ * The elements of peptides, excluding any modifications.
+ */
+enum class Element {
+	C = 0,
+	H = 1,
+	N = 2,
+	O = 3,
+	S = 4
+};
+
+const size_t N_ELEMENTS = 5;
+
+/*
+ * An elemental composition, as the number of atoms of each Element.
+ */
+using Composition = std::array<long, N_ELEMENTS>;
+
+/*
+ * The elemental composition of each residue, i.e. of the amino acid less
+ * H2O, as for AA_MASSES.
+ */
+extern const std::unordered_map<char, Composition> AA_COMPOSITIONS;
+
 struct ModMassSite {
 	long site;
 	double mass;
@@ -6,13 +6,17 @@ generate theoretical ions useful for annotating mass spectra (MSn).
 """
 from __future__ import annotations
 
+import array
 import dataclasses
 import enum
 from typing import Dict, List, Optional, Sequence, Tuple, Union
 
-from cpepfrag import calculate_mass, generate_ions
+from cpepfrag import (
+    PeptideBase, fragment_peptides as _fragment_peptides, register_ion_types as
+    _register_ion_types
+)
 
-from .constants import AA_MASSES, FIXED_MASSES, MassType
+from .constants import AA_MASSES, FIXED_MASSES, MassFormat, MassType
 
 
 Ion = Tuple[float, str, int]
@@ -48,6 +52,74 @@ class IonType(enum.Enum):
     c = 6  #: c-type ions
     z = 7  #: z-type ions
     x = 8  #: x-type ions
+    internal = 9  #: Internal by- and ay-type ions
+    d = 10  #: d-type satellite ions
+    v = 11  #: v-type satellite ions
+    w = 12  #: w-type satellite ions
+
+
+# array.array type codes for each MassFormat
+_MASS_FORMAT_TYPECODES = {
+    MassFormat.float64: "d",
+    MassFormat.float32: "f",
+    MassFormat.fixed: "i",
+}
+
+
+@dataclasses.dataclass(frozen=True)
+class TopDownIons:
+    """
+    The ions generated by :meth:`Peptide.fragment_top_down`, as parallel
+    arrays.
+
+    Attributes:
+        mz: The ion m/z values, in the requested :class:`MassFormat`.
+        positions: The sequence positions (as 32-bit integers).
+        charges: The charge states (as 32-bit integers).
+        ion_types: The :class:`IonType` values (as 8-bit integers).
+        labels: The ion labels, if requested, as generated by
+                :meth:`Peptide.fragment`, otherwise None.
+
+    """
+    mz: array.array
+    positions: array.array
+    charges: array.array
+    ion_types: array.array
+    labels: Optional[List[str]] = None
+
+    def __len__(self) -> int:
+        return len(self.mz)
+
+
+@dataclasses.dataclass(frozen=True)
+class IsotopePeaks:
+    """
+    The isotope peaks of the ions of one type, computed by
+    :meth:`Peptide.fragment_isotopes`: the `n_peaks` most abundant of each
+    ion, in order of m/z, for each ion in order of position.
+
+    Attributes:
+        mz: The peak m/z values.
+        abundances: The peak abundances, as fractions of all of the isotopic
+                    variants of the ion.
+        n_peaks: The number of peaks of each ion.
+
+    """
+    mz: array.array
+    abundances: array.array
+    n_peaks: int
+
+    def __len__(self) -> int:
+        return len(self.mz) // self.n_peaks
+
+    def envelope(self, index: int) -> List[Tuple[float, float]]:
+        """
+        Returns the (m/z, abundance) peaks of the ion at the index.
+
+        """
+        start = index * self.n_peaks
+        end = start + self.n_peaks
+        return list(zip(self.mz[start:end], self.abundances[start:end]))
 
 
 IonTypesDict = Dict[IonType, List[Union[str, Tuple[str, float]]]]
@@ -67,6 +139,41 @@ DEFAULT_IONS: IonTypesDict = {
 }
 
 
+CID_IONS: IonTypesDict = {
+    IonType.b: [],
+    IonType.y: []
+}
+
+
+ETD_IONS: IonTypesDict = {
+    IonType.c: [],
+    IonType.z: []
+}
+
+
+ETHCD_IONS: IonTypesDict = {
+    IonType.b: [],
+    IonType.y: [],
+    IonType.c: [],
+    IonType.z: []
+}
+
+
+class IonPreset(enum.Enum):
+    """
+    Enumeration of the built-in ion type configurations. These are registered
+    with the C++ extension once, on import, so that their configuration does
+    not need to be converted on each call to :meth:`Peptide.fragment`. A
+    configuration dictionary which is modified, or reassigned, afterwards is
+    registered again on its next use.
+
+    """
+    default = enum.auto()  #: `DEFAULT_IONS`
+    cid = enum.auto()  #: `CID_IONS`
+    etd = enum.auto()  #: `ETD_IONS`
+    ethcd = enum.auto()  #: `ETHCD_IONS`
+
+
 AA_TYPE_MASSES = {
     (mass_type, aa): getattr(masses, mass_type.name)
     for aa, masses in AA_MASSES.items()
@@ -101,6 +208,85 @@ def _reformat_ion_types(ion_types: IonTypesDict) -> CIonTypesDict:
     return new_ion_types
 
 
+def register_ion_types(ion_types: IonTypesDict) -> int:
+    """
+    Registers an ion type configuration with the C++ extension, so that it is
+    converted only once, rather than on every call to :meth:`Peptide.fragment`.
+
+    Args:
+        ion_types: Dictionary of :class:`IonType` s to list of configured
+                   neutral losses.
+
+    Returns:
+        Handle which may be passed as the `ion_types` argument of
+        :meth:`Peptide.fragment`.
+
+    """
+    return _register_ion_types(
+        _reformat_ion_types({t: list(l) for t, l in ion_types.items()})
+    )
+
+
+def _preset_ion_types(preset: IonPreset) -> IonTypesDict:
+    """
+    Returns the current configuration dictionary of the preset, looked up at
+    call time so that reassigned module attributes are followed.
+
+    """
+    return {
+        IonPreset.default: DEFAULT_IONS,
+        IonPreset.cid: CID_IONS,
+        IonPreset.etd: ETD_IONS,
+        IonPreset.ethcd: ETHCD_IONS,
+    }[preset]
+
+
+# The handle of each preset, with a copy of the configuration registered
+_PRESET_HANDLES: Dict[IonPreset, Tuple[int, IonTypesDict]] = {}
+
+
+def _preset_handle(preset: IonPreset) -> int:
+    """
+    Returns the registered handle of the preset, registering its current
+    configuration if it has changed since it was last registered.
+
+    """
+    ion_types = _preset_ion_types(preset)
+    registered = _PRESET_HANDLES.get(preset)
+    if registered is None or registered[1] != ion_types:
+        registered = (
+            register_ion_types(ion_types),
+            {t: list(l) for t, l in ion_types.items()}
+        )
+        _PRESET_HANDLES[preset] = registered
+    return registered[0]
+
+
+for _preset in IonPreset:
+    _preset_handle(_preset)
+
+
+IonTypesArg = Optional[Union[IonTypesDict, IonPreset, int]]
+
+
+def _resolve_ion_types(
+        ion_types: IonTypesArg
+) -> Union[CIonTypesDict, int]:
+    """
+    Converts an `ion_types` argument into the form accepted by the C++
+    extension: either a registered configuration handle or a reformatted
+    ion type dictionary.
+
+    """
+    if ion_types is None:
+        return _preset_handle(IonPreset.default)
+    if isinstance(ion_types, IonPreset):
+        return _preset_handle(ion_types)
+    if isinstance(ion_types, int):
+        return ion_types
+    return _reformat_ion_types(ion_types)
+
+
 class UnknownModificationSite(Exception):
     """
     An exception to represent the detection of an unknown/uninterpretable
@@ -109,78 +295,42 @@ class UnknownModificationSite(Exception):
     """
 
 
-class Peptide:
+class Peptide(PeptideBase):
     """
     A class to represent a peptide, including its charge state and any
     modifications, including PTMs and quantitative tags. The class should be
     used to fragment the peptides for mass spectrum annotation.
 
+    The attributes are stored by the C++ extension, which converts the
+    sequence and modifications once and caches the resulting masses until
+    `seq`, `mods` or `mass_type` is reassigned. Changes made in place to a
+    `mods` list are also detected.
+
+    Args:
+        sequence: The peptide sequence (single character format).
+        charge: The charge state of the peptide.
+        modifications: The modifications applied to the peptide.
+        mass_type: The type of masses used in calculations
+                   (see :class:`MassType`). Defaults to `MassType.mono`.
+        radical: Flag indicating whether the peptide is a radical peptide.
+                 This flag influences the ion candidates generated during
+                 fragmentation.
+
     Attributes:
         mass_type: Type of masses used in calculations (see :class:`MassType`).
         radical: Flag indicating whether the peptide is a radical peptide.
 
     """
 
-    __slots__ = ("seq", "charge", "mods", "mass_type", "radical",)
-
-    def __init__(
-            self,
-            sequence: str,
-            charge: int,
-            modifications: Sequence[ModSite],
-            mass_type: MassType = MassType.mono,
-            radical: bool = False
-    ):
-        """
-        Initializes the Peptide object.
-
-        Args:
-            sequence: The peptide sequence (single character format).
-            charge: The charge state of the peptide.
-            modifications: The modifications applied to the peptide.
-            mass_type: The type of masses used in calculations
-                       (see :class:`MassType`).
-            radical: Flag indicating whether the peptide is a radical peptide.
-                     This flag influences the ion candidates generated during
-                     fragmentation.
+    __slots__ = ()
 
-        """
-        self.seq = sequence
-        self.charge = charge
-        self.mods = modifications
-        self.mass_type: MassType = mass_type
-        self.radical: bool = radical
-
-    @property
-    def peptide_mass(self) -> List[float]:
-        """
-        The mass of the peptide along the sequence, with each position
-        calculated separately.
+    _ATTRIBUTES = ("seq", "charge", "mods", "mass_type", "radical",)
 
-        Note:
-            In the returned list, index 0 is the N-terminus mass, while index -1
-            is the C-terminus mass.
-
-        """
-        return self.calculate_mass()
-
-    @property
-    def mass(self) -> float:
-        """
-        Total mass of the peptide, including modifications.
-
-        """
-        pep_mass = self.peptide_mass
-        mass = sum(pep_mass) + FIXED_MASSES["H2O"]
-        return mass
-
-    @property
-    def mz(self) -> float:
-        """
-        Calculates the mass-to-charge ratio of the peptide.
-
-        """
-        return (self.mass / self.charge) + FIXED_MASSES["H"]
+    # Implemented by PeptideBase; repeated here to be documented with the class
+    peptide_mass = PeptideBase.peptide_mass
+    mass = PeptideBase.mass
+    mz = PeptideBase.mz
+    calculate_mass = PeptideBase.calculate_mass
 
     def __repr__(self) -> str:
         """
@@ -190,7 +340,7 @@ class Peptide:
             Official representation of the Peptide object.
 
         """
-        out = {s: getattr(self, s) for s in self.__class__.__slots__}
+        out = {s: getattr(self, s) for s in self._ATTRIBUTES}
         return f"<{self.__class__.__name__} {out}>"
 
     def __str__(self) -> str:
@@ -217,6 +367,17 @@ class Peptide:
         """
         return hash((self.seq, self.charge, tuple(self.mods)))
 
+    def __reduce__(self):
+        """
+        Supports pickling and copying, which would otherwise be unavailable
+        for instances of the native base class.
+
+        """
+        return (
+            self.__class__,
+            (self.seq, self.charge, self.mods, self.mass_type, self.radical)
+        )
+
     def __eq__(self, other: object) -> bool:
         """
         Implements the equality test for the Peptide object.
@@ -227,92 +388,299 @@ class Peptide:
         return (self.seq, self.charge, self.mods) == \
                (other.seq, other.charge, other.mods)
 
-    def calculate_mass(self) -> List[float]:
+    def fragment(
+            self,
+            ion_types: IonTypesArg = None,
+            residue_losses: bool = False,
+            max_losses: int = 1,
+            min_mz: Optional[float] = None,
+            max_mz: Optional[float] = None,
+            max_ions: Optional[int] = None,
+            basic_charge_limit: bool = False,
+            min_internal_length: int = 2,
+            max_internal_length: Optional[int] = None
+    ) -> List[Ion]:
         """
-        Calculates the theoretical mass of the peptide along the sequence,
-        including any modifications.
+        Fragments the peptide to generate the ion types specified.
+
+        Args:
+            ion_types: Dictionary of :class:`IonType` s to list of configured
+                       neutral losses. Only fragments for :class:`IonType` s
+                       specified here will be generated. Alternatively, an
+                       :class:`IonPreset` or a handle returned by
+                       :func:`register_ion_types`. Defaults to
+                       `IonPreset.default`, i.e. `DEFAULT_IONS`.
+            residue_losses: Whether to apply the H2O, NH3 and H3PO4 neutral
+                            losses only to fragments containing a residue
+                            which can lose them: S, T, E or D for H2O; R, K,
+                            N or Q for NH3; and a phosphorylated residue for
+                            H3PO4. Other losses are applied to all fragments.
+                            A fragment with several of a loss, or of losses
+                            from the same residues, must contain as many such
+                            residues.
+            max_losses: The maximum number of neutral losses combined in a
+                        fragment. If greater than 1, fragments are also
+                        generated with each combination of up to this many of
+                        the configured losses, including repeats, labelled
+                        e.g. `[b5-H2O-NH3][+]` or `[y4-2H2O][+]`. Combinations
+                        with the same mass as an earlier one are omitted.
+            min_mz: If given, ions of lower m/z are not generated. The ions
+                    generated with `min_mz` or `max_mz` are those generated
+                    without them within the range, though not necessarily in
+                    the same order.
+            max_mz: If given, ions of higher m/z are not generated.
+            max_ions: If given, the maximum number of ions generated of each
+                      ion type. The first generated are kept: all of the
+                      singly charged ions, in order of position, then those
+                      of each higher charge state in turn.
+            basic_charge_limit: Whether to limit the charge of each fragment
+                                to its number of basic sites: K, R and H
+                                residues and its own N-terminal amine.
+                                Fragments without basic residues are
+                                singly charged.
+            min_internal_length: The minimum number of residues of the
+                                 internal fragments generated for
+                                 `IonType.internal`.
+            max_internal_length: If given, the maximum number of residues of
+                                 the internal fragments.
 
         Returns:
-            Masses along the peptide sequence. Index 0 is the N-terminus mass,
-            while index -1 is the C-terminus mass.
+            List of generated ions, as tuples of `(fragment mass, ion label,
+            sequence position)`.
 
         """
-        return calculate_mass(
-            self.seq,
-            self.mods,
-            self.mass_type.value
+        return self._fragment(
+            _resolve_ion_types(ion_types), residue_losses, max_losses,
+            min_mz, max_mz, max_ions, basic_charge_limit, min_internal_length,
+            max_internal_length
         )
 
-    def fragment(
+    def fragment_charges(
             self,
-            ion_types: Optional[IonTypesDict] = None
-    ) -> List[Ion]:
+            charges: Sequence[int],
+            ion_types: IonTypesArg = None,
+            residue_losses: bool = False,
+            max_losses: int = 1,
+            min_mz: Optional[float] = None,
+            max_mz: Optional[float] = None,
+            max_ions: Optional[int] = None,
+            basic_charge_limit: bool = False,
+            min_internal_length: int = 2,
+            max_internal_length: Optional[int] = None
+    ) -> Dict[int, List[Ion]]:
         """
-        Fragments the peptide to generate the ion types specified.
+        Fragments the peptide at each of the charge states, e.g. for a
+        precursor of unknown charge. The ions are those :meth:`fragment`
+        generates for the peptide at each charge, but are only generated
+        once, at the highest charge, rather than once per charge.
 
         Args:
+            charges: The precursor charge states, ignoring :attr:`charge`.
             ion_types: Dictionary of :class:`IonType` s to list of configured
-                       neutral losses. Only fragments for :class:`IonType` s
-                       specified here will be generated.
+                       neutral losses, as for :meth:`fragment`.
+            residue_losses: As for :meth:`fragment`.
+            max_losses: As for :meth:`fragment`.
+            min_mz: As for :meth:`fragment`.
+            max_mz: As for :meth:`fragment`.
+            max_ions: As for :meth:`fragment`.
+            basic_charge_limit: As for :meth:`fragment`.
+            min_internal_length: As for :meth:`fragment`.
+            max_internal_length: As for :meth:`fragment`.
 
         Returns:
-            List of generated ions, as tuples of `(fragment mass, ion label,
-            sequence position)`.
+            Dictionary of each charge state to the list of its generated
+            ions, as returned by :meth:`fragment`. Ions generated at more
+            than one charge state are the same objects in each list.
 
         """
-        if ion_types is None:
-            ion_types = DEFAULT_IONS
+        return self._fragment_charges(
+            charges, _resolve_ion_types(ion_types), residue_losses,
+            max_losses, min_mz, max_mz, max_ions, basic_charge_limit,
+            min_internal_length, max_internal_length
+        )
+
+    def fragment_masses(
+            self,
+            ion_types: IonTypesArg = None,
+            mass_format: MassFormat = MassFormat.float32,
+            residue_losses: bool = False,
+            max_losses: int = 1,
+            min_mz: Optional[float] = None,
+            max_mz: Optional[float] = None,
+            max_ions: Optional[int] = None,
+            basic_charge_limit: bool = False,
+            min_internal_length: int = 2,
+            max_internal_length: Optional[int] = None
+    ) -> Tuple[array.array, array.array]:
+        """
+        Fragments the peptide to generate the ion types specified, returning
+        only the ion masses and positions in compact arrays. Ion labels are
+        not generated.
+
+        Args:
+            ion_types: Dictionary of :class:`IonType` s to list of configured
+                       neutral losses, as for :meth:`fragment`.
+            mass_format: The storage format of the returned masses
+                         (see :class:`MassFormat`).
+            residue_losses: As for :meth:`fragment`.
+            max_losses: As for :meth:`fragment`.
+            min_mz: As for :meth:`fragment`.
+            max_mz: As for :meth:`fragment`.
+            max_ions: As for :meth:`fragment`.
+            basic_charge_limit: As for :meth:`fragment`.
+            min_internal_length: As for :meth:`fragment`.
+            max_internal_length: As for :meth:`fragment`.
 
-        ion_types = _reformat_ion_types(ion_types)
+        Returns:
+            Tuple of two arrays: the fragment masses, in the order returned
+            by :meth:`fragment`, and their sequence positions (as 32-bit
+            integers).
 
-        return self._fragment(ion_types)
+        """
+        masses, positions = self._fragment_masses(
+            _resolve_ion_types(ion_types), mass_format.value, residue_losses,
+            max_losses, min_mz, max_mz, max_ions, basic_charge_limit,
+            min_internal_length, max_internal_length
+        )
+        return (
+            array.array(_MASS_FORMAT_TYPECODES[mass_format], masses),
+            array.array("i", positions)
+        )
 
-    def _fragment(
+    def fragment_top_down(
             self,
-            ion_types: CIonTypesDict
-    ) -> List[Ion]:
+            ion_types: IonTypesArg = IonPreset.cid,
+            mass_format: MassFormat = MassFormat.float64,
+            min_mz: Optional[float] = None,
+            max_mz: Optional[float] = None,
+            labels: bool = False,
+            threads: int = 1
+    ) -> TopDownIons:
         """
-        Fragments the peptide to generate the ion types specified.
+        Fragments a large peptide or intact protein, e.g. for top-down
+        spectra, at high charge states. Only the b, a, c, y, z and x ion
+        series are supported, with their configured neutral losses.
+
+        The ions are computed as by :meth:`fragment`, but are returned as
+        compact arrays, and the ions of each charge state outside the m/z
+        range are skipped without being computed, so that a highly charged
+        protein needs memory proportional to the ions within the range.
 
         Args:
-            ion_types (dict):
+            ion_types: Dictionary of :class:`IonType` s to list of configured
+                       neutral losses, as for :meth:`fragment`. Defaults to
+                       `IonPreset.cid`.
+            mass_format: The storage format of the returned m/z values
+                         (see :class:`MassFormat`).
+            min_mz: If given, ions of lower m/z are not generated.
+            max_mz: If given, ions of higher m/z are not generated.
+            labels: Whether to build the ion labels.
+            threads: The number of threads computing charge states
+                     concurrently, which only pays for very long sequences.
+
+        Returns:
+            The ions, ordered by ion type, then charge state, then neutral
+            loss, then position.
 
         """
-        b_masses, y_masses = self._ion_masses()
-        return generate_ions(
-            ion_types,
-            self.mass,
-            self.peptide_mass[1:-1],
-            b_masses,
-            y_masses,
-            self.charge,
-            self.radical,
-            self.seq
+        mz, positions, charges, ion_types_, labels_ = self._fragment_top_down(
+            _resolve_ion_types(ion_types), mass_format.value, min_mz, max_mz,
+            labels, threads
+        )
+        return TopDownIons(
+            array.array(_MASS_FORMAT_TYPECODES[mass_format], mz),
+            array.array("i", positions),
+            array.array("i", charges),
+            array.array("b", ion_types_),
+            labels_
         )
 
-    def _ion_masses(self) -> Tuple[List[float], List[float]]:
+    def fragment_isotopes(
+            self,
+            ion_types: Sequence[IonType] = (IonType.b, IonType.y),
+            n_peaks: int = 4,
+            charge: int = 1
+    ) -> Dict[IonType, IsotopePeaks]:
         """
-        Generates the theoretical ion masses of the peptide based on its
-        sequence and modification masses.
+        Computes the isotope envelope of each ion of the ion types, for
+        matching high-resolution spectra. The precursor and the b, a, c, y,
+        z and x ion series are supported.
+
+        The elemental composition of each ion is accumulated along its
+        ladder, and its distribution is computed from cached distributions
+        of each count of each element, so that all of the ions of a series
+        are computed in one call. Each peak aggregates the isotopic variants
+        of one nominal mass, at their mean m/z, offset from the
+        monoisotopic m/z of the ion as generated by :meth:`fragment`. The
+        most abundant peaks of each ion are returned, which for large ions
+        no longer include the monoisotopic peak.
+
+        Modifications have no elemental composition, so they shift the
+        peaks of the ions containing them without changing their
+        abundances.
+
+        Args:
+            ion_types: The ion types whose ions to compute.
+            n_peaks: The number of the most abundant peaks of each ion,
+                     returned in order of m/z.
+            charge: The charge state of the ions.
 
         Returns:
-            Tuple of two lists: the b and y ion masses.
+            Dictionary of ion type to :class:`IsotopePeaks`, with one ion for
+            the precursor and one for each fragment of a series.
+
+        Raises:
+            ValueError: If the peptide's mass_type is not `MassType.mono`,
+                        or for unsupported ion types.
 
         """
-        seq_len = len(self.seq)
-
-        pep_mass = self.peptide_mass
-
-        y_base = FIXED_MASSES["H2O"] + pep_mass[-1]
-        b_base = pep_mass[0]
-        # Reverse the sequence portion of the list (i.e. pep_mass[1:-1])
-        rev_seq_masses = pep_mass[-2:0:-1]
-        y_ions = []
-        b_ions = []
-        for ii in range(seq_len):
-            y_base += rev_seq_masses[ii]
-            y_ions.append(y_base)
-            b_base += pep_mass[ii + 1]
-            b_ions.append(b_base)
-
-        return b_ions, y_ions
+        if self.mass_type is not MassType.mono:
+            raise ValueError(
+                "Isotope distributions require monoisotopic masses")
+        ion_types = list(ion_types)
+        peaks = self._isotopes(
+            [ion_type.value for ion_type in ion_types], n_peaks, charge)
+        return {
+            ion_type: IsotopePeaks(
+                array.array("d", mz), array.array("d", abundances), n_peaks)
+            for ion_type, (mz, abundances) in zip(ion_types, peaks)
+        }
+
+
+def fragment_peptides(
+        peptides: Sequence[Peptide],
+        ion_types: IonTypesArg = None,
+        residue_losses: bool = False,
+        max_losses: int = 1,
+        min_mz: Optional[float] = None,
+        max_mz: Optional[float] = None,
+        max_ions: Optional[int] = None,
+        basic_charge_limit: bool = False,
+        min_internal_length: int = 2,
+        max_internal_length: Optional[int] = None
+) -> List[List[Ion]]:
+    """
+    Fragments each of the peptides, as :meth:`Peptide.fragment`, resolving
+    `ion_types` once for all of them.
+
+    Args:
+        peptides: The peptides to fragment.
+        ion_types: The ion types to generate, as for :meth:`Peptide.fragment`.
+        residue_losses: As for :meth:`Peptide.fragment`.
+        max_losses: As for :meth:`Peptide.fragment`.
+        min_mz: As for :meth:`Peptide.fragment`.
+        max_mz: As for :meth:`Peptide.fragment`.
+        max_ions: As for :meth:`Peptide.fragment`.
+        basic_charge_limit: As for :meth:`Peptide.fragment`.
+        min_internal_length: As for :meth:`Peptide.fragment`.
+        max_internal_length: As for :meth:`Peptide.fragment`.
+
+    Returns:
+        The list of generated ions for each peptide, in order.
+
+    """
+    return _fragment_peptides(
+        peptides, _resolve_ion_types(ion_types), residue_losses, max_losses,
+        min_mz, max_mz, max_ions, basic_charge_limit, min_internal_length,
+        max_internal_length
+    )
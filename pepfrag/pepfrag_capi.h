@@ -0,0 +1,159 @@
+#ifndef _PEPFRAG_CAPI_H
+#define _PEPFRAG_CAPI_H
+
+/*
+ * The C API of the cpepfrag extension, for use by other compiled extensions
+ * without going through Python objects.
+ *
+ * The API is a table of function pointers, exported by cpepfrag as a capsule
+ * named PEPFRAG_CAPSULE_NAME. Import it once, with the GIL held, e.g. in the
+ * module initialization function of the calling extension:
+ *
+ *     const PepfragCAPI* pepfrag = pepfrag_import_capi();
+ *     if (pepfrag == NULL) return NULL;
+ *
+ * The functions do not use the Python API, so may be called without holding
+ * the GIL, and from any thread, concurrently, including those building
+ * labels. Each thread uses its own workspace, the configuration registry is
+ * locked and the label strings shared between threads are immutable. They
+ * return PEPFRAG_OK on success or an error code, with a description of the
+ * error available from last_error, which is kept per thread.
+ *
+ * Compile with the include directory given by pepfrag.get_include().
+ */
+
+#include <Python.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PEPFRAG_CAPSULE_NAME "cpepfrag._C_API"
+
+/*
+ * The version of the function table. Functions are only ever appended, so a
+ * table of a later version may be used wherever an earlier one is expected.
+ */
+#define PEPFRAG_CAPI_VERSION 1
+
+#define PEPFRAG_OK 0
+// An argument was invalid, e.g. an unknown residue or configuration handle
+#define PEPFRAG_ERROR_INVALID_ARGUMENT 1
+// An output buffer was too small; the required size has been set
+#define PEPFRAG_ERROR_BUFFER_TOO_SMALL 2
+#define PEPFRAG_ERROR_INTERNAL 3
+
+#define PEPFRAG_MASS_TYPE_MONO 0
+#define PEPFRAG_MASS_TYPE_AVG 1
+
+/*
+ * Ion type values, as for pepfrag.IonType.
+ */
+#define PEPFRAG_ION_PRECURSOR 1
+#define PEPFRAG_ION_IMMONIUM 2
+#define PEPFRAG_ION_B 3
+#define PEPFRAG_ION_Y 4
+#define PEPFRAG_ION_A 5
+#define PEPFRAG_ION_C 6
+#define PEPFRAG_ION_Z 7
+#define PEPFRAG_ION_X 8
+
+typedef struct {
+	// 1-based residue position, or 0 for the N-terminus and the sequence
+	// length + 1 for the C-terminus
+	long site;
+	double mass;
+} PepfragModSite;
+
+typedef struct {
+	// NUL-terminated, single-letter residue codes
+	const char* sequence;
+	const PepfragModSite* mods;
+	size_t n_mods;
+	long charge;
+	int radical;
+	int mass_type;
+} PepfragPeptide;
+
+typedef struct {
+	const char* label;
+	double mass;
+} PepfragNeutralLoss;
+
+typedef struct {
+	int ion_type;
+	const PepfragNeutralLoss* losses;
+	size_t n_losses;
+} PepfragIonTypeSpec;
+
+typedef struct {
+	// PEPFRAG_CAPI_VERSION of the exporting module
+	unsigned int version;
+
+	/*
+	 * Describes the last error returned on the calling thread.
+	 */
+	const char* (*last_error)(void);
+
+	/*
+	 * Calculates the per-position masses of the peptide, as
+	 * pepfrag.Peptide.peptide_mass, into masses, which must have space for the
+	 * sequence length + 2 values.
+	 */
+	int (*calculate_mass)(const PepfragPeptide* peptide, double* masses, size_t capacity);
+
+	/*
+	 * Registers an ion type configuration, as pepfrag.register_ion_types,
+	 * setting its handle. Handles are shared with the Python API.
+	 */
+	int (*register_ion_types)(const PepfragIonTypeSpec* ion_types, size_t n_ion_types, long* handle);
+
+	/*
+	 * Generates the fragment ions of the peptide for the configuration
+	 * handle, writing their m/z and positions in the order of
+	 * pepfrag.Peptide.fragment and setting n_ions. If capacity is less than
+	 * the number of ions, nothing is written, n_ions is set to the number
+	 * required and PEPFRAG_ERROR_BUFFER_TOO_SMALL is returned.
+	 */
+	int (*generate_ions)(
+		const PepfragPeptide* peptide, long ion_config,
+		double* mz, int32_t* positions, size_t capacity, size_t* n_ions);
+
+	/*
+	 * Annotates the n_peaks peaks, with m/z values mz, with the label of the
+	 * nearest fragment ion of the peptide within tolerance (in Da). Labels
+	 * are written to labels, NUL-terminated and truncated as necessary, at
+	 * intervals of label_size bytes; unmatched peaks are given an empty
+	 * label. Sets n_matched to the number of peaks annotated.
+	 */
+	int (*annotate_peaks)(
+		const PepfragPeptide* peptide, long ion_config,
+		const double* mz, size_t n_peaks, double tolerance,
+		char* labels, size_t label_size, size_t* n_matched);
+} PepfragCAPI;
+
+/*
+ * Imports the C API from cpepfrag, returning NULL with a Python exception set
+ * on failure.
+ */
+static inline const PepfragCAPI* pepfrag_import_capi(void) {
+	const PepfragCAPI* api = (const PepfragCAPI*) PyCapsule_Import(PEPFRAG_CAPSULE_NAME, 0);
+	if (api == NULL) {
+		return NULL;
+	}
+	if (api->version < PEPFRAG_CAPI_VERSION) {
+		PyErr_Format(
+			PyExc_ImportError, "pepfrag C API version %u is older than the required version %d",
+			api->version, PEPFRAG_CAPI_VERSION);
+		return NULL;
+	}
+	return api;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _PEPFRAG_CAPI_H
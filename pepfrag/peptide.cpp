@@ -0,0 +1,950 @@
+#include <Python.h>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "arguments.h"
+#include "converters.h"
+#include "cpepfrag.h"
+#include "fragment.h"
+#include "ionconfig.h"
+#include "isotope.h"
+#include "peptide.h"
+#include "stats.h"
+#include "topdown.h"
+#include "tracing.h"
+#include "workspace.h"
+
+/*
+ * The native state derived from the attributes of a peptide. It is allocated
+ * on first use and invalidated whenever seq, mods or mass_type is set.
+ */
+struct PeptideCache {
+	bool valid = false;
+	std::string sequence;
+	// As returned by calculateMass
+	std::vector<double> peptideMasses;
+	double precursorMass = 0.;
+	std::vector<double> seqMasses;
+	std::vector<double> bMasses;
+	std::vector<double> yMasses;
+};
+
+struct PeptideObject {
+	PyObject_HEAD
+	PyObject* seq;
+	PyObject* charge;
+	PyObject* mods;
+	PyObject* massType;
+	PyObject* radical;
+	// The items of mods from which the cache was built, used to detect the
+	// modification list being changed in place. NULL if mods is not a list or
+	// tuple, in which case the cache is rebuilt on every use.
+	PyObject* cachedMods;
+	PeptideCache* cache;
+};
+
+enum class PeptideAttribute { seq, charge, mods, massType, radical };
+
+const char* ATTRIBUTE_NAMES[] = {"seq", "charge", "mods", "mass_type", "radical"};
+
+FastcallParameters fragmentParameters(
+	"_fragment",
+	{"ion_types", "residue_losses", "max_losses", "min_mz", "max_mz", "max_ions",
+	 "basic_charge_limit", "min_internal_length", "max_internal_length"},
+	1);
+
+FastcallParameters fragmentMassesParameters(
+	"_fragment_masses",
+	{"ion_types", "mass_format", "residue_losses", "max_losses", "min_mz", "max_mz", "max_ions",
+	 "basic_charge_limit", "min_internal_length", "max_internal_length"},
+	2);
+
+FastcallParameters fragmentChargesParameters(
+	"_fragment_charges",
+	{"charges", "ion_types", "residue_losses", "max_losses", "min_mz", "max_mz", "max_ions",
+	 "basic_charge_limit", "min_internal_length", "max_internal_length"},
+	2);
+
+FastcallParameters fragmentPeptidesParameters(
+	"fragment_peptides",
+	{"peptides", "ion_types", "residue_losses", "max_losses", "min_mz", "max_mz", "max_ions",
+	 "basic_charge_limit", "min_internal_length", "max_internal_length"},
+	2);
+
+FastcallParameters fragmentTopDownParameters(
+	"_fragment_top_down",
+	{"ion_types", "mass_format", "min_mz", "max_mz", "labels", "threads"},
+	2);
+
+FastcallParameters isotopesParameters("_isotopes", {"ion_types", "n_peaks", "charge"}, 3);
+
+PyObject*& attributeSlot(PeptideObject* self, PeptideAttribute attribute) {
+	switch (attribute) {
+		case PeptideAttribute::seq: return self->seq;
+		case PeptideAttribute::charge: return self->charge;
+		case PeptideAttribute::mods: return self->mods;
+		case PeptideAttribute::massType: return self->massType;
+		default: return self->radical;
+	}
+}
+
+/*
+ * Returns a borrowed reference to the attribute, or NULL with an
+ * AttributeError set if it has not been set.
+ */
+PyObject* getAttribute(PeptideObject* self, PeptideAttribute attribute) {
+	PyObject* value = attributeSlot(self, attribute);
+	if (value == NULL) {
+		PyErr_Format(
+			PyExc_AttributeError, "'%.200s' object has no attribute '%s'",
+			Py_TYPE(self)->tp_name, ATTRIBUTE_NAMES[static_cast<int>(attribute)]);
+	}
+	return value;
+}
+
+void invalidateCache(PeptideObject* self) {
+	if (self->cache != NULL) {
+		self->cache->valid = false;
+	}
+	Py_CLEAR(self->cachedMods);
+}
+
+/*
+ * Returns whether mods still holds the modifications from which the cache
+ * was built. The ModSite items are immutable, so only their identity is
+ * compared.
+ */
+bool modsUnchanged(PeptideObject* self) {
+	if (self->cachedMods == NULL
+			|| !(PyList_CheckExact(self->mods) || PyTuple_CheckExact(self->mods))) {
+		return false;
+	}
+
+	Py_ssize_t size = PySequence_Fast_GET_SIZE(self->mods);
+	if (size != PyTuple_GET_SIZE(self->cachedMods)) return false;
+
+	PyObject** items = PySequence_Fast_ITEMS(self->mods);
+	for (Py_ssize_t ii = 0; ii < size; ii++) {
+		if (items[ii] != PyTuple_GET_ITEM(self->cachedMods, ii)) return false;
+	}
+	return true;
+}
+
+/*
+ * Builds the cache if it is not valid. Returns false, with a Python exception
+ * set, on failure.
+ */
+bool updateCache(PeptideObject* self) {
+	if (self->cache != NULL && self->cache->valid && modsUnchanged(self)) return true;
+
+	invalidateCache(self);
+
+	PyObject* seq = getAttribute(self, PeptideAttribute::seq);
+	PyObject* mods = getAttribute(self, PeptideAttribute::mods);
+	PyObject* massTypeEnum = getAttribute(self, PeptideAttribute::massType);
+	if (seq == NULL || mods == NULL || massTypeEnum == NULL) return false;
+
+	const char* sequence;
+	if (!argumentToString(seq, "sequence", sequence)) return false;
+
+	PyObject* massTypeValue = PyObject_GetAttrString(massTypeEnum, "value");
+	if (massTypeValue == NULL) return false;
+	long massType;
+	bool converted = argumentToLong(massTypeValue, massType);
+	Py_DECREF(massTypeValue);
+	if (!converted) return false;
+
+	try {
+		if (self->cache == NULL) {
+			self->cache = new PeptideCache();
+		}
+		PeptideCache& cache = *self->cache;
+		cache.sequence.assign(sequence);
+		cache.peptideMasses = calculateMass(
+			cache.sequence, modSiteListToMap(mods, cache.sequence.size()), massType);
+		calculateIonMasses(
+			cache.peptideMasses, cache.precursorMass, cache.seqMasses, cache.bMasses, cache.yMasses);
+	}
+	catch (const std::out_of_range& ex) {
+		PyErr_SetString(PyExc_KeyError, ex.what());
+		return false;
+	}
+	catch (const std::exception& ex) {
+		PyErr_SetString(PyExc_RuntimeError, ex.what());
+		return false;
+	}
+
+	if (PyList_CheckExact(mods) || PyTuple_CheckExact(mods)) {
+		self->cachedMods = PySequence_Tuple(mods);
+		if (self->cachedMods == NULL) return false;
+	}
+	self->cache->valid = true;
+	return true;
+}
+
+/*
+ * Converts the charge and radical flag of the peptide and copies its cached
+ * sequence and masses into the workspace. Returns false, with a Python
+ * exception set, on failure.
+ */
+bool loadPeptide(PeptideObject* self, long& charge, bool& radical, Workspace& workspace) {
+	PyObject* chargeObj = getAttribute(self, PeptideAttribute::charge);
+	PyObject* radicalObj = getAttribute(self, PeptideAttribute::radical);
+	if (chargeObj == NULL || radicalObj == NULL
+			|| !argumentToLong(chargeObj, charge)
+			|| !argumentToBool(radicalObj, radical)
+			|| !updateCache(self)) {
+		return false;
+	}
+
+	PEPFRAG_TRACE_SPAN("convert input");
+	const PeptideCache& cache = *self->cache;
+	workspace.sequence.assign(cache.sequence);
+	workspace.seqMasses.assign(cache.seqMasses.begin(), cache.seqMasses.end());
+	workspace.bMasses.assign(cache.bMasses.begin(), cache.bMasses.end());
+	workspace.yMasses.assign(cache.yMasses.begin(), cache.yMasses.end());
+	workspace.precMasses.assign(1, cache.precursorMass);
+	return true;
+}
+
+/*
+ * Generates the ions of the peptide for ionTypes into workspace.ions.
+ * Returns false, with a Python exception set, on failure.
+ */
+bool fragmentCached(
+	PeptideObject* self,
+	PyObject* ionTypes,
+	const IonGenerationOptions& options,
+	Workspace& workspace)
+{
+	long charge;
+	bool radical;
+	if (!loadPeptide(self, charge, radical, workspace)) return false;
+
+	try {
+		generateIons(ionTypes, charge, radical, options, workspace);
+	}
+	catch (const std::exception& ex) {
+		PyErr_SetString(PyExc_RuntimeError, ex.what());
+		return false;
+	}
+	return true;
+}
+
+/*
+ * The configuration for a converted ion type dict or a registered
+ * configuration handle. Throws as getIonConfig or dictToIonTypeMap.
+ */
+IonConfig toIonConfig(PyObject* ionTypes) {
+	if (PyLong_Check(ionTypes)) {
+		return getIonConfig(PyLong_AsLong(ionTypes));
+	}
+	PEPFRAG_TRACE_SPAN("convert ion types");
+	return makeIonConfig(dictToIonTypeMap(ionTypes));
+}
+
+/*
+ * Sets the generation options from the optional residue_losses, max_losses,
+ * min_mz, max_mz, max_ions, basic_charge_limit, min_internal_length and
+ * max_internal_length arguments, in that order, any of which may be NULL or
+ * None. Returns false, with a Python exception set, on failure.
+ */
+bool setGenerationOptions(PyObject* const* values, IonGenerationOptions& options) {
+	auto given = [](PyObject* value) { return value != NULL && value != Py_None; };
+
+	if (given(values[0]) && !argumentToBool(values[0], options.residueLosses)) return false;
+
+	long value;
+	if (given(values[1])) {
+		if (!argumentToLong(values[1], value)) return false;
+		if (value < 1) {
+			PyErr_SetString(PyExc_ValueError, "max_losses must be at least 1");
+			return false;
+		}
+		options.maxLosses = (size_t) value;
+	}
+
+	if (given(values[2]) && !argumentToDouble(values[2], options.minMz)) return false;
+	if (given(values[3]) && !argumentToDouble(values[3], options.maxMz)) return false;
+
+	if (given(values[4])) {
+		if (!argumentToLong(values[4], value)) return false;
+		if (value < 1) {
+			PyErr_SetString(PyExc_ValueError, "max_ions must be at least 1");
+			return false;
+		}
+		options.maxIons = (size_t) value;
+	}
+
+	if (given(values[5]) && !argumentToBool(values[5], options.basicChargeLimit)) return false;
+
+	const char* lengthNames[] = {"min_internal_length", "max_internal_length"};
+	size_t* lengths[] = {&options.minInternalLength, &options.maxInternalLength};
+	for (int ii = 0; ii < 2; ii++) {
+		if (!given(values[6 + ii])) continue;
+		if (!argumentToLong(values[6 + ii], value)) return false;
+		if (value < 1) {
+			PyErr_Format(PyExc_ValueError, "%s must be at least 1", lengthNames[ii]);
+			return false;
+		}
+		*lengths[ii] = (size_t) value;
+	}
+	return true;
+}
+
+/*
+ * Converts charges, a sequence of positive integers. Returns false, with a
+ * Python exception set, on failure.
+ */
+bool toCharges(PyObject* chargesObj, std::vector<long>& charges) {
+	PyObject* items = PySequence_Fast(chargesObj, "charges must be a sequence");
+	if (items == NULL) return false;
+
+	Py_ssize_t nItems = PySequence_Fast_GET_SIZE(items);
+	charges.resize(nItems);
+	for (Py_ssize_t ii = 0; ii < nItems; ii++) {
+		if (!argumentToLong(PySequence_Fast_GET_ITEM(items, ii), charges[ii])) break;
+		if (charges[ii] < 1) {
+			PyErr_Format(PyExc_ValueError, "charges must be positive, not %ld", charges[ii]);
+			break;
+		}
+	}
+	Py_DECREF(items);
+	return !PyErr_Occurred();
+}
+
+/* Type slots */
+
+/*
+ * Returns a borrowed reference to MassType.mono, the default mass type.
+ */
+PyObject* defaultMassType() {
+	static PyObject* massType = NULL;
+	if (massType == NULL) {
+		PyObject* constants = PyImport_ImportModule("pepfrag.constants");
+		if (constants == NULL) return NULL;
+		PyObject* massTypeEnum = PyObject_GetAttrString(constants, "MassType");
+		Py_DECREF(constants);
+		if (massTypeEnum == NULL) return NULL;
+		massType = PyObject_GetAttrString(massTypeEnum, "mono");
+		Py_DECREF(massTypeEnum);
+	}
+	return massType;
+}
+
+int Peptide_init(PeptideObject* self, PyObject* args, PyObject* kwargs) {
+	static const char* keywords[] = {"sequence", "charge", "modifications", "mass_type", "radical", NULL};
+
+	PyObject* seq;
+	PyObject* charge;
+	PyObject* mods;
+	PyObject* massType = NULL;
+	PyObject* radical = Py_False;
+	if (!PyArg_ParseTupleAndKeywords(
+			args, kwargs, "OOO|OO:Peptide", const_cast<char**>(keywords),
+			&seq, &charge, &mods, &massType, &radical)) {
+		return -1;
+	}
+	if (massType == NULL && (massType = defaultMassType()) == NULL) return -1;
+
+	Py_INCREF(seq);
+	Py_XSETREF(self->seq, seq);
+	Py_INCREF(charge);
+	Py_XSETREF(self->charge, charge);
+	Py_INCREF(mods);
+	Py_XSETREF(self->mods, mods);
+	Py_INCREF(massType);
+	Py_XSETREF(self->massType, massType);
+	Py_INCREF(radical);
+	Py_XSETREF(self->radical, radical);
+	invalidateCache(self);
+	return 0;
+}
+
+int Peptide_traverse(PeptideObject* self, visitproc visit, void* arg) {
+	Py_VISIT(self->seq);
+	Py_VISIT(self->charge);
+	Py_VISIT(self->mods);
+	Py_VISIT(self->massType);
+	Py_VISIT(self->radical);
+	Py_VISIT(self->cachedMods);
+	return 0;
+}
+
+int Peptide_clear(PeptideObject* self) {
+	Py_CLEAR(self->seq);
+	Py_CLEAR(self->charge);
+	Py_CLEAR(self->mods);
+	Py_CLEAR(self->massType);
+	Py_CLEAR(self->radical);
+	invalidateCache(self);
+	return 0;
+}
+
+void Peptide_dealloc(PeptideObject* self) {
+	PyObject_GC_UnTrack(self);
+	Peptide_clear(self);
+	delete self->cache;
+	Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+/* Attributes */
+
+PyObject* Peptide_getAttribute(PeptideObject* self, void* closure) {
+	PyObject* value = getAttribute(self, *static_cast<PeptideAttribute*>(closure));
+	Py_XINCREF(value);
+	return value;
+}
+
+int Peptide_setAttribute(PeptideObject* self, PyObject* value, void* closure) {
+	PeptideAttribute attribute = *static_cast<PeptideAttribute*>(closure);
+	PyObject*& slot = attributeSlot(self, attribute);
+	if (value == NULL && slot == NULL) {
+		getAttribute(self, attribute);
+		return -1;
+	}
+
+	Py_XINCREF(value);
+	Py_XSETREF(slot, value);
+
+	if (attribute != PeptideAttribute::charge && attribute != PeptideAttribute::radical) {
+		invalidateCache(self);
+	}
+	return 0;
+}
+
+PyObject* Peptide_getPeptideMass(PeptideObject* self, void* closure) {
+	if (!updateCache(self)) return NULL;
+	return vectorToList(self->cache->peptideMasses, &PyFloat_FromDouble);
+}
+
+PyObject* Peptide_getMass(PeptideObject* self, void* closure) {
+	if (!updateCache(self)) return NULL;
+	return PyFloat_FromDouble(self->cache->precursorMass);
+}
+
+PyObject* Peptide_getMz(PeptideObject* self, void* closure) {
+	PyObject* charge = getAttribute(self, PeptideAttribute::charge);
+	if (charge == NULL || !updateCache(self)) return NULL;
+
+	const double protonMass = FIXED_MASSES.at("H");
+	if (PyLong_CheckExact(charge)) {
+		double chargeValue = PyLong_AsDouble(charge);
+		if (chargeValue != 0.) {
+			return PyFloat_FromDouble(self->cache->precursorMass / chargeValue + protonMass);
+		}
+		PyErr_Clear();
+	}
+
+	// Other numeric types, and the ZeroDivisionError, as for Python floats
+	PyObject* mass = PyFloat_FromDouble(self->cache->precursorMass);
+	if (mass == NULL) return NULL;
+	PyObject* ratio = PyNumber_TrueDivide(mass, charge);
+	Py_DECREF(mass);
+	if (ratio == NULL) return NULL;
+	PyObject* proton = PyFloat_FromDouble(protonMass);
+	PyObject* mz = proton == NULL ? NULL : PyNumber_Add(ratio, proton);
+	Py_DECREF(ratio);
+	Py_XDECREF(proton);
+	return mz;
+}
+
+/* Methods */
+
+PyObject* Peptide_calculateMass(PeptideObject* self, PyObject* args) {
+	PEPFRAG_COUNT(calculateMassCalls);
+	PEPFRAG_TRACE_SPAN("calculate_mass");
+	return Peptide_getPeptideMass(self, NULL);
+}
+
+PyObject* Peptide_ionMasses(PeptideObject* self, PyObject* args) {
+	if (!updateCache(self)) return NULL;
+
+	PyObject* bMasses = vectorToList(self->cache->bMasses, &PyFloat_FromDouble);
+	if (bMasses == NULL) return NULL;
+	PyObject* yMasses = vectorToList(self->cache->yMasses, &PyFloat_FromDouble);
+	if (yMasses == NULL) {
+		Py_DECREF(bMasses);
+		return NULL;
+	}
+	PyObject* result = PyTuple_Pack(2, bMasses, yMasses);
+	Py_DECREF(bMasses);
+	Py_DECREF(yMasses);
+	return result;
+}
+
+PyObject* Peptide_fragment(PeptideObject* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames) {
+	PEPFRAG_COUNT(generateIonsCalls);
+	PEPFRAG_TRACE_SPAN("generate_ions");
+
+	PyObject* values[9];
+	IonGenerationOptions options;
+	if (!fragmentParameters.parse(args, nargs, kwnames, values)
+			|| !setGenerationOptions(values + 1, options)) return NULL;
+
+	WorkspaceLease workspace;
+	if (!fragmentCached(self, values[0], options, *workspace)) return NULL;
+
+	PEPFRAG_TRACE_SPAN("convert output");
+	return vectorToList(workspace->ions, &ionToTuple);
+}
+
+PyObject* Peptide_fragmentMasses(PeptideObject* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames) {
+	PEPFRAG_COUNT(generateIonMassesCalls);
+	PEPFRAG_TRACE_SPAN("generate_ion_masses");
+
+	PyObject* values[10];
+	MassFormat massFormat;
+	IonGenerationOptions options;
+	options.labels = false;
+	if (!fragmentMassesParameters.parse(args, nargs, kwnames, values)
+			|| !argumentToMassFormat(values[1], massFormat)
+			|| !setGenerationOptions(values + 2, options)) return NULL;
+
+	WorkspaceLease workspace;
+	if (!fragmentCached(self, values[0], options, *workspace)) return NULL;
+
+	PEPFRAG_TRACE_SPAN("convert output");
+	// The result owns each buffer once set, so that an exception part way
+	// releases those already packed
+	PyObject* result = PyTuple_New(2);
+	if (result == NULL) return NULL;
+	try {
+		PyTuple_SET_ITEM(result, 0, ionMassesToBytes(workspace->ions, massFormat));
+		PyTuple_SET_ITEM(result, 1, ionPositionsToBytes(workspace->ions));
+		return result;
+	}
+	catch (const std::overflow_error& ex) {
+		Py_DECREF(result);
+		PyErr_SetString(PyExc_OverflowError, ex.what());
+		return NULL;
+	}
+	catch (const std::exception& ex) {
+		Py_DECREF(result);
+		PyErr_SetString(PyExc_RuntimeError, ex.what());
+		return NULL;
+	}
+}
+
+PyObject* Peptide_fragmentCharges(PeptideObject* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames) {
+	PEPFRAG_COUNT(generateIonsCalls);
+	PEPFRAG_TRACE_SPAN("generate_ions");
+
+	PyObject* values[10];
+	std::vector<long> charges;
+	IonGenerationOptions options;
+	if (!fragmentChargesParameters.parse(args, nargs, kwnames, values)
+			|| !toCharges(values[0], charges)
+			|| !setGenerationOptions(values + 2, options)) return NULL;
+
+	long maxCharge = 0;
+	for (long charge : charges) {
+		maxCharge = std::max(maxCharge, charge);
+	}
+
+	WorkspaceLease workspace;
+	long charge;
+	bool radical;
+	if (!loadPeptide(self, charge, radical, *workspace)) return NULL;
+
+	try {
+		IonConfig config = toIonConfig(values[1]);
+		PEPFRAG_COUNT(peptides);
+		generateChargeStates(config, maxCharge, radical, options, *workspace);
+	}
+	catch (const std::exception& ex) {
+		PyErr_SetString(PyExc_RuntimeError, ex.what());
+		return NULL;
+	}
+
+	PEPFRAG_TRACE_SPAN("convert output");
+	PyObject* result = PyDict_New();
+	if (result == NULL) return NULL;
+
+	// Each ion is converted once, and the tuple shared by the lists of all of
+	// the charge states including it
+	const Ions& ions = workspace->typeIons;
+	std::vector<PyObject*> tuples(ions.size(), NULL);
+	for (long charge : charges) {
+		const std::vector<const Ion*>& chargeIons = workspace->chargeStateIons[charge - 1];
+		PyObject* list = PyList_New((Py_ssize_t) chargeIons.size());
+		if (list == NULL) break;
+		for (size_t ii = 0; ii < chargeIons.size(); ii++) {
+			PyObject*& tuple = tuples[chargeIons[ii] - ions.data()];
+			if (tuple == NULL && (tuple = ionToTuple(*chargeIons[ii])) == NULL) break;
+			Py_INCREF(tuple);
+			PyList_SET_ITEM(list, ii, tuple);
+		}
+
+		PyObject* key = PyErr_Occurred() ? NULL : PyLong_FromLong(charge);
+		int status = key == NULL ? -1 : PyDict_SetItem(result, key, list);
+		Py_XDECREF(key);
+		Py_DECREF(list);
+		if (status < 0) break;
+	}
+
+	for (PyObject* tuple : tuples) {
+		Py_XDECREF(tuple);
+	}
+	if (PyErr_Occurred()) {
+		Py_DECREF(result);
+		return NULL;
+	}
+	return result;
+}
+
+/*
+ * Releases the GIL for its lifetime.
+ */
+class ReleasedGil {
+	public:
+		ReleasedGil() : state(PyEval_SaveThread()) {}
+
+		~ReleasedGil() { PyEval_RestoreThread(state); }
+
+		ReleasedGil(const ReleasedGil&) = delete;
+		ReleasedGil& operator=(const ReleasedGil&) = delete;
+
+	private:
+		PyThreadState* state;
+};
+
+/*
+ * A run of the ions from fragmentTopDown, of one row of the mass table of
+ * the ion type at index typeIndex of the configuration, at one charge state.
+ */
+struct TopDownRun {
+	size_t typeIndex;
+	long charge;
+	size_t row;
+	size_t end;
+};
+
+PyObject* Peptide_fragmentTopDown(PeptideObject* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames) {
+	PEPFRAG_COUNT(generateIonMassesCalls);
+	PEPFRAG_TRACE_SPAN("fragment_top_down");
+
+	auto given = [](PyObject* value) { return value != NULL && value != Py_None; };
+
+	PyObject* values[6];
+	MassFormat massFormat;
+	TopDownOptions options;
+	bool labels = false;
+	if (!fragmentTopDownParameters.parse(args, nargs, kwnames, values)
+			|| !argumentToMassFormat(values[1], massFormat)
+			|| (given(values[2]) && !argumentToDouble(values[2], options.minMz))
+			|| (given(values[3]) && !argumentToDouble(values[3], options.maxMz))
+			|| (given(values[4]) && !argumentToBool(values[4], labels))) return NULL;
+	if (given(values[5])) {
+		long threads;
+		if (!argumentToLong(values[5], threads)) return NULL;
+		if (threads < 1) {
+			PyErr_SetString(PyExc_ValueError, "threads must be at least 1");
+			return NULL;
+		}
+		options.threads = (unsigned) threads;
+	}
+
+	WorkspaceLease workspace;
+	long charge;
+	bool radical;
+	if (!loadPeptide(self, charge, radical, *workspace)) return NULL;
+
+	std::vector<double> mz;
+	std::vector<int32_t> positions;
+	std::vector<TopDownRun> runs;
+	IonConfig config;
+	try {
+		config = toIonConfig(values[0]);
+		PEPFRAG_COUNT(peptides);
+		// The sink only appends to the arrays, so Python is not needed
+		ReleasedGil released;
+		fragmentTopDown(config.ionTypes, charge, radical, options, *workspace, [&](const TopDownChunk& chunk) {
+			size_t typeIndex = 0;
+			while (config.ionTypes[typeIndex].first != chunk.type) typeIndex++;
+			mz.insert(mz.end(), chunk.mz, chunk.mz + chunk.size);
+			positions.insert(positions.end(), chunk.positions, chunk.positions + chunk.size);
+			runs.push_back({typeIndex, chunk.charge, chunk.row, mz.size()});
+		});
+	}
+	catch (const std::exception& ex) {
+		PyErr_SetString(PyExc_RuntimeError, ex.what());
+		return NULL;
+	}
+
+	PEPFRAG_TRACE_SPAN("convert output");
+	std::vector<int32_t> charges(mz.size());
+	std::vector<int8_t> types(mz.size());
+	PyObject* labelList = labels ? PyList_New((Py_ssize_t) mz.size()) : Py_None;
+	if (labelList == NULL) return NULL;
+	if (!labels) Py_INCREF(Py_None);
+
+	size_t start = 0;
+	for (const TopDownRun& run : runs) {
+		IonType type = config.ionTypes[run.typeIndex].first;
+		const SimpleIonGenerator& generator = static_cast<const SimpleIonGenerator&>(IonGenerator::get(type));
+		for (size_t ii = start; ii < run.end; ii++) {
+			charges[ii] = (int32_t) run.charge;
+			types[ii] = (int8_t) static_cast<int>(type);
+			if (!labels) continue;
+			std::string label = generator.label(
+				workspace->sequence, positions[ii] - 1, run.row, run.charge, radical,
+				config.ionTypes[run.typeIndex].second);
+			PyObject* labelObj = PyUnicode_FromString(label.c_str());
+			if (labelObj == NULL) {
+				Py_DECREF(labelList);
+				return NULL;
+			}
+			PyList_SET_ITEM(labelList, ii, labelObj);
+		}
+		start = run.end;
+	}
+
+	// As for fragment_masses, the result owns each buffer once set
+	PyObject* result = PyTuple_New(5);
+	if (result == NULL) {
+		Py_DECREF(labelList);
+		return NULL;
+	}
+	PyTuple_SET_ITEM(result, 4, labelList);
+	try {
+		PyTuple_SET_ITEM(result, 0, massesToBytes(mz, massFormat));
+		PyTuple_SET_ITEM(result, 1, vectorToBytes(positions));
+		PyTuple_SET_ITEM(result, 2, vectorToBytes(charges));
+		PyTuple_SET_ITEM(result, 3, vectorToBytes(types));
+		return result;
+	}
+	catch (const std::overflow_error& ex) {
+		Py_DECREF(result);
+		PyErr_SetString(PyExc_OverflowError, ex.what());
+		return NULL;
+	}
+	catch (const std::exception& ex) {
+		Py_DECREF(result);
+		PyErr_SetString(PyExc_RuntimeError, ex.what());
+		return NULL;
+	}
+}
+
+/* Isotope distributions */
+
+/*
+ * The calling thread's IsotopeCalculator, whose cache of element
+ * distributions is kept between calls.
+ */
+IsotopeCalculator& threadIsotopeCalculator() {
+	thread_local IsotopeCalculator calculator;
+	return calculator;
+}
+
+PyObject* Peptide_isotopes(PeptideObject* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames) {
+	PEPFRAG_TRACE_SPAN("isotopes");
+
+	PyObject* values[3];
+	long nPeaks;
+	long charge;
+	if (!isotopesParameters.parse(args, nargs, kwnames, values)
+			|| !argumentToLong(values[1], nPeaks)
+			|| !argumentToLong(values[2], charge)) return NULL;
+	if (nPeaks < 1 || charge < 1) {
+		PyErr_SetString(PyExc_ValueError, "n_peaks and charge must be at least 1");
+		return NULL;
+	}
+
+	PyObject* ionTypes = PySequence_Fast(values[0], "ion_types must be a sequence");
+	if (ionTypes == NULL) return NULL;
+	std::vector<IonType> types;
+	for (Py_ssize_t ii = 0; ii < PySequence_Fast_GET_SIZE(ionTypes); ii++) {
+		long type;
+		if (!argumentToLong(PySequence_Fast_GET_ITEM(ionTypes, ii), type)) {
+			Py_DECREF(ionTypes);
+			return NULL;
+		}
+		types.push_back(static_cast<IonType>(type));
+	}
+	Py_DECREF(ionTypes);
+
+	WorkspaceLease workspace;
+	long peptideCharge;
+	bool radical;
+	if (!loadPeptide(self, peptideCharge, radical, *workspace)) return NULL;
+
+	PyObject* result = PyList_New((Py_ssize_t) types.size());
+	if (result == NULL) return NULL;
+	std::vector<double> mz;
+	std::vector<double> abundances;
+	try {
+		IsotopeCalculator& calculator = threadIsotopeCalculator();
+		for (size_t ii = 0; ii < types.size(); ii++) {
+			ionIsotopes(types[ii], charge, (size_t) nPeaks, calculator, *workspace, mz, abundances);
+			// The result owns each object once set, so that a failure,
+			// or exception, part way releases those already built
+			PyObject* pair = PyTuple_New(2);
+			if (pair == NULL) {
+				Py_DECREF(result);
+				return NULL;
+			}
+			PyList_SET_ITEM(result, ii, pair);
+			PyObject* mzBytes = vectorToBytes(mz);
+			if (mzBytes == NULL) {
+				Py_DECREF(result);
+				return NULL;
+			}
+			PyTuple_SET_ITEM(pair, 0, mzBytes);
+			PyObject* abundanceBytes = vectorToBytes(abundances);
+			if (abundanceBytes == NULL) {
+				Py_DECREF(result);
+				return NULL;
+			}
+			PyTuple_SET_ITEM(pair, 1, abundanceBytes);
+		}
+	}
+	catch (const std::invalid_argument& ex) {
+		Py_DECREF(result);
+		PyErr_SetString(PyExc_ValueError, ex.what());
+		return NULL;
+	}
+	catch (const std::exception& ex) {
+		Py_DECREF(result);
+		PyErr_SetString(PyExc_RuntimeError, ex.what());
+		return NULL;
+	}
+	return result;
+}
+
+/* Batch fragmentation */
+
+PyObject* python_fragmentPeptides(PyObject* module, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames) {
+	PEPFRAG_TRACE_SPAN("fragment_peptides");
+
+	PyObject* values[10];
+	IonGenerationOptions options;
+	if (!fragmentPeptidesParameters.parse(args, nargs, kwnames, values)
+			|| !setGenerationOptions(values + 2, options)) return NULL;
+
+	PyObject* peptides = PySequence_Fast(values[0], "peptides must be a sequence");
+	if (peptides == NULL) return NULL;
+
+	Py_ssize_t nPeptides = PySequence_Fast_GET_SIZE(peptides);
+	PyObject* result = PyList_New(nPeptides);
+	if (result == NULL) {
+		Py_DECREF(peptides);
+		return NULL;
+	}
+
+	try {
+		IonConfig config = toIonConfig(values[1]);
+
+		WorkspaceLease workspace;
+		for (Py_ssize_t ii = 0; ii < nPeptides; ii++) {
+			PyObject* item = PySequence_Fast_GET_ITEM(peptides, ii);
+			if (!PyObject_TypeCheck(item, &PeptideBaseType)) {
+				PyErr_Format(
+					PyExc_TypeError, "peptides must contain Peptide objects, not %.200s",
+					Py_TYPE(item)->tp_name);
+				break;
+			}
+
+			PeptideObject* peptide = (PeptideObject*) item;
+			long charge;
+			bool radical;
+			if (!loadPeptide(peptide, charge, radical, *workspace)) break;
+
+			PEPFRAG_COUNT(peptides);
+			generateConfigIons(config, charge, radical, options, *workspace);
+
+			PEPFRAG_TRACE_SPAN("convert output");
+			PyObject* ions = vectorToList(workspace->ions, &ionToTuple);
+			if (ions == NULL) break;
+			PyList_SET_ITEM(result, ii, ions);
+		}
+	}
+	catch (const std::exception& ex) {
+		PyErr_SetString(PyExc_RuntimeError, ex.what());
+	}
+
+	Py_DECREF(peptides);
+	if (PyErr_Occurred()) {
+		Py_DECREF(result);
+		return NULL;
+	}
+	return result;
+}
+
+/* Type definition */
+
+PeptideAttribute ATTRIBUTES[] = {
+	PeptideAttribute::seq, PeptideAttribute::charge, PeptideAttribute::mods,
+	PeptideAttribute::massType, PeptideAttribute::radical
+};
+
+PyGetSetDef peptideGetSet[] = {
+	{"seq", (getter) Peptide_getAttribute, (setter) Peptide_setAttribute,
+	 "The peptide sequence (single character format).", &ATTRIBUTES[0]},
+	{"charge", (getter) Peptide_getAttribute, (setter) Peptide_setAttribute,
+	 "The charge state of the peptide.", &ATTRIBUTES[1]},
+	{"mods", (getter) Peptide_getAttribute, (setter) Peptide_setAttribute,
+	 "The modifications applied to the peptide.", &ATTRIBUTES[2]},
+	{"mass_type", (getter) Peptide_getAttribute, (setter) Peptide_setAttribute,
+	 "Type of masses used in calculations (see MassType).", &ATTRIBUTES[3]},
+	{"radical", (getter) Peptide_getAttribute, (setter) Peptide_setAttribute,
+	 "Flag indicating whether the peptide is a radical peptide.", &ATTRIBUTES[4]},
+	{"peptide_mass", (getter) Peptide_getPeptideMass, NULL,
+	 "The mass of the peptide along the sequence, with each position calculated separately.\n\n"
+	 "Index 0 is the N-terminus mass, while index -1 is the C-terminus mass.", NULL},
+	{"mass", (getter) Peptide_getMass, NULL,
+	 "Total mass of the peptide, including modifications.", NULL},
+	{"mz", (getter) Peptide_getMz, NULL,
+	 "The mass-to-charge ratio of the peptide.", NULL},
+	{NULL, NULL, NULL, NULL, NULL} /* SENTINEL */
+};
+
+PyMethodDef peptideMethods[] = {
+	{"calculate_mass", (PyCFunction) Peptide_calculateMass, METH_NOARGS,
+	 "Calculates the theoretical mass of the peptide along the sequence, including any modifications.\n\n"
+	 "Index 0 of the returned list is the N-terminus mass, while index -1 is the C-terminus mass."},
+	{"_ion_masses", (PyCFunction) Peptide_ionMasses, METH_NOARGS,
+	 "The b and y ion masses of the peptide."},
+	{"_fragment", (PyCFunction) (void(*)(void)) Peptide_fragment, METH_FASTCALL | METH_KEYWORDS,
+	 "Fragments the peptide for a converted ion type dict or a registered configuration handle."},
+	{"_fragment_masses", (PyCFunction) (void(*)(void)) Peptide_fragmentMasses, METH_FASTCALL | METH_KEYWORDS,
+	 "As _fragment, returning packed masses and positions without labels."},
+	{"_fragment_charges", (PyCFunction) (void(*)(void)) Peptide_fragmentCharges, METH_FASTCALL | METH_KEYWORDS,
+	 "As _fragment, for each of a sequence of charge states, returning a dict of charge to ions."},
+	{"_fragment_top_down", (PyCFunction) (void(*)(void)) Peptide_fragmentTopDown, METH_FASTCALL | METH_KEYWORDS,
+	 "Fragments the terminal ion series of a large peptide or protein, returning packed arrays."},
+	{"_isotopes", (PyCFunction) (void(*)(void)) Peptide_isotopes, METH_FASTCALL | METH_KEYWORDS,
+	 "The isotope peaks of each ion of a sequence of ion types, as packed m/z and abundance arrays."},
+	{NULL, NULL, 0, NULL} /* SENTINEL */
+};
+
+PyTypeObject PeptideBaseType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"cpepfrag.PeptideBase",
+};
+
+bool initPeptideType() {
+	if (!fragmentParameters.intern()
+			|| !fragmentMassesParameters.intern()
+			|| !fragmentChargesParameters.intern()
+			|| !fragmentPeptidesParameters.intern()
+			|| !fragmentTopDownParameters.intern()
+			|| !isotopesParameters.intern()) {
+		return false;
+	}
+
+	PeptideBaseType.tp_basicsize = sizeof(PeptideObject);
+	PeptideBaseType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC;
+	PeptideBaseType.tp_doc = "Native storage and cached masses for pepfrag.Peptide.";
+	PeptideBaseType.tp_new = PyType_GenericNew;
+	PeptideBaseType.tp_init = (initproc) Peptide_init;
+	PeptideBaseType.tp_dealloc = (destructor) Peptide_dealloc;
+	PeptideBaseType.tp_traverse = (traverseproc) Peptide_traverse;
+	PeptideBaseType.tp_clear = (inquiry) Peptide_clear;
+	PeptideBaseType.tp_getset = peptideGetSet;
+	PeptideBaseType.tp_methods = peptideMethods;
+
+	return PyType_Ready(&PeptideBaseType) == 0;
+}
@@ -0,0 +1,27 @@
+#ifndef _PEPFRAG_PEPTIDE_H
+#define _PEPFRAG_PEPTIDE_H
+
+#include <Python.h>
+
+/*
+ * cpepfrag.PeptideBase, the native base of pepfrag.Peptide. It stores the
+ * seq, charge, mods, mass_type and radical attributes, and caches the
+ * sequence, residue masses and b/y mass ladders derived from them, so that
+ * these are converted and calculated once per peptide rather than on every
+ * mass or fragment call.
+ */
+extern PyTypeObject PeptideBaseType;
+
+/*
+ * cpepfrag.fragment_peptides(peptides, ion_types): fragments a sequence of
+ * PeptideBase objects, returning a list of the ion lists of each.
+ */
+PyObject* python_fragmentPeptides(PyObject* module, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames);
+
+/*
+ * Interns the argument names of the type's methods. Returns false, with a
+ * Python exception set, on failure.
+ */
+bool initPeptideType();
+
+#endif // _PEPFRAG_PEPTIDE_H
@@ -0,0 +1,69 @@
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+
+#include "stats.h"
+
+#ifdef PEPFRAG_STATS
+
+std::atomic<unsigned long long> counterValues[(size_t) StatCounter::count];
+std::atomic<unsigned long long> timerValues[(size_t) StatTimer::count];
+std::atomic<unsigned long long> ionCounts[MAX_ION_TYPE + 1];
+
+long long nowNanoseconds() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void addCount(StatCounter counter, unsigned long long n) {
+	counterValues[(size_t) counter].fetch_add(n, std::memory_order_relaxed);
+}
+
+void addIonCount(IonType type, unsigned long long n) {
+	ionCounts[(size_t) type].fetch_add(n, std::memory_order_relaxed);
+}
+
+ScopedTimer::ScopedTimer(StatTimer timer) : timer(timer), start(nowNanoseconds()) {}
+
+ScopedTimer::~ScopedTimer() {
+	timerValues[(size_t) timer].fetch_add(
+		(unsigned long long) (nowNanoseconds() - start), std::memory_order_relaxed);
+}
+
+bool statsEnabled() {
+	return true;
+}
+
+Stats stats() {
+	Stats snapshot;
+	for (size_t ii = 0; ii < (size_t) StatCounter::count; ii++) {
+		snapshot.counters[ii] = counterValues[ii].load(std::memory_order_relaxed);
+	}
+	for (size_t ii = 0; ii < (size_t) StatTimer::count; ii++) {
+		snapshot.timers[ii] = timerValues[ii].load(std::memory_order_relaxed);
+	}
+	for (size_t ii = 0; ii <= MAX_ION_TYPE; ii++) {
+		snapshot.ions[ii] = ionCounts[ii].load(std::memory_order_relaxed);
+	}
+	return snapshot;
+}
+
+void resetStats() {
+	for (auto& value : counterValues) value = 0;
+	for (auto& value : timerValues) value = 0;
+	for (auto& value : ionCounts) value = 0;
+}
+
+#else
+
+bool statsEnabled() {
+	return false;
+}
+
+Stats stats() {
+	return Stats();
+}
+
+void resetStats() {}
+
+#endif // PEPFRAG_STATS
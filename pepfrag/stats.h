@@ -0,0 +1,104 @@
+#ifndef _PEPFRAG_STATS_H
+#define _PEPFRAG_STATS_H
+
+/*
+ * Runtime instrumentation counters, enabled by defining PEPFRAG_STATS at
+ * build time (e.g. PEPFRAG_STATS=1 python setup.py build_ext). Without it,
+ * the PEPFRAG_COUNT* and PEPFRAG_TIME macros expand to nothing, so the
+ * instrumentation has no cost.
+ *
+ * Counters are summed over all threads since the last reset.
+ */
+
+#include <cstddef>
+
+#include "ion.h"
+
+enum class StatCounter {
+	// Calls per cpepfrag entry point
+	generateIonsCalls = 0,
+	generateIonMassesCalls,
+	calculateMassCalls,
+	registerIonTypesCalls,
+	// Peptides for which ions were generated
+	peptides,
+	// Lookups in the position/charge label string cache
+	labelCacheHits,
+	labelCacheMisses,
+	// Generation calls by whether the ion types were given as a registered
+	// configuration handle or converted from a dict
+	registeredConfigs,
+	convertedConfigs,
+	count
+};
+
+enum class StatTimer {
+	dictToIonTypeMap = 0,
+	listToDoubleVector,
+	vectorToList,
+	generation,
+	merge,
+	count
+};
+
+struct Stats {
+	unsigned long long counters[(size_t) StatCounter::count];
+	// Cumulative time, in nanoseconds
+	unsigned long long timers[(size_t) StatTimer::count];
+	// Ions generated, indexed by IonType value
+	unsigned long long ions[MAX_ION_TYPE + 1];
+};
+
+/*
+ * Whether the counters were compiled in.
+ */
+bool statsEnabled();
+
+/*
+ * A snapshot of the counters, all zero if statsEnabled() is false.
+ */
+Stats stats();
+
+void resetStats();
+
+#ifdef PEPFRAG_STATS
+
+void addCount(StatCounter counter, unsigned long long n);
+
+void addIonCount(IonType type, unsigned long long n);
+
+/*
+ * Adds the time between its construction and destruction to the timer.
+ */
+class ScopedTimer {
+	public:
+		explicit ScopedTimer(StatTimer timer);
+
+		~ScopedTimer();
+
+		ScopedTimer(const ScopedTimer&) = delete;
+		ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+	private:
+		StatTimer timer;
+		long long start;
+};
+
+#define PEPFRAG_CONCAT_INNER(a, b) a##b
+#define PEPFRAG_CONCAT(a, b) PEPFRAG_CONCAT_INNER(a, b)
+
+#define PEPFRAG_COUNT(counter) addCount(StatCounter::counter, 1)
+#define PEPFRAG_COUNT_N(counter, n) addCount(StatCounter::counter, (n))
+#define PEPFRAG_COUNT_IONS(type, n) addIonCount((type), (n))
+#define PEPFRAG_TIME(timer) ScopedTimer PEPFRAG_CONCAT(pepfragTimer, __LINE__)(StatTimer::timer)
+
+#else
+
+#define PEPFRAG_COUNT(counter) ((void) 0)
+#define PEPFRAG_COUNT_N(counter, n) ((void) 0)
+#define PEPFRAG_COUNT_IONS(type, n) ((void) 0)
+#define PEPFRAG_TIME(timer) ((void) 0)
+
+#endif // PEPFRAG_STATS
+
+#endif // _PEPFRAG_STATS_H
@@ -0,0 +1,276 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "iongenerator.h"
+#include "topdown.h"
+#include "tracing.h"
+
+/*
+ * The ions of one charge state of a series, with the end of those of each
+ * mass table row.
+ */
+struct ChargeStateIons {
+	std::vector<double> mz;
+	std::vector<uint32_t> positions;
+	std::vector<size_t> rowEnds;
+};
+
+bool isTerminalSeries(IonType type) {
+	switch (type) {
+		case IonType::b:
+		case IonType::a:
+		case IonType::c:
+		case IonType::y:
+		case IonType::z:
+		case IonType::x:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// The m/z of a singly charged table mass at the charge state, with the
+// arithmetic of computeFragmentMasses
+inline double chargedMz(double mass, long charge) {
+	return charge > 1 ? (mass + PROTON_MASS * (double) (charge - 1)) / (double) charge : mass;
+}
+
+/*
+ * Computes the ions of the charge state from the singly charged mass table,
+ * whose first position is firstIndex of the ladder. Rows which increase in
+ * mass are searched for the positions within the m/z range, and any others
+ * filtered.
+ */
+void computeChargeState(
+	const FragmentMassTable& table,
+	long firstIndex,
+	long charge,
+	const std::vector<char>& increasing,
+	const TopDownOptions& options,
+	ChargeStateIons& ions)
+{
+	ions.mz.clear();
+	ions.positions.clear();
+	ions.rowEnds.clear();
+
+	// As for SimpleIonGenerator::generate, only positions p with
+	// p >= 2 * charge - 1 are charged
+	long minPosition = charge > 1 ? 2 * charge - 1 : 1;
+	long firstCharged = std::max(minPosition - 1 - firstIndex, 0L);
+	size_t begin = std::min((size_t) firstCharged, table.nPositions);
+
+	for (size_t row = 0; row < table.nRows; row++) {
+		const double* masses = table.row(1, row);
+		size_t first = begin;
+		size_t last = table.nPositions;
+		if (increasing[row]) {
+			first = std::partition_point(masses + first, masses + last, [&](double mass) {
+				return chargedMz(mass, charge) < options.minMz;
+			}) - masses;
+			last = std::partition_point(masses + first, masses + last, [&](double mass) {
+				return chargedMz(mass, charge) <= options.maxMz;
+			}) - masses;
+		}
+		for (size_t ii = first; ii < last; ii++) {
+			double mz = chargedMz(masses[ii], charge);
+			if (!increasing[row] && (mz < options.minMz || mz > options.maxMz)) continue;
+			ions.mz.push_back(mz);
+			ions.positions.push_back((uint32_t) (firstIndex + (long) ii + 1));
+		}
+		ions.rowEnds.push_back(ions.mz.size());
+	}
+}
+
+/*
+ * Passes the ions of the charge state to the sink in chunks of at most
+ * chunkSize ions of one row.
+ */
+void emitChargeState(
+	IonType type,
+	long charge,
+	const ChargeStateIons& ions,
+	size_t chunkSize,
+	const TopDownSink& sink)
+{
+	size_t start = 0;
+	for (size_t row = 0; row < ions.rowEnds.size(); row++) {
+		size_t end = ions.rowEnds[row];
+		for (; start < end; start += std::min(chunkSize, end - start)) {
+			size_t size = std::min(chunkSize, end - start);
+			sink({type, charge, row, size, ions.mz.data() + start, ions.positions.data() + start});
+		}
+	}
+}
+
+/*
+ * Threads, started once and joined on destruction, which run the tasks of
+ * each wave alongside the calling thread.
+ */
+class WaveWorkers {
+	public:
+		explicit WaveWorkers(size_t nWorkers) : errors(nWorkers + 1) {
+			try {
+				threads.reserve(nWorkers);
+				for (size_t ii = 1; ii <= nWorkers; ii++) {
+					threads.emplace_back(&WaveWorkers::work, this, ii);
+				}
+			}
+			catch (...) {
+				stop();
+				throw;
+			}
+		}
+
+		~WaveWorkers() {
+			stop();
+		}
+
+		WaveWorkers(const WaveWorkers&) = delete;
+		WaveWorkers& operator=(const WaveWorkers&) = delete;
+
+		/*
+		 * Runs task(0) on the calling thread and task(ii), for ii in
+		 * [1, size), on the workers, then, once all have finished, rethrows
+		 * the exception of the first task, by index, which threw.
+		 */
+		void run(size_t size, const std::function<void(size_t)>& task) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				waveTask = &task;
+				waveSize = std::min(size, threads.size() + 1);
+				pending = waveSize - 1;
+				wave++;
+			}
+			started.notify_all();
+
+			runTask(0);
+
+			std::unique_lock<std::mutex> lock(mutex);
+			finished.wait(lock, [this]() { return pending == 0; });
+			waveTask = nullptr;
+			for (size_t ii = 0; ii < waveSize; ii++) {
+				if (errors[ii]) {
+					std::exception_ptr error = errors[ii];
+					std::fill(errors.begin(), errors.end(), nullptr);
+					std::rethrow_exception(error);
+				}
+			}
+		}
+
+	private:
+		void runTask(size_t index) {
+			try {
+				(*waveTask)(index);
+			}
+			catch (...) {
+				errors[index] = std::current_exception();
+			}
+		}
+
+		void work(size_t index) {
+			unsigned long seen = 0;
+			while (true) {
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					started.wait(lock, [&]() { return stopping || wave != seen; });
+					if (stopping) return;
+					seen = wave;
+					if (index >= waveSize) continue;
+				}
+				runTask(index);
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					pending--;
+				}
+				finished.notify_one();
+			}
+		}
+
+		void stop() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			started.notify_all();
+			for (std::thread& thread : threads) {
+				thread.join();
+			}
+			threads.clear();
+		}
+
+		std::vector<std::thread> threads;
+		std::mutex mutex;
+		std::condition_variable started;
+		std::condition_variable finished;
+		// The current wave, its number of tasks and those yet to finish on
+		// the workers, and the exception thrown by each task
+		const std::function<void(size_t)>* waveTask = nullptr;
+		size_t waveSize = 0;
+		size_t pending = 0;
+		unsigned long wave = 0;
+		bool stopping = false;
+		std::vector<std::exception_ptr> errors;
+};
+
+void fragmentTopDown(
+	const IonTypeMap& ionTypes,
+	long charge,
+	bool radical,
+	const TopDownOptions& options,
+	Workspace& workspace,
+	const TopDownSink& sink)
+{
+	for (const auto& pair : ionTypes) {
+		if (!isTerminalSeries(pair.first)) {
+			throw std::invalid_argument(
+				"Ion type not supported for top-down fragmentation: "
+				+ std::to_string(static_cast<int>(pair.first)));
+		}
+	}
+
+	size_t chunkSize = std::max(options.chunkSize, (size_t) 1);
+	size_t nThreads = std::max(options.threads, 1u);
+	std::vector<ChargeStateIons> chargeStates(nThreads);
+	std::vector<char> increasing;
+	// No more threads are started than there are charge states to compute
+	WaveWorkers workers(std::min(nThreads, (size_t) std::max(charge, 1L)) - 1);
+
+	for (const auto& pair : ionTypes) {
+		PEPFRAG_TRACE_SPAN(generationSpanName(pair.first));
+		const SimpleIonGenerator& generator = static_cast<const SimpleIonGenerator&>(IonGenerator::get(pair.first));
+		FragmentMassTable& table = workspace.table;
+		long firstIndex = generator.massTable(
+			ionTypeMasses(pair.first, workspace), pair.second, radical, workspace.deltas, table);
+
+		increasing.assign(table.nRows, 1);
+		for (size_t row = 0; row < table.nRows; row++) {
+			const double* masses = table.row(1, row);
+			for (size_t ii = 1; ii < table.nPositions && increasing[row]; ii++) {
+				increasing[row] = masses[ii] >= masses[ii - 1];
+			}
+		}
+
+		// Each wave computes up to nThreads charge states, the first on this
+		// thread and the others on the workers, then emits them in order
+		for (long waveStart = 1; waveStart <= charge; waveStart += (long) nThreads) {
+			size_t waveSize = std::min(nThreads, (size_t) (charge - waveStart + 1));
+			workers.run(waveSize, [&](size_t ii) {
+				computeChargeState(
+					table, firstIndex, waveStart + (long) ii, increasing, options, chargeStates[ii]);
+			});
+
+			for (size_t ii = 0; ii < waveSize; ii++) {
+				emitChargeState(pair.first, waveStart + (long) ii, chargeStates[ii], chunkSize, sink);
+			}
+		}
+	}
+}
@@ -0,0 +1,74 @@
+#ifndef _PEPFRAG_TOPDOWN_H
+#define _PEPFRAG_TOPDOWN_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+
+#include "ion.h"
+#include "ionconfig.h"
+#include "workspace.h"
+
+/*
+ * Options for fragmentTopDown.
+ */
+struct TopDownOptions {
+	// The m/z range [minMz, maxMz] of the ions to generate
+	double minMz = -std::numeric_limits<double>::infinity();
+	double maxMz = std::numeric_limits<double>::infinity();
+	// The maximum number of ions passed to the sink in one chunk
+	size_t chunkSize = 1 << 16;
+	// The number of threads computing the charge states of a series
+	// concurrently
+	unsigned threads = 1;
+};
+
+/*
+ * A chunk of the ions of one row of the mass table of an ion series at one
+ * charge state, as parallel arrays. The row is 0 for the base ions, then
+ * each radical ion, if radical, then each neutral loss, as for
+ * SimpleIonGenerator::massTable. The arrays are only valid for the duration
+ * of the sink call.
+ */
+struct TopDownChunk {
+	IonType type;
+	long charge;
+	size_t row;
+	size_t size;
+	const double* mz;
+	const uint32_t* positions;
+};
+
+using TopDownSink = std::function<void(const TopDownChunk&)>;
+
+/*
+ * Fragments a large peptide or intact protein, taking its sequence and
+ * masses from the workspace, e.g. as set by setPeptideMasses, streaming the
+ * ions to sink in chunks rather than building Ions with labels.
+ *
+ * Only the terminal ion series, b, a and c and y, z and x, are supported,
+ * with their configured neutral losses. Each series' singly charged mass
+ * table is computed once, then the ions of each charge state up to charge,
+ * within the m/z range, are passed to the sink in order of ion type, charge
+ * state, row and position. Since each row of a ladder increases in mass, the
+ * range of positions within the m/z range of each charge state is found by
+ * binary search, so that ions outside it are never computed. The ions are
+ * otherwise those, with the same m/z, which fragmentPeptide would generate.
+ *
+ * At most options.threads charge states of a series are held in memory at
+ * once, each computed on its own thread: the calling thread or one of up to
+ * options.threads - 1 workers started once per call. The sink is only called
+ * from the calling thread. Exceptions thrown on the workers are rethrown on
+ * the calling thread once each has finished its charge state. Throws
+ * std::invalid_argument for other ion types.
+ */
+void fragmentTopDown(
+	const IonTypeMap& ionTypes,
+	long charge,
+	bool radical,
+	const TopDownOptions& options,
+	Workspace& workspace,
+	const TopDownSink& sink);
+
+#endif // _PEPFRAG_TOPDOWN_H
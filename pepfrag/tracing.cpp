@@ -0,0 +1,191 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "tracing.h"
+
+std::atomic<bool> tracingEnabled(false);
+
+struct TraceEvent {
+	const char* name;
+	long long start;
+	long long end;
+};
+
+/*
+ * The ring buffer of spans recorded by one thread. Buffers are shared with
+ * the registry below, so that the spans of exited threads can still be
+ * exported. A buffer grows up to the size of its session's ring as spans
+ * are recorded, so that threads recording few spans hold few.
+ */
+struct TraceBuffer {
+	std::mutex mutex;
+	size_t threadIndex;
+	// Whether the recording thread has exited
+	bool exited = false;
+	// The tracing session in which the events were recorded
+	unsigned long long session = 0;
+	size_t capacity = 0;
+	std::vector<TraceEvent> events;
+	// The index at which the next event will be written once full
+	size_t next = 0;
+};
+
+std::mutex traceRegistryMutex;
+std::vector<std::shared_ptr<TraceBuffer>> traceBuffers;
+size_t nextTraceThreadIndex = 1;
+
+std::atomic<unsigned long long> traceSession(0);
+std::atomic<size_t> traceBufferSize(0);
+std::atomic<long long> traceEpoch(0);
+
+long long traceClock() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * Removes the buffers of exited threads from the registry, whose mutex must
+ * be held, if keep returns false for them.
+ */
+template<class Keep>
+void dropExitedBuffers(Keep keep) {
+	traceBuffers.erase(
+		std::remove_if(traceBuffers.begin(), traceBuffers.end(), [&](const std::shared_ptr<TraceBuffer>& buffer) {
+			std::lock_guard<std::mutex> lock(buffer->mutex);
+			return buffer->exited && !keep(*buffer);
+		}),
+		traceBuffers.end());
+}
+
+/*
+ * A thread's buffer, marked as exited when the thread exits. It is then
+ * dropped at once if it has no spans of the current session, and otherwise
+ * once those are exported.
+ */
+struct ThreadTraceBuffer {
+	std::shared_ptr<TraceBuffer> buffer;
+
+	~ThreadTraceBuffer() {
+		if (!buffer) return;
+		std::lock_guard<std::mutex> registryLock(traceRegistryMutex);
+		{
+			std::lock_guard<std::mutex> lock(buffer->mutex);
+			buffer->exited = true;
+		}
+		unsigned long long session = traceSession.load();
+		dropExitedBuffers([&](const TraceBuffer& exited) {
+			return exited.session == session && !exited.events.empty();
+		});
+	}
+};
+
+TraceBuffer& threadTraceBuffer() {
+	thread_local ThreadTraceBuffer threadBuffer;
+	std::shared_ptr<TraceBuffer>& buffer = threadBuffer.buffer;
+	if (!buffer) {
+		buffer = std::make_shared<TraceBuffer>();
+		std::lock_guard<std::mutex> lock(traceRegistryMutex);
+		buffer->threadIndex = nextTraceThreadIndex++;
+		traceBuffers.push_back(buffer);
+	}
+	return *buffer;
+}
+
+void startTracing(size_t bufferSize) {
+	std::lock_guard<std::mutex> lock(traceRegistryMutex);
+	traceBufferSize = bufferSize;
+	traceEpoch = traceClock();
+	// Buffers from previous sessions are cleared when next written, and
+	// those of exited threads, which never will be, are dropped
+	traceSession++;
+	dropExitedBuffers([](const TraceBuffer&) { return false; });
+	tracingEnabled = true;
+}
+
+void stopTracing() {
+	tracingEnabled = false;
+}
+
+/* ScopedSpan */
+
+void ScopedSpan::begin() {
+	start = traceClock();
+}
+
+void ScopedSpan::end() {
+	long long endTime = traceClock();
+	TraceBuffer& buffer = threadTraceBuffer();
+
+	std::lock_guard<std::mutex> lock(buffer.mutex);
+	unsigned long long session = traceSession.load();
+	if (buffer.session != session) {
+		buffer.events.clear();
+		buffer.events.shrink_to_fit();
+		buffer.capacity = traceBufferSize.load();
+		buffer.next = 0;
+		buffer.session = session;
+	}
+	// Discard spans begun before the session started
+	if (buffer.capacity == 0 || start < traceEpoch.load()) {
+		return;
+	}
+
+	if (buffer.events.size() < buffer.capacity) {
+		buffer.events.push_back({name, start, endTime});
+		return;
+	}
+	buffer.events[buffer.next] = {name, start, endTime};
+	buffer.next = (buffer.next + 1) % buffer.capacity;
+}
+
+/* Export */
+
+void appendEvent(std::string& json, const TraceEvent& event, size_t threadIndex, long long epoch) {
+	char entry[256];
+	std::snprintf(
+		entry, sizeof(entry),
+		"{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f},\n",
+		event.name, threadIndex, (event.start - epoch) / 1000., (event.end - event.start) / 1000.);
+	json += entry;
+}
+
+std::string traceJson() {
+	std::string json = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+	long long epoch = traceEpoch.load();
+
+	std::lock_guard<std::mutex> registryLock(traceRegistryMutex);
+	unsigned long long session = traceSession.load();
+	for (const auto& buffer : traceBuffers) {
+		std::lock_guard<std::mutex> lock(buffer->mutex);
+		if (buffer->session != session || buffer->events.empty()) continue;
+
+		char entry[128];
+		std::snprintf(
+			entry, sizeof(entry),
+			"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,"
+			"\"args\":{\"name\":\"pepfrag thread %zu\"}},\n",
+			buffer->threadIndex, buffer->threadIndex);
+		json += entry;
+
+		// Oldest first: from the next to be overwritten, once full
+		size_t size = buffer->events.size();
+		for (size_t ii = 0; ii < size; ii++) {
+			appendEvent(json, buffer->events[(buffer->next + ii) % size], buffer->threadIndex, epoch);
+		}
+	}
+	// The spans of exited threads are exported once
+	dropExitedBuffers([](const TraceBuffer&) { return false; });
+
+	// Remove the trailing comma
+	if (json.compare(json.size() - 2, 2, ",\n") == 0) {
+		json.erase(json.size() - 2, 1);
+	}
+	json += "]}\n";
+	return json;
+}
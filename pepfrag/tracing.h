@@ -0,0 +1,76 @@
+#ifndef _PEPFRAG_TRACING_H
+#define _PEPFRAG_TRACING_H
+
+/*
+ * Scoped-span tracing, for per-thread timelines of the stages of ion
+ * generation. Each thread records its completed spans into its own ring
+ * buffer, which retains the most recent spans once full. The buffers can be
+ * exported in the Chrome trace event format, for viewing in Perfetto or
+ * chrome://tracing.
+ *
+ * Tracing is off until startTracing is called; while off, a span costs a
+ * single atomic load.
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+
+extern std::atomic<bool> tracingEnabled;
+
+/*
+ * Starts recording spans, discarding any previously recorded. Each thread
+ * retains up to bufferSize spans.
+ */
+void startTracing(size_t bufferSize);
+
+/*
+ * Stops recording spans. Recorded spans are kept for traceJson.
+ */
+void stopTracing();
+
+/*
+ * Returns the recorded spans from all threads as Chrome trace event JSON.
+ * Spans are complete ("X") events, with times in microseconds since
+ * startTracing. The buffers of threads which have exited are released once
+ * exported, so their spans are only included in the first export.
+ */
+std::string traceJson();
+
+/*
+ * Records a span covering its lifetime, if tracing was enabled on its
+ * construction. name must have static storage duration.
+ */
+class ScopedSpan {
+	public:
+		explicit ScopedSpan(const char* name)
+			: name(tracingEnabled.load(std::memory_order_relaxed) ? name : nullptr)
+		{
+			if (this->name != nullptr) {
+				begin();
+			}
+		}
+
+		~ScopedSpan() {
+			if (name != nullptr) {
+				end();
+			}
+		}
+
+		ScopedSpan(const ScopedSpan&) = delete;
+		ScopedSpan& operator=(const ScopedSpan&) = delete;
+
+	private:
+		void begin();
+		void end();
+
+		const char* name;
+		long long start;
+};
+
+#define PEPFRAG_TRACE_CONCAT_INNER(a, b) a##b
+#define PEPFRAG_TRACE_CONCAT(a, b) PEPFRAG_TRACE_CONCAT_INNER(a, b)
+
+#define PEPFRAG_TRACE_SPAN(name) ScopedSpan PEPFRAG_TRACE_CONCAT(pepfragSpan, __LINE__)(name)
+
+#endif // _PEPFRAG_TRACING_H
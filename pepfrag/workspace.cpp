@@ -0,0 +1,108 @@
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "workspace.h"
+
+std::atomic<unsigned long long> acquisitionCount(0);
+std::atomic<unsigned long long> fallbackCount(0);
+std::atomic<unsigned long long> allocationCount(0);
+std::atomic<unsigned long long> allocatedBytes(0);
+
+template<class T>
+size_t capacityBytes(const std::vector<T>& buffer) {
+	return buffer.capacity() * sizeof(T);
+}
+
+template<class T>
+size_t capacityBytes(const std::vector<std::vector<T>>& buffers) {
+	size_t bytes = buffers.capacity() * sizeof(std::vector<T>);
+	for (const std::vector<T>& buffer : buffers) {
+		bytes += capacityBytes(buffer);
+	}
+	return bytes;
+}
+
+std::array<size_t, Workspace::N_BUFFERS> Workspace::capacities() const {
+	return {
+		capacityBytes(ions),
+		capacityBytes(generated),
+		capacityBytes(mergeBuffer),
+		capacityBytes(table.masses),
+		capacityBytes(deltas),
+		capacityBytes(chargeIndices),
+		capacityBytes(lossSiteCounts),
+		capacityBytes(lossCells),
+		capacityBytes(singleIndices),
+		capacityBytes(singleLabels),
+		capacityBytes(basicSiteCounts),
+		capacityBytes(fragmentCharges),
+		capacityBytes(prefixMasses),
+		capacityBytes(fragmentHeap),
+		capacityBytes(internalFragments),
+		capacityBytes(satelliteLadder),
+		capacityBytes(satellitePositions),
+		capacityBytes(chargeEnds),
+		capacityBytes(typeIons),
+		capacityBytes(typeChargeEnds),
+		capacityBytes(chargeStateIons),
+		capacityBytes(ionPointers),
+		capacityBytes(pointerBuffer),
+		capacityBytes(precMasses),
+		capacityBytes(seqMasses),
+		capacityBytes(bMasses),
+		capacityBytes(yMasses),
+		sequence.capacity()
+	};
+}
+
+Workspace& threadWorkspace() {
+	thread_local Workspace workspace;
+	return workspace;
+}
+
+/* WorkspaceLease */
+
+WorkspaceLease::WorkspaceLease() {
+	workspace = &threadWorkspace();
+	if (workspace->inUse) {
+		temporary.reset(new Workspace());
+		workspace = temporary.get();
+		fallbackCount++;
+	}
+	workspace->inUse = true;
+	initialCapacities = workspace->capacities();
+	acquisitionCount++;
+}
+
+WorkspaceLease::~WorkspaceLease() {
+	std::array<size_t, Workspace::N_BUFFERS> finalCapacities = workspace->capacities();
+	for (size_t ii = 0; ii < Workspace::N_BUFFERS; ii++) {
+		if (finalCapacities[ii] > initialCapacities[ii]) {
+			allocationCount++;
+			allocatedBytes += finalCapacities[ii] - initialCapacities[ii];
+		}
+	}
+	workspace->inUse = false;
+}
+
+/* Statistics */
+
+WorkspaceStats workspaceStats() {
+	return {
+		acquisitionCount.load(),
+		fallbackCount.load(),
+		allocationCount.load(),
+		allocatedBytes.load()
+	};
+}
+
+void resetWorkspaceStats() {
+	acquisitionCount = 0;
+	fallbackCount = 0;
+	allocationCount = 0;
+	allocatedBytes = 0;
+}
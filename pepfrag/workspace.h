@@ -0,0 +1,149 @@
+#ifndef _PEPFRAG_WORKSPACE_H
+#define _PEPFRAG_WORKSPACE_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "fragmentkernel.h"
+#include "ion.h"
+
+/*
+ * Counters describing the allocations made by ion generation workspaces,
+ * summed over all threads since the last reset.
+ */
+struct WorkspaceStats {
+	// Number of workspace leases taken, i.e. generation calls
+	unsigned long long acquisitions;
+	// Number of leases served by a temporary workspace because the thread's
+	// workspace was already in use
+	unsigned long long fallbacks;
+	// Number of workspace buffers which had to grow during a lease
+	unsigned long long allocations;
+	// Total increase in workspace buffer capacity, in bytes
+	unsigned long long bytesAllocated;
+};
+
+/*
+ * An internal fragment of residues [start, end), less the delta of a row of
+ * InternalIonGenerator, with its neutral mass.
+ */
+struct InternalFragment {
+	double mass;
+	uint32_t start;
+	uint32_t end;
+	uint32_t row;
+};
+
+/*
+ * A position of a SatelliteIonGenerator ladder with a side chain cleavage,
+ * with the letter of the substituent lost, or '\0' if it is the only one.
+ */
+struct SatellitePosition {
+	uint32_t position;
+	char variant;
+};
+
+/*
+ * Reusable buffers for ion generation. The buffers retain their capacity
+ * between uses, so that once they have grown to fit the largest peptide seen,
+ * generation performs no further heap allocations for them.
+ *
+ * Note that label strings are not covered: with labels enabled, labels longer
+ * than the standard library's small string buffer are still heap allocated.
+ */
+struct Workspace {
+	// The merged output of all generators
+	Ions ions;
+	// The output of a single generator
+	Ions generated;
+	// Scratch space for mergeIonVectors
+	Ions mergeBuffer;
+
+	FragmentMassTable table;
+	std::vector<double> deltas;
+	std::vector<size_t> chargeIndices;
+	// For residue-aware neutral losses, the counts from countLossSites and
+	// the mass table cell of each singly charged ion, also used with m/z and
+	// ion limits
+	std::vector<unsigned> lossSiteCounts;
+	std::vector<size_t> lossCells;
+	// For m/z and ion limits, the index of the singly charged ion of each of
+	// the lossCells, if generated, and otherwise its label, once built for a
+	// higher charge state
+	std::vector<size_t> singleIndices;
+	std::vector<std::string> singleLabels;
+	// For the basic charge limit, the counts from countBasicSites and the
+	// maximum charge of the fragment at each position
+	std::vector<unsigned> basicSiteCounts;
+	std::vector<long> fragmentCharges;
+	// For internal fragments, the prefix sums of the residue masses, the
+	// heap of the next fragment of each start residue and row, and the
+	// fragments in order of mass
+	std::vector<double> prefixMasses;
+	std::vector<InternalFragment> fragmentHeap;
+	std::vector<InternalFragment> internalFragments;
+	// For satellite ions, the satellite ladder and its positions
+	std::vector<double> satelliteLadder;
+	std::vector<SatellitePosition> satellitePositions;
+	// The end of the ions of each charge state, relative to the first, of
+	// the last IonGenerator::generate call
+	std::vector<size_t> chargeEnds;
+
+	// The output of all generators for generateChargeStates, in turn, with
+	// the start of that of each generator followed by the ends of its charge
+	// states, and the ions of each charge state, pointing into typeIons
+	Ions typeIons;
+	std::vector<size_t> typeChargeEnds;
+	std::vector<std::vector<const Ion*>> chargeStateIons;
+	// Scratch space for mergeIonPointers
+	std::vector<const Ion*> ionPointers;
+	std::vector<const Ion*> pointerBuffer;
+
+	std::vector<double> precMasses;
+	std::vector<double> seqMasses;
+	std::vector<double> bMasses;
+	std::vector<double> yMasses;
+	std::string sequence;
+
+	bool inUse = false;
+
+	static const size_t N_BUFFERS = 28;
+
+	// The capacity, in bytes, of each buffer above
+	std::array<size_t, N_BUFFERS> capacities() const;
+};
+
+/*
+ * Provides exclusive use of the calling thread's Workspace for the lifetime
+ * of the lease, recording any growth of its buffers in the WorkspaceStats.
+ * If the thread's workspace is already leased, e.g. by a re-entrant call, a
+ * temporary workspace is used instead.
+ */
+class WorkspaceLease {
+	public:
+		WorkspaceLease();
+
+		~WorkspaceLease();
+
+		WorkspaceLease(const WorkspaceLease&) = delete;
+		WorkspaceLease& operator=(const WorkspaceLease&) = delete;
+
+		Workspace& operator*() const { return *workspace; }
+		Workspace* operator->() const { return workspace; }
+
+	private:
+		Workspace* workspace;
+		std::unique_ptr<Workspace> temporary;
+		std::array<size_t, Workspace::N_BUFFERS> initialCapacities;
+};
+
+WorkspaceStats workspaceStats();
+
+void resetWorkspaceStats();
+
+#endif // _PEPFRAG_WORKSPACE_H
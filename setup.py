@@ -13,6 +13,11 @@ if sys.platform != "win32":
 if sys.platform == "win32":
     extra_compiler_args.append("/utf-8")
 
+# Build with the runtime instrumentation counters (cpepfrag.stats()) enabled
+define_macros = []
+if os.environ.get("PEPFRAG_STATS", "0") not in ("", "0"):
+    define_macros.append(("PEPFRAG_STATS", "1"))
+
 
 # Extract README.md
 readme = os.path.join(os.path.abspath(os.path.dirname(__file__)), "README.md")
@@ -23,12 +28,26 @@ with open(readme, encoding='utf-8') as fh:
 cpepfrag = Extension(
     "cpepfrag",
     sources=[
+        # The core library, independent of CPython (see CMakeLists.txt)
+        os.path.join(PACKAGE_DIR, "fragment.cpp"),
+        os.path.join(PACKAGE_DIR, "fragmentkernel.cpp"),
         os.path.join(PACKAGE_DIR, "iongenerator.cpp"),
-        os.path.join(PACKAGE_DIR, "converters.cpp"),
+        os.path.join(PACKAGE_DIR, "ionconfig.cpp"),
+        os.path.join(PACKAGE_DIR, "isotope.cpp"),
         os.path.join(PACKAGE_DIR, "mass.cpp"),
+        os.path.join(PACKAGE_DIR, "topdown.cpp"),
+        os.path.join(PACKAGE_DIR, "workspace.cpp"),
+        os.path.join(PACKAGE_DIR, "stats.cpp"),
+        os.path.join(PACKAGE_DIR, "tracing.cpp"),
+        # The CPython binding
+        os.path.join(PACKAGE_DIR, "arguments.cpp"),
+        os.path.join(PACKAGE_DIR, "capi.cpp"),
+        os.path.join(PACKAGE_DIR, "converters.cpp"),
         os.path.join(PACKAGE_DIR, "cpepfrag.cpp"),
+        os.path.join(PACKAGE_DIR, "peptide.cpp"),
     ],
     language="c++11",
+    define_macros=define_macros,
     extra_compile_args=extra_compiler_args,
     extra_link_args=extra_link_args
 )
@@ -39,6 +58,10 @@ setup(
     packages=[
         "pepfrag",
     ],
+    # The C API header, for extensions using pepfrag.get_include()
+    package_data={
+        "pepfrag": ["pepfrag_capi.h"],
+    },
     license="MIT",
     description="A library for peptide fragment ion generation",
     author="Daniel Spencer",
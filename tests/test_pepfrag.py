@@ -1,11 +1,22 @@
+import array
+import copy
+import ctypes
+import json
+import pickle
+import re
 import unittest
+from concurrent.futures import ThreadPoolExecutor
 from typing import Dict, List, Tuple
 
 import numpy as np
 
+import cpepfrag
+
 from pepfrag.pepfrag import (
-    IonType, MassType, ModSite, Peptide, _reformat_ion_types
+    DEFAULT_IONS, IonPreset, IonType, MassFormat, MassType, ModSite, Peptide,
+    TopDownIons, _reformat_ion_types, fragment_peptides, register_ion_types
 )
+from pepfrag.constants import FIXED_MASSES, FIXED_POINT_SCALE
 
 
 def ions_to_dict(ions: List[Tuple[float, str, int]]) -> Dict[str, float]:
@@ -96,6 +107,79 @@ class TestPeptideMass(unittest.TestCase):
         self.assertAlmostEqual(427.28, peptide.mass, 2)
 
 
+class TestPeptideCache(unittest.TestCase):
+    """
+    Tests for the invalidation of the masses cached by pepfrag.Peptide.
+
+    """
+    def assertSameMasses(self, peptide: Peptide, expected: Peptide):
+        self.assertEqual(expected.peptide_mass, peptide.peptide_mass)
+        self.assertEqual(expected.mass, peptide.mass)
+        self.assertEqual(expected.mz, peptide.mz)
+        self.assertEqual(expected.fragment(), peptide.fragment())
+
+    def test_set_seq(self):
+        peptide = Peptide('ACDK', 2, [ModSite(15.994915, 2, 'Oxidation')])
+        peptide.fragment()
+        peptide.seq = 'ACEK'
+        self.assertSameMasses(
+            peptide, Peptide('ACEK', 2, [ModSite(15.994915, 2, 'Oxidation')])
+        )
+
+    def test_set_mods(self):
+        peptide = Peptide('ACDK', 2, [])
+        peptide.fragment()
+        peptide.mods = [ModSite(15.994915, 2, 'Oxidation')]
+        self.assertSameMasses(
+            peptide, Peptide('ACDK', 2, [ModSite(15.994915, 2, 'Oxidation')])
+        )
+
+    def test_mods_changed_in_place(self):
+        mods = [ModSite(15.994915, 2, 'Oxidation')]
+        peptide = Peptide('ACDK', 2, mods)
+        peptide.fragment()
+
+        mods.append(ModSite(304.20536, 'nterm', 'iTRAQ8plex'))
+        self.assertSameMasses(peptide, Peptide('ACDK', 2, list(mods)))
+
+        mods[0] = ModSite(57.021464, 2, 'Carbamidomethyl')
+        self.assertSameMasses(peptide, Peptide('ACDK', 2, list(mods)))
+
+    def test_set_mass_type(self):
+        peptide = Peptide('ACDK', 2, [])
+        peptide.fragment()
+        peptide.mass_type = MassType.avg
+        self.assertSameMasses(peptide, Peptide('ACDK', 2, [], MassType.avg))
+
+    def test_set_charge(self):
+        peptide = Peptide('ACDK', 2, [])
+        peptide.fragment()
+        peptide.charge = 3
+        self.assertSameMasses(peptide, Peptide('ACDK', 3, []))
+
+    def test_invalid_attributes(self):
+        peptide = Peptide('ACDK', 0, [])
+        with self.assertRaises(ZeroDivisionError):
+            peptide.mz
+
+        peptide.seq = 'AC1K'
+        with self.assertRaises(KeyError):
+            peptide.mass
+
+        peptide.seq = 'ACDK'
+        del peptide.mods
+        with self.assertRaises(AttributeError):
+            peptide.mass
+
+    def test_pickle_and_copy(self):
+        peptide = Peptide(
+            'ACDK', 2, [ModSite(15.994915, 2, 'Oxidation')], MassType.avg, True
+        )
+        for other in [pickle.loads(pickle.dumps(peptide)), copy.copy(peptide)]:
+            self.assertEqual(repr(peptide), repr(other))
+            self.assertSameMasses(other, peptide)
+
+
 class TestReformatIonTypeDictionary(unittest.TestCase):
     """
     Tests for the reformat_ion_types function.
@@ -309,6 +393,1347 @@ class TestPeptideFragmentation(unittest.TestCase):
         self.assertIsNotNone(ions)
 
 
+class TestPeptideFragmentMasses(unittest.TestCase):
+    """
+    Tests for the pepfrag.Peptide class, focusing on compact mass output.
+
+    """
+    def setUp(self):
+        self.peptide = Peptide(
+            'AYHGMLPWK', 4, [ModSite(15.994915, 5, 'Oxidation')], radical=True
+        )
+        self.ions = self.peptide.fragment()
+
+    def test_float64(self):
+        masses, positions = self.peptide.fragment_masses(
+            mass_format=MassFormat.float64)
+        self.assertEqual([ion[0] for ion in self.ions], list(masses))
+        self.assertEqual([ion[2] for ion in self.ions], list(positions))
+
+    def test_float32(self):
+        masses, positions = self.peptide.fragment_masses()
+        self.assertEqual('f', masses.typecode)
+        self.assertEqual(len(self.ions), len(masses))
+        for ion, mass in zip(self.ions, masses):
+            self.assertLess(abs(ion[0] - mass) / ion[0], 1e-6)
+        self.assertEqual([ion[2] for ion in self.ions], list(positions))
+
+    def test_fixed(self):
+        masses, _ = self.peptide.fragment_masses(
+            ion_types={IonType.b: ['H2O'], IonType.y: []},
+            mass_format=MassFormat.fixed
+        )
+        ions = self.peptide.fragment(
+            ion_types={IonType.b: ['H2O'], IonType.y: []})
+        self.assertEqual(
+            [round(ion[0] * FIXED_POINT_SCALE) for ion in ions], list(masses))
+
+    def test_fixed_overflow(self):
+        peptide = Peptide('AYHGMLPWK', 1, [ModSite(300000., 'nterm', 'M')])
+        with self.assertRaises(OverflowError):
+            peptide.fragment_masses(mass_format=MassFormat.fixed)
+        with self.assertRaises(OverflowError):
+            peptide.fragment_top_down(mass_format=MassFormat.fixed)
+        self.assertEqual(
+            len(peptide.fragment()),
+            len(peptide.fragment_masses(mass_format=MassFormat.float64)[0])
+        )
+
+    def test_invalid_format(self):
+        ion_types = _reformat_ion_types({IonType.b: []})
+        for mass_format in [-1, 3]:
+            with self.subTest(mass_format=mass_format):
+                with self.assertRaises(ValueError):
+                    self.peptide._fragment_masses(ion_types, mass_format)
+                with self.assertRaises(ValueError):
+                    self.peptide._fragment_top_down(ion_types, mass_format)
+
+
+class TestResidueLosses(unittest.TestCase):
+    """
+    Tests for the residue-aware application of neutral losses.
+
+    """
+    def loss_labels(self, peptide, ion_types, **kwargs):
+        return sorted(
+            label for _, label, _ in peptide.fragment(ion_types, **kwargs)
+            if '-' in label
+        )
+
+    def test_water_ammonia(self):
+        peptide = Peptide('GGSK', 1, [])
+        ion_types = {
+            IonType.b: ['H2O', 'NH3', 'CO'],
+            IonType.y: ['H2O', 'NH3'],
+            IonType.precursor: ['H2O', 'NH3']
+        }
+        self.assertEqual(
+            sorted([
+                '[b1-CO][+]', '[b2-CO][+]', '[b3-CO][+]', '[b3-H2O][+]',
+                '[y1-NH3][+]', '[y2-H2O][+]', '[y2-NH3][+]', '[y3-H2O][+]',
+                '[y3-NH3][+]', '[M-H2O][+]', '[M-NH3][+]'
+            ]),
+            self.loss_labels(peptide, ion_types, residue_losses=True)
+        )
+        # All losses are applied by default
+        self.assertEqual(17, len(self.loss_labels(peptide, ion_types)))
+
+    def test_precursor_losses(self):
+        peptide = Peptide('GGAL', 1, [])
+        self.assertEqual(
+            [],
+            self.loss_labels(
+                peptide, {IonType.precursor: ['H2O', 'NH3']}, residue_losses=True
+            )
+        )
+
+    def test_phosphate(self):
+        ion_types = {IonType.b: [('H3PO4', 97.976896)], IonType.y: [('H3PO4', 97.976896)]}
+        for mass_type in MassType:
+            phospho = 79.966331 if mass_type is MassType.mono else 79.9799
+            peptide = Peptide(
+                'AGSPK', 1, [ModSite(phospho, 3, 'Phospho')], mass_type
+            )
+            self.assertEqual(
+                sorted([
+                    '[b3-H3PO4][+]', '[b4-H3PO4][+]', '[y3-H3PO4][+]',
+                    '[y4-H3PO4][+]'
+                ]),
+                self.loss_labels(peptide, ion_types, residue_losses=True)
+            )
+
+        peptide = Peptide('AGSPK', 1, [])
+        self.assertEqual(
+            [], self.loss_labels(peptide, ion_types, residue_losses=True)
+        )
+
+    def test_charged(self):
+        peptide = Peptide('GGSKAAGR', 3, [])
+        full = peptide.fragment()
+        ions = peptide.fragment(residue_losses=True)
+        self.assertLess(len(ions), len(full))
+        self.assertTrue(set(ions) <= set(full))
+        self.assertIn('[b3-NH3][2+]', [label for _, label, _ in full])
+        self.assertNotIn('[b3-NH3][2+]', [label for _, label, _ in ions])
+        self.assertIn('[b3-H2O][2+]', [label for _, label, _ in ions])
+
+
+class TestStackedLosses(unittest.TestCase):
+    """
+    Tests for the combination of several neutral losses in a fragment.
+
+    """
+    def loss_ions(self, peptide, ion_types, **kwargs):
+        return {
+            label: mass for mass, label, _ in
+            peptide.fragment(ion_types, **kwargs) if '-' in label
+        }
+
+    def test_combinations(self):
+        peptide = Peptide('GGSKE', 1, [])
+        ion_types = {
+            IonType.b: ['H2O', 'NH3'],
+            IonType.precursor: ['H2O', 'NH3']
+        }
+        ions = self.loss_ions(peptide, ion_types, max_losses=2)
+        self.assertEqual(
+            sorted([
+                '[b{}-{}][+]'.format(position, loss)
+                for position in range(1, 5)
+                for loss in ['H2O', 'NH3', '2H2O', 'H2O-NH3', '2NH3']
+            ] + [
+                '[M-{}][+]'.format(loss)
+                for loss in ['H2O', 'NH3', '2H2O', 'H2O-NH3', '2NH3']
+            ]),
+            sorted(ions)
+        )
+        self.assertAlmostEqual(
+            ions['[b3-H2O][+]'] - FIXED_MASSES['NH3'], ions['[b3-H2O-NH3][+]']
+        )
+        self.assertAlmostEqual(
+            ions['[M-H2O][+]'] - FIXED_MASSES['H2O'], ions['[M-2H2O][+]']
+        )
+
+        self.assertEqual(
+            36,
+            len(self.loss_ions(
+                peptide, {IonType.b: ['H2O', 'NH3']}, max_losses=3
+            ))
+        )
+
+    def test_single_loss(self):
+        peptide = Peptide('AYHGMLPWK', 3, [])
+        self.assertEqual(peptide.fragment(), peptide.fragment(max_losses=1))
+
+    def test_cached_losses(self):
+        # The losses of a registered configuration are cached for each
+        # max_losses, so alternating between them gives the same ions
+        peptide = Peptide('AYHGMLPWK', 3, [])
+        single = peptide.fragment()
+        stacked = peptide.fragment(max_losses=2)
+        self.assertGreater(len(stacked), len(single))
+        self.assertEqual(single, peptide.fragment())
+        self.assertEqual(stacked, peptide.fragment(max_losses=2))
+        self.assertEqual(
+            stacked, Peptide('AYHGMLPWK', 3, []).fragment(max_losses=2)
+        )
+
+    def test_duplicate_masses(self):
+        peptide = Peptide('GGSK', 1, [])
+        ion_types = {
+            IonType.y: ['H2O', ('W2', 2 * FIXED_MASSES['H2O'])]
+        }
+        self.assertEqual(
+            sorted([
+                '[y{}-{}][+]'.format(position, loss)
+                for position in range(1, 4)
+                for loss in ['H2O', 'W2', 'H2O-W2', '2W2']
+            ]),
+            sorted(self.loss_ions(peptide, ion_types, max_losses=2))
+        )
+
+    def test_residue_losses(self):
+        peptide = Peptide('GGSKE', 1, [])
+        ions = self.loss_ions(
+            peptide, {IonType.y: ['H2O', 'NH3']}, residue_losses=True,
+            max_losses=2
+        )
+        self.assertEqual(
+            sorted([
+                '[y1-H2O][+]', '[y2-H2O][+]', '[y2-NH3][+]',
+                '[y2-H2O-NH3][+]', '[y3-H2O][+]', '[y3-NH3][+]',
+                '[y3-2H2O][+]', '[y3-H2O-NH3][+]', '[y4-H2O][+]',
+                '[y4-NH3][+]', '[y4-2H2O][+]', '[y4-H2O-NH3][+]'
+            ]),
+            sorted(ions)
+        )
+
+    def test_invalid(self):
+        with self.assertRaises(ValueError):
+            Peptide('GGSK', 1, []).fragment(max_losses=0)
+
+
+class TestIonLimits(unittest.TestCase):
+    """
+    Tests for the m/z range and ion count limits of fragmentation.
+
+    """
+    def test_mz_range(self):
+        peptide = Peptide('AYHGMLPWKDCRAYHGMLPWK', 4, [])
+        full = peptide.fragment()
+        for min_mz, max_mz in [(100, 2000), (300, 500), (None, 400), (900, None)]:
+            ions = peptide.fragment(min_mz=min_mz, max_mz=max_mz)
+            self.assertEqual(
+                sorted(
+                    ion for ion in full
+                    if (min_mz is None or ion[0] >= min_mz)
+                    and (max_mz is None or ion[0] <= max_mz)
+                ),
+                sorted(ions)
+            )
+        self.assertEqual([], peptide.fragment(min_mz=5000))
+
+    def test_negative_mz(self):
+        # Without a range, losses may give ions of negative m/z
+        ions = ions_to_dict(Peptide('', 2, []).fragment())
+        self.assertAlmostEqual(-24.97199, ions['[M-CO2][+]'], places=5)
+        self.assertIn('[M-CO2][2+]', ions)
+
+    def test_charged_labels(self):
+        # Ions multiply charged into the range keep their labels though their
+        # singly charged ions are above it
+        peptide = Peptide('AYHGMLPWKDCR', 3, [])
+        ions = ions_to_dict(peptide.fragment(max_mz=700))
+        self.assertNotIn('y9[+]', ions)
+        self.assertIn('y9[2+]', ions)
+        self.assertAlmostEqual(
+            ions_to_dict(peptide.fragment())['y9[2+]'], ions['y9[2+]']
+        )
+
+    def test_max_ions(self):
+        peptide = Peptide('AYHGMLPWKDCR', 3, [])
+        ion_types = {IonType.b: [], IonType.y: ['H2O'], IonType.precursor: []}
+        full = peptide.fragment(ion_types)
+        ions = peptide.fragment(ion_types, max_ions=12)
+        self.assertEqual(27, len(ions))
+        self.assertTrue(set(ions) <= set(full))
+        # The singly charged ions of each type are kept first: the 11 b ions
+        # and one b ion at 2+, and 12 of the 22 y ions
+        labels = [label for _, label, _ in ions]
+        self.assertEqual(
+            ['b3[2+]'],
+            [l for l in labels if '[+]' not in l and not l.startswith('[M')]
+        )
+        self.assertEqual(12, len([l for l in labels if l.startswith(('y', '[y'))]))
+        self.assertEqual(full, peptide.fragment(ion_types, max_ions=1000))
+
+    def test_invalid(self):
+        with self.assertRaises(ValueError):
+            Peptide('GGSK', 1, []).fragment(max_ions=0)
+
+
+class TestBasicChargeLimit(unittest.TestCase):
+    """
+    Tests for the limiting of fragment charges by their basic sites.
+
+    """
+    def charged_labels(self, ions):
+        return [label for _, label, _ in ions if '[+]' not in label]
+
+    def test_basic_sites(self):
+        peptide = Peptide('GGSAGAKGGAGR', 4, [])
+        ion_types = {IonType.b: [], IonType.y: []}
+        ions = peptide.fragment(ion_types, basic_charge_limit=True)
+        # Each fragment has its own N-terminal amine. b ions also have K
+        # from b7; y ions have R and, from y6, K
+        self.assertEqual(
+            sorted(
+                ['b{}[2+]'.format(ii) for ii in range(7, 12)]
+                + ['y{}[2+]'.format(ii) for ii in range(3, 12)]
+                + ['y{}[3+]'.format(ii) for ii in range(6, 12)]
+            ),
+            sorted(self.charged_labels(ions))
+        )
+
+        full = peptide.fragment(ion_types)
+        self.assertTrue(set(ions) <= set(full))
+        self.assertEqual(
+            [ion for ion in full if '[+]' in ion[1]],
+            [ion for ion in ions if '[+]' in ion[1]]
+        )
+
+    def test_tryptic(self):
+        peptide = Peptide('AGLSPEDVTAEGK', 3, [])
+        ion_types = {IonType.b: [], IonType.y: []}
+        ions = peptide.fragment(ion_types, basic_charge_limit=True)
+        # The y ions have K and their own N-terminal amine, while the b ions
+        # have only the N-terminus
+        self.assertEqual(
+            sorted('y{}[2+]'.format(ii) for ii in range(3, 13)),
+            sorted(self.charged_labels(ions))
+        )
+        full = ions_to_dict(peptide.fragment(ion_types))
+        for mass, label, _ in ions:
+            self.assertEqual(full[label], mass)
+
+    def test_no_basic_sites(self):
+        peptide = Peptide('GGSAGAGGAGDE', 3, [])
+        self.assertEqual(
+            [], self.charged_labels(peptide.fragment(
+                {IonType.y: ['H2O']}, basic_charge_limit=True
+            ))
+        )
+
+
+class TestInternalFragments(unittest.TestCase):
+    """
+    Tests for the generation of internal fragment ions.
+
+    """
+    def expected(self, seq, charge, min_length=2, max_length=None):
+        ions = []
+        for start in range(1, len(seq) - 1):
+            for end in range(start + min_length, len(seq)):
+                if max_length is not None and end - start > max_length:
+                    continue
+                residues = seq[start:end]
+                mass = Peptide(residues, 1, []).fragment(
+                    {IonType.precursor: []}
+                )[0][0] - FIXED_MASSES['H2O']
+                for cs in range(1, charge + 1):
+                    if end - start < 2 * cs - 1:
+                        continue
+                    symbol = '{}+'.format(cs if cs > 1 else '')
+                    for delta, label in [
+                            (0, 'by({})'), (FIXED_MASSES['CO'], 'ay({})')]:
+                        ions.append((
+                            label.format(residues) + '[{}]'.format(symbol),
+                            (mass - delta + (cs - 1) * FIXED_MASSES['H']) / cs
+                        ))
+        return ions
+
+    def test_fragments(self):
+        peptide = Peptide('PEPTIDEKPRL', 3, [])
+        ions = ions_to_dict(peptide.fragment({IonType.internal: []}))
+        expected = dict(self.expected('PEPTIDEKPRL', 3))
+        self.assertEqual(sorted(expected), sorted(ions))
+        for label, mass in expected.items():
+            self.assertAlmostEqual(mass, ions[label], places=6)
+
+    def test_mass_order(self):
+        peptide = Peptide('AYHGMLPWKDCRAYHGMLPWK', 2, [])
+        ions = peptide.fragment({IonType.internal: ['H2O']})
+        singly = [mass for mass, label, _ in ions if '[+]' in label]
+        self.assertEqual(sorted(singly), singly)
+        doubly = [mass for mass, label, _ in ions if '[2+]' in label]
+        self.assertEqual(sorted(doubly), doubly)
+        self.assertTrue(
+            all(length == len(label[label.index('(') + 1:label.index(')')])
+                for _, label, length in ions)
+        )
+
+    def test_limits(self):
+        peptide = Peptide('PEPTIDEKPRL', 2, [])
+        ions = peptide.fragment(
+            {IonType.internal: []}, min_internal_length=3,
+            max_internal_length=4, min_mz=300, max_mz=450
+        )
+        self.assertEqual(
+            sorted(
+                label for label, mass in
+                self.expected('PEPTIDEKPRL', 2, 3, 4) if 300 <= mass <= 450
+            ),
+            sorted(label for _, label, _ in ions)
+        )
+        self.assertEqual(
+            [],
+            Peptide('PEK', 1, []).fragment({IonType.internal: []})
+        )
+
+    def test_losses(self):
+        peptide = Peptide('GGSAGK', 1, [])
+        labels = [
+            label for _, label, _ in peptide.fragment(
+                {IonType.internal: ['H2O']}, residue_losses=True
+            ) if '-' in label
+        ]
+        self.assertEqual(
+            sorted(['[by(GS)-H2O][+]', '[by(SA)-H2O][+]', '[by(GSA)-H2O][+]',
+                    '[by(SAG)-H2O][+]', '[by(GSAG)-H2O][+]']),
+            sorted(labels)
+        )
+
+
+class TestSatelliteIons(unittest.TestCase):
+    """
+    Tests for the generation of d, v and w satellite ions.
+
+    """
+    def test_leucine_isoleucine(self):
+        ion_types = {IonType.z: [], IonType.w: []}
+        leucine = ions_to_dict(Peptide('PEPTLDEK', 2, []).fragment(ion_types))
+        isoleucine = ions_to_dict(
+            Peptide('PEPTIDEK', 2, []).fragment(ion_types)
+        )
+        # Leucine loses an isopropyl, isoleucine an ethyl or a methyl group
+        self.assertAlmostEqual(
+            43.05478, leucine['z4[+]'] - leucine['w4[+]'], places=4
+        )
+        self.assertAlmostEqual(
+            29.03913, isoleucine['z4[+]'] - isoleucine['wa4[+]'], places=4
+        )
+        self.assertAlmostEqual(
+            15.02348, isoleucine['z4[+]'] - isoleucine['wb4[+]'], places=4
+        )
+        self.assertNotIn('wa4[+]', leucine)
+        self.assertNotIn('w4[+]', isoleucine)
+        # P and G have no satellite ions
+        self.assertNotIn('w6[+]', leucine)
+        self.assertIn('w7[+]', leucine)
+
+    def test_d_and_v_ions(self):
+        peptide = Peptide('GLKE', 2, [])
+        ions = ions_to_dict(peptide.fragment(
+            {IonType.a: [], IonType.y: [], IonType.d: ['H2O'], IonType.v: []}
+        ))
+        self.assertAlmostEqual(
+            ions['a2[+]'] + FIXED_MASSES['H'] - 43.05478, ions['d2[+]'],
+            places=4
+        )
+        self.assertAlmostEqual(
+            ions['d2[+]'] - FIXED_MASSES['H2O'], ions['[d2-H2O][+]'],
+            places=6
+        )
+        # v ions lose the whole side chain of E (C3H5O2), less a hydrogen
+        self.assertAlmostEqual(
+            ions['y1[+]'] - 73.02895 + FIXED_MASSES['H'], ions['v1[+]'],
+            places=4
+        )
+        # G has no side chain cleavage
+        self.assertNotIn('d1[+]', ions)
+        self.assertIn('d3[2+]', ions)
+        self.assertIn('v3[2+]', ions)
+
+    def test_modified_residues(self):
+        ions = Peptide(
+            'AMLK', 1, [ModSite(15.994915, 2, 'Oxidation')]
+        ).fragment({IonType.d: []})
+        self.assertEqual(['d3[+]'], [label for _, label, _ in ions])
+
+    def test_average_masses(self):
+        mono = ions_to_dict(Peptide('PEPTLDEK', 1, []).fragment(
+            {IonType.w: []}
+        ))
+        average = ions_to_dict(Peptide(
+            'PEPTLDEK', 1, [], mass_type=MassType.avg
+        ).fragment({IonType.w: []}))
+        self.assertEqual(sorted(mono), sorted(average))
+        self.assertAlmostEqual(mono['w4[+]'], average['w4[+]'], places=0)
+
+
+class TestEntryPointConsistency(unittest.TestCase):
+    """
+    Tests that fragment_peptides, fragment_charges and fragment_masses
+    generate the ions of fragment with each of the generation options.
+
+    """
+    peptides = [
+        Peptide('GGSKAAGR', 3, []),
+        Peptide('GGSKAAG', 2, []),
+        Peptide('GGSKAAGRHK', 4, []),
+        Peptide('AYHGMLPWKDCR', 3, []),
+        Peptide('PEPTIDEKPRL', 3, []),
+    ]
+
+    # The ion types, or None for the default, and options of each case
+    option_sets = {
+        'residue_losses': (None, {'residue_losses': True}),
+        'max_losses': (None, {'max_losses': 2}),
+        'limits': (None, {'min_mz': 150, 'max_mz': 600, 'max_ions': 40}),
+        'basic_charge_limit': (None, {'basic_charge_limit': True}),
+        'internal': ({IonType.b: [], IonType.internal: ['NH3']}, {}),
+        'satellite': ({IonType.b: [], IonType.w: [], IonType.d: ['NH3']}, {}),
+    }
+
+    def test_entry_points(self):
+        for name, (ion_types, kwargs) in self.option_sets.items():
+            with self.subTest(options=name):
+                expected = [p.fragment(ion_types, **kwargs) for p in self.peptides]
+                self.assertEqual(
+                    expected, fragment_peptides(self.peptides, ion_types, **kwargs)
+                )
+
+                for peptide, ions in zip(self.peptides, expected):
+                    charges = list(range(1, peptide.charge + 1))
+                    for charge, charge_ions in peptide.fragment_charges(
+                            charges, ion_types, **kwargs).items():
+                        self.assertEqual(
+                            Peptide(peptide.seq, charge, []).fragment(
+                                ion_types, **kwargs),
+                            charge_ions
+                        )
+
+                    masses, positions = peptide.fragment_masses(
+                        ion_types, MassFormat.float64, **kwargs
+                    )
+                    self.assertEqual([ion[0] for ion in ions], list(masses))
+                    self.assertEqual([ion[2] for ion in ions], list(positions))
+
+
+class TestTopDown(unittest.TestCase):
+    """
+    Tests for the top-down fragmentation of large peptides.
+
+    """
+    ion_types = {IonType.b: ['H2O', 'NH3'], IonType.y: ['H2O'], IonType.c: []}
+
+    def assert_matches(self, ions: TopDownIons, expected):
+        self.assertEqual(
+            sorted(zip(ions.labels, ions.mz, ions.positions)),
+            sorted((label, mass, position)
+                   for mass, label, position in expected)
+        )
+
+    def test_matches_fragment(self):
+        peptide = Peptide('PEPTIDEKPRLAYHGMLPWK', 5, [])
+        ions = peptide.fragment_top_down(self.ion_types, labels=True)
+        self.assert_matches(ions, peptide.fragment(self.ion_types))
+        self.assertEqual(len(ions.mz), len(ions.charges))
+        for label, charge in zip(ions.labels, ions.charges):
+            symbol = re.search(r'(\d*)\+\]$', label).group(1)
+            self.assertEqual(int(symbol or 1), charge)
+        self.assertEqual(
+            {IonType.b.value, IonType.y.value, IonType.c.value},
+            set(ions.ion_types)
+        )
+
+    def test_radical(self):
+        peptide = Peptide('PEPTIDEK', 2, [], radical=True)
+        ion_types = {IonType.a: ['NH3'], IonType.z: []}
+        self.assert_matches(
+            peptide.fragment_top_down(ion_types, labels=True),
+            peptide.fragment(ion_types)
+        )
+
+    def test_mz_range(self):
+        peptide = Peptide('AYHGMLPWKDCRAYHGMLPWKDCR', 8, [])
+        for threads in [1, 3]:
+            ions = peptide.fragment_top_down(
+                self.ion_types, min_mz=300, max_mz=700, labels=True,
+                threads=threads
+            )
+            self.assert_matches(
+                ions,
+                [ion for ion in peptide.fragment(self.ion_types)
+                 if 300 <= ion[0] <= 700]
+            )
+
+    def test_order(self):
+        ions = Peptide('AYHGMLPWKDCR', 3, []).fragment_top_down(
+            {IonType.b: [], IonType.y: []}
+        )
+        self.assertIsNone(ions.labels)
+        keys = list(zip(ions.ion_types, ions.charges))
+        self.assertEqual(sorted(keys), keys)
+        for ion_type in [IonType.b.value, IonType.y.value]:
+            for charge in range(1, 4):
+                mz = [m for m, t, c in zip(ions.mz, ions.ion_types, ions.charges)
+                      if t == ion_type and c == charge]
+                self.assertEqual(sorted(mz), mz)
+
+    def test_mass_format(self):
+        peptide = Peptide('AYHGMLPWKDCR', 2, [])
+        ions = peptide.fragment_top_down(mass_format=MassFormat.fixed)
+        self.assertEqual('i', ions.mz.typecode)
+        expected = peptide.fragment_top_down()
+        self.assertEqual(
+            [round(m * FIXED_POINT_SCALE) for m in expected.mz],
+            list(ions.mz)
+        )
+
+    def test_unsupported_types(self):
+        with self.assertRaises(RuntimeError):
+            Peptide('PEPTIDE', 2, []).fragment_top_down(
+                {IonType.b: [], IonType.imm: []}
+            )
+        with self.assertRaises(ValueError):
+            Peptide('PEPTIDE', 2, []).fragment_top_down(threads=0)
+
+
+class TestIsotopes(unittest.TestCase):
+    """
+    Tests for the isotope distributions of precursors and fragments.
+
+    """
+    # The (nominal shift, mass, abundance) of the isotopes of each element
+    isotopes = {
+        'C': [(0, 12., 0.9893), (1, 13.00335483507, 0.0107)],
+        'H': [(0, 1.00782503207, 0.999885), (1, 2.01410177812, 0.000115)],
+        'N': [(0, 14.0030740048, 0.99636), (1, 15.0001088982, 0.00364)],
+        'O': [(0, 15.99491461956, 0.99757), (1, 16.99913170, 0.00038),
+              (2, 17.9991610, 0.00205)],
+        'S': [(0, 31.97207100, 0.9499), (1, 32.97145876, 0.0075),
+              (2, 33.96786690, 0.0425), (4, 35.96708076, 0.0001)],
+    }
+
+    def expand(self, composition: Dict[str, int], n_peaks: int):
+        """
+        Returns the (abundance, mean mass shift) of the first peaks of the
+        distribution of the composition, adding one atom at a time.
+
+        """
+        peaks = {0: (1., 0.)}
+        for element, count in composition.items():
+            light = self.isotopes[element][0][1]
+            for _ in range(count):
+                expanded = {}
+                for shift, (abundance, shift_sum) in peaks.items():
+                    for nominal, mass, fraction in self.isotopes[element]:
+                        if shift + nominal >= n_peaks:
+                            continue
+                        total, total_sum = expanded.get(shift + nominal, (0., 0.))
+                        expanded[shift + nominal] = (
+                            total + abundance * fraction,
+                            total_sum + fraction * (shift_sum + abundance * (mass - light))
+                        )
+                peaks = expanded
+        return [(peaks[ii][0], peaks[ii][1] / peaks[ii][0])
+                for ii in range(n_peaks)]
+
+    def test_precursor(self):
+        # PEPTIDE is C34H53N7O15, with two charging protons
+        peptide = Peptide('PEPTIDE', 2, [])
+        peaks = peptide.fragment_isotopes([IonType.precursor], 4, charge=2)
+        envelope = peaks[IonType.precursor].envelope(0)
+        mono = peptide.mass / 2 + FIXED_MASSES['H']
+        expected = self.expand({'C': 34, 'H': 55, 'N': 7, 'O': 15}, 4)
+        self.assertEqual(4, len(envelope))
+        for (mz, abundance), (expected_abundance, shift) in zip(envelope, expected):
+            self.assertAlmostEqual(expected_abundance, abundance, places=12)
+            self.assertAlmostEqual(mono + shift / 2, mz, places=9)
+
+    def test_fragments(self):
+        # y2 of ACMK is MK, C11H24N3O3S+
+        peptide = Peptide('ACMK', 1, [])
+        peaks = peptide.fragment_isotopes(n_peaks=3)
+        self.assertEqual(3, len(peaks[IonType.y]))
+        expected = self.expand({'C': 11, 'H': 24, 'N': 3, 'O': 3, 'S': 1}, 3)
+        self.assertEqual(
+            [round(a, 12) for a, _ in expected],
+            [round(a, 12) for _, a in peaks[IonType.y].envelope(1)]
+        )
+
+        # The monoisotopic peaks are the ions of fragment
+        ions = ions_to_dict(peptide.fragment({IonType.b: [], IonType.y: []}))
+        for ion_type in [IonType.b, IonType.y]:
+            for ii in range(len(peaks[ion_type])):
+                self.assertAlmostEqual(
+                    ions[f'{ion_type.name}{ii + 1}[+]'],
+                    peaks[ion_type].envelope(ii)[0][0]
+                )
+
+    def test_charge(self):
+        peptide = Peptide('AYHGMLPWKDCR', 3, [])
+        single = peptide.fragment_isotopes([IonType.b], 2)[IonType.b]
+        double = peptide.fragment_isotopes([IonType.b], 2, charge=2)[IonType.b]
+        proton = FIXED_MASSES['H']
+        for one, two in zip(single.mz, double.mz):
+            self.assertAlmostEqual((one + proton) / 2, two, places=4)
+
+    def test_most_abundant(self):
+        # The monoisotopic peak of a large protein is negligible, so the most
+        # abundant peaks are those around its mean mass
+        peptide = Peptide('AYHGMLPWKDCRGASVTE' * 40, 1, [])
+        peaks = peptide.fragment_isotopes([IonType.precursor], 4)
+        wider = peptide.fragment_isotopes([IonType.precursor], 40)
+        self.assertEqual(sorted(peaks[IonType.precursor].mz),
+                         list(peaks[IonType.precursor].mz))
+        self.assertEqual(
+            sorted(wider[IonType.precursor].abundances, reverse=True)[:4],
+            sorted(peaks[IonType.precursor].abundances, reverse=True)
+        )
+        self.assertGreater(
+            peaks[IonType.precursor].mz[0] - peptide.mass, 10
+        )
+
+    def test_modifications(self):
+        peptide = Peptide('PEPTCIDE', 1, [])
+        modified = Peptide('PEPTCIDE', 1, [ModSite(57.02146, 5, 'cam')])
+        peaks = peptide.fragment_isotopes([IonType.b])[IonType.b]
+        shifted = modified.fragment_isotopes([IonType.b])[IonType.b]
+        self.assertEqual(list(peaks.abundances), list(shifted.abundances))
+        for ii in range(len(peaks)):
+            offset = 57.02146 if ii >= 4 else 0.
+            for (mz, _), (shifted_mz, _) in zip(peaks.envelope(ii), shifted.envelope(ii)):
+                self.assertAlmostEqual(mz + offset, shifted_mz)
+
+    def test_unsupported(self):
+        with self.assertRaises(ValueError):
+            Peptide('PEPTIDE', 1, [], mass_type=MassType.avg).fragment_isotopes()
+        with self.assertRaises(ValueError):
+            Peptide('PEPTIDE', 1, []).fragment_isotopes([IonType.imm])
+        with self.assertRaises(ValueError):
+            Peptide('PEPTIDE', 1, []).fragment_isotopes(n_peaks=0)
+
+
+class TestFragmentCharges(unittest.TestCase):
+    """
+    Tests for the fragmentation of a peptide at several charge states.
+
+    """
+    def test_matches_fragment(self):
+        for seq, mods, radical in [
+                ('AYHGMLPWK', [], False),
+                ('AYHGMLPWKDCR', [ModSite(57.021464, 11, 'Carbamidomethyl')], False),
+                ('CDEK', [ModSite(304.20536, 'nterm', 'iTRAQ8plex')], True),
+                ('K', [], False),
+        ]:
+            for ion_types in [
+                    None, IonPreset.cid, IonPreset.etd, IonPreset.ethcd,
+                    {IonType.precursor: ['H2O'], IonType.imm: [], IonType.y: ['NH3']},
+            ]:
+                peptide = Peptide(seq, 2, mods, radical=radical)
+                ions = peptide.fragment_charges([4, 1, 2, 6], ion_types)
+                self.assertEqual([4, 1, 2, 6], list(ions))
+                for charge, charge_ions in ions.items():
+                    self.assertEqual(
+                        Peptide(seq, charge, mods, radical=radical).fragment(ion_types),
+                        charge_ions
+                    )
+
+    def test_shared_ions(self):
+        ions = Peptide('AYHGMLPWK', 2, []).fragment_charges([1, 2])
+        self.assertTrue(all(ion in ions[2] for ion in ions[1]))
+        self.assertTrue(any(ion is ions[1][0] for ion in ions[2]))
+
+    def test_invalid_charges(self):
+        peptide = Peptide('AYHGMLPWK', 2, [])
+        self.assertEqual({}, peptide.fragment_charges([]))
+
+        with self.assertRaises(ValueError):
+            peptide.fragment_charges([2, 0])
+
+        with self.assertRaises(TypeError):
+            peptide.fragment_charges(3)
+
+
+class TestFragmentPeptides(unittest.TestCase):
+    """
+    Tests for the batch fragmentation of peptides.
+
+    """
+    def setUp(self):
+        # Missed cleavage, ragged end and semi-specific peptides, with
+        # duplicates at differing charge states
+        self.peptides = [
+            Peptide('AYHGMLPWK', 2, []),
+            Peptide('AYHGMLPWKDCR', 3, [ModSite(57.021464, 11, 'Carbamidomethyl')]),
+            Peptide('AYHGMLPWK', 4, []),
+            Peptide('YHGMLPWK', 3, []),
+            Peptide('HGMLPWK', 1, [ModSite(15.994915, 4, 'Oxidation')]),
+            Peptide('AYHGMLPWK', 3, [ModSite(304.20536, 'nterm', 'iTRAQ8plex')]),
+            Peptide('AYHGMLP', 2, [], radical=True),
+            Peptide('AYHGMLPWK', 3, [], radical=True),
+            Peptide('AYHGMLPWK', 3, [], MassType.avg),
+            Peptide('AYHGMIPWK', 3, []),
+            Peptide('K', 2, []),
+        ]
+
+    def test_matches_fragment(self):
+        for ion_types in [
+                None, IonPreset.cid, IonPreset.etd, IonPreset.ethcd,
+                {IonType.b: ['H2O'], IonType.x: [], IonType.imm: []},
+        ]:
+            expected = [p.fragment(ion_types) for p in self.peptides]
+            self.assertEqual(
+                expected, fragment_peptides(self.peptides, ion_types)
+            )
+
+    def test_empty(self):
+        self.assertEqual([], fragment_peptides([]))
+
+    def test_invalid_peptides(self):
+        with self.assertRaises(TypeError):
+            fragment_peptides(['AYHGMLPWK'])
+
+        with self.assertRaises(KeyError):
+            fragment_peptides([Peptide('AYHGM1PWK', 2, [])])
+
+
+class TestMassListInputs(unittest.TestCase):
+    """
+    Tests for the types accepted as mass lists by cpepfrag.generate_ions.
+
+    """
+    def setUp(self):
+        self.peptide = Peptide('AYHGMLPWK', 3, [])
+        self.seq_masses = self.peptide.peptide_mass[1:-1]
+        self.b_masses, self.y_masses = self.peptide._ion_masses()
+
+    def _generate(self, convert):
+        return cpepfrag.generate_ions(
+            _reformat_ion_types({IonType.b: [], IonType.y: []}),
+            self.peptide.mass,
+            convert(self.seq_masses),
+            convert(self.b_masses),
+            convert(self.y_masses),
+            self.peptide.charge,
+            False,
+            self.peptide.seq
+        )
+
+    def test_equivalent_inputs(self):
+        expected = self._generate(list)
+        for convert in [
+                tuple,
+                np.array,
+                lambda m: array.array('d', m),
+                lambda m: memoryview(array.array('d', m)),
+                lambda m: [np.float64(v) for v in m],
+                # Non-contiguous and non-float64 buffers are read as sequences
+                lambda m: np.repeat(np.array(m), 2)[::2],
+                lambda m: np.array(m, dtype=np.longdouble),
+        ]:
+            self.assertEqual(expected, self._generate(convert))
+
+    def test_ints(self):
+        self.b_masses = [int(m) for m in self.b_masses]
+        ions = self._generate(list)
+        self.assertEqual(
+            float(self.b_masses[0]) + FIXED_MASSES['H'],
+            next(i[0] for i in ions if i[1] == 'b1[+]')
+        )
+
+    def test_invalid(self):
+        with self.assertRaisesRegex(RuntimeError, 'expected type: float'):
+            self._generate(lambda m: ['a'] * len(m))
+        with self.assertRaisesRegex(RuntimeError, 'not a sequence'):
+            self._generate(lambda m: 1.)
+
+    def test_unordered(self):
+        for convert in [
+                set,
+                frozenset,
+                lambda m: dict.fromkeys(m),
+                lambda m: (v for v in m),
+                iter,
+        ]:
+            with self.assertRaisesRegex(RuntimeError, 'not a sequence'):
+                self._generate(convert)
+
+
+class TestKeywordArguments(unittest.TestCase):
+    """
+    Tests for the argument parsing of the cpepfrag entry points.
+
+    """
+    def setUp(self):
+        peptide = Peptide('AYHGMLPWK', 3, [])
+        b_masses, y_masses = peptide._ion_masses()
+        self.kwargs = {
+            'ion_types': _reformat_ion_types({IonType.b: [], IonType.y: []}),
+            'precursor_mass': peptide.mass,
+            'seq_masses': peptide.peptide_mass[1:-1],
+            'b_masses': b_masses,
+            'y_masses': y_masses,
+            'charge': peptide.charge,
+            'radical': False,
+            'sequence': peptide.seq,
+        }
+
+    def test_generate_ions_keywords(self):
+        expected = cpepfrag.generate_ions(*self.kwargs.values())
+        self.assertEqual(expected, cpepfrag.generate_ions(**self.kwargs))
+
+        args = list(self.kwargs.values())[:3]
+        kwargs = dict(list(self.kwargs.items())[3:])
+        self.assertEqual(expected, cpepfrag.generate_ions(*args, **kwargs))
+
+    def test_generate_ion_masses_format(self):
+        with self.assertRaises(ValueError):
+            cpepfrag.generate_ion_masses(**self.kwargs, mass_format=3)
+
+    def test_generate_ion_masses_keywords(self):
+        self.assertEqual(
+            cpepfrag.generate_ion_masses(*self.kwargs.values(), MassFormat.float64.value),
+            cpepfrag.generate_ion_masses(**self.kwargs, mass_format=MassFormat.float64.value)
+        )
+
+    def test_calculate_mass_keywords(self):
+        self.assertEqual(
+            cpepfrag.calculate_mass('ACK', [], 0),
+            cpepfrag.calculate_mass(mass_type=0, mod_sites=[], sequence='ACK')
+        )
+
+    def test_missing_argument(self):
+        del self.kwargs['charge']
+        with self.assertRaisesRegex(TypeError, "missing required argument 'charge'"):
+            cpepfrag.generate_ions(**self.kwargs)
+
+    def test_unexpected_argument(self):
+        with self.assertRaisesRegex(TypeError, "unexpected keyword argument 'mass_type'"):
+            cpepfrag.generate_ions(**self.kwargs, mass_type=0)
+
+    def test_duplicate_argument(self):
+        with self.assertRaisesRegex(TypeError, "multiple values for argument 'sequence'"):
+            cpepfrag.calculate_mass('ACK', [], 0, sequence='ACK')
+
+    def test_too_many_arguments(self):
+        with self.assertRaisesRegex(TypeError, 'at most 3 arguments'):
+            cpepfrag.calculate_mass('ACK', [], 0, 1)
+
+    def test_invalid_types(self):
+        self.kwargs['precursor_mass'] = 'heavy'
+        with self.assertRaises(TypeError):
+            cpepfrag.generate_ions(**self.kwargs)
+
+        with self.assertRaises(TypeError):
+            cpepfrag.calculate_mass(1, [], 0)
+
+
+class TestIonPresets(unittest.TestCase):
+    """
+    Tests for fragmentation using registered ion type configurations.
+
+    """
+    def setUp(self):
+        self.peptide = Peptide(
+            'AYHGMLPWK', 3, [ModSite(15.994915, 5, 'Oxidation')], radical=True
+        )
+
+    def test_default(self):
+        self.assertEqual(
+            self.peptide.fragment(
+                {t: list(l) for t, l in DEFAULT_IONS.items()}),
+            self.peptide.fragment(IonPreset.default)
+        )
+
+    def test_presets(self):
+        for preset, ion_types in [
+            (IonPreset.cid, {IonType.b: [], IonType.y: []}),
+            (IonPreset.etd, {IonType.c: [], IonType.z: []}),
+            (IonPreset.ethcd, {IonType.b: [], IonType.y: [], IonType.c: [],
+                               IonType.z: []}),
+        ]:
+            self.assertEqual(
+                self.peptide.fragment(ion_types),
+                self.peptide.fragment(preset)
+            )
+
+    def test_registered_custom(self):
+        ion_types = {
+            IonType.y: ['H2O', ('testLoss', 9.)],
+            IonType.imm: [],
+            IonType.a: ['CO'],
+        }
+        handle = register_ion_types(ion_types)
+        self.assertEqual(['H2O', ('testLoss', 9.)], ion_types[IonType.y])
+        self.assertEqual(
+            self.peptide.fragment(ion_types),
+            self.peptide.fragment(handle)
+        )
+
+    def test_unknown_handle(self):
+        with self.assertRaisesRegex(RuntimeError, r'Unknown ion type'):
+            self.peptide.fragment(100000)
+
+    def test_modified_default(self):
+        original = {t: list(l) for t, l in DEFAULT_IONS.items()}
+        try:
+            DEFAULT_IONS[IonType.y].append('CO')
+            del DEFAULT_IONS[IonType.x]
+            ion_types = {t: list(l) for t, l in DEFAULT_IONS.items()}
+            self.assertEqual(
+                self.peptide.fragment(ion_types), self.peptide.fragment()
+            )
+            self.assertEqual(
+                self.peptide.fragment(ion_types),
+                self.peptide.fragment(IonPreset.default)
+            )
+        finally:
+            DEFAULT_IONS.clear()
+            DEFAULT_IONS.update(original)
+        self.assertEqual(
+            self.peptide.fragment(original), self.peptide.fragment()
+        )
+
+
+class TestKernelIsas(unittest.TestCase):
+    """
+    Tests that each fragment mass kernel supported by the CPU computes the
+    same masses as the scalar kernel.
+
+    """
+    def setUp(self):
+        self.default = cpepfrag.set_kernel_isa('scalar')
+
+    def tearDown(self):
+        cpepfrag.set_kernel_isa(self.default)
+
+    def generate(self, ladder: List[float]) -> bytes:
+        ion_types = _reformat_ion_types({
+            IonType.b: ['H2O', 'NH3', 'CO2'], IonType.y: ['H2O']
+        })
+        masses, _ = cpepfrag.generate_ion_masses(
+            ion_types, 1000., ladder, ladder, ladder[::-1], 5, False,
+            'A' * len(ladder), MassFormat.float64.value
+        )
+        return masses
+
+    def test_kernels_match_scalar(self):
+        self.assertIn('scalar', cpepfrag.kernel_isas())
+        rng = np.random.default_rng(7)
+        # Lengths up to and past several vector widths, with every tail
+        ladders = [list(rng.uniform(50., 3000., length)) for length in range(1, 35)]
+        expected = [self.generate(ladder) for ladder in ladders]
+        for isa in cpepfrag.kernel_isas():
+            with self.subTest(isa=isa):
+                cpepfrag.set_kernel_isa(isa)
+                for ladder, masses in zip(ladders, expected):
+                    self.assertEqual(masses, self.generate(ladder), len(ladder))
+
+    def test_unsupported_isa(self):
+        with self.assertRaises(ValueError):
+            cpepfrag.set_kernel_isa('neon')
+
+
+class TestWorkspace(unittest.TestCase):
+    """
+    Tests for the reuse of ion generation workspaces.
+
+    """
+    def test_steady_state_no_allocations(self):
+        peptides = [
+            Peptide('AYHGMLPWK', 3, [ModSite(15.994915, 5, 'Oxidation')]),
+            Peptide('ATSMPLK', 2, []),
+        ]
+        for peptide in peptides:
+            peptide.fragment()
+            peptide.fragment_masses()
+
+        cpepfrag.reset_workspace_stats()
+        for _ in range(10):
+            for peptide in peptides:
+                peptide.fragment()
+                peptide.fragment_masses()
+
+        stats = cpepfrag.workspace_stats()
+        self.assertEqual(40, stats['acquisitions'])
+        self.assertEqual(0, stats['fallbacks'])
+        self.assertEqual(0, stats['allocations'])
+        self.assertEqual(0, stats['bytes_allocated'])
+
+
+class TestStats(unittest.TestCase):
+    """
+    Tests for the runtime instrumentation counters.
+
+    """
+    def setUp(self):
+        self.peptide = Peptide('AYHGMLPWK', 3, [])
+        # Populate the workspace, so that the counted calls allocate nothing
+        self.peptide.fragment(IonPreset.cid)
+        cpepfrag.reset_stats()
+
+    def test_reset(self):
+        stats = cpepfrag.stats()
+        self.assertEqual(0, stats['workspace']['acquisitions'])
+        if stats['enabled']:
+            self.assertEqual(0, stats['peptides'])
+            self.assertEqual(0, sum(stats['ions'].values()))
+            self.assertEqual(0, sum(stats['time_ns'].values()))
+
+    def test_fragment(self):
+        ions = self.peptide.fragment(IonPreset.cid)
+        self.peptide.fragment_masses(IonPreset.cid)
+
+        stats = cpepfrag.stats()
+        self.assertEqual(2, stats['workspace']['acquisitions'])
+        if not stats['enabled']:
+            self.assertEqual({'enabled', 'workspace'}, set(stats))
+            return
+
+        self.assertEqual(1, stats['calls']['generate_ions'])
+        self.assertEqual(1, stats['calls']['generate_ion_masses'])
+        self.assertEqual(2, stats['peptides'])
+        self.assertEqual(2 * len(ions), sum(stats['ions'].values()))
+        self.assertEqual(
+            2 * len([i for i in ions if i[1].startswith('b')]),
+            stats['ions'][IonType.b.value]
+        )
+        self.assertEqual(0, stats['ions'][IonType.a.value])
+        self.assertEqual(2, stats['ion_configs']['registered'])
+        self.assertGreater(stats['time_ns']['generation'], 0)
+
+    def test_ion_types(self):
+        peptide = Peptide('GLKEPEPTIDEKPRL', 3, [])
+        for ion_type in (IonType.internal, IonType.d, IonType.v, IonType.w):
+            with self.subTest(ion_type=ion_type):
+                cpepfrag.reset_stats()
+                ions = peptide.fragment({ion_type: []})
+                self.assertGreater(len(ions), 0)
+
+                stats = cpepfrag.stats()
+                if not stats['enabled']:
+                    continue
+                self.assertEqual(
+                    {t.value for t in IonType}, set(stats['ions'])
+                )
+                self.assertEqual(len(ions), stats['ions'][ion_type.value])
+                self.assertEqual(len(ions), sum(stats['ions'].values()))
+
+
+class TestTracing(unittest.TestCase):
+    """
+    Tests for the export of trace spans.
+
+    """
+    def tearDown(self):
+        cpepfrag.stop_tracing()
+
+    def _spans(self) -> List[dict]:
+        trace = json.loads(cpepfrag.trace_json())
+        return [e for e in trace['traceEvents'] if e['ph'] == 'X']
+
+    def test_fragment_spans(self):
+        peptide = Peptide('AYHGMLPWK', 3, [])
+        cpepfrag.start_tracing()
+        peptide.fragment(IonPreset.cid)
+        cpepfrag.stop_tracing()
+        peptide.fragment(IonPreset.cid)
+
+        names = [span['name'] for span in self._spans()]
+        self.assertEqual(1, names.count('generate_ions'))
+        self.assertEqual(1, names.count('generate b'))
+        self.assertEqual(1, names.count('generate y'))
+        self.assertNotIn('generate a', names)
+
+    def test_ring_buffer(self):
+        peptide = Peptide('AYHGMLPWK', 3, [])
+        cpepfrag.start_tracing(buffer_size=5)
+        for _ in range(10):
+            peptide.fragment(IonPreset.cid)
+
+        spans = self._spans()
+        self.assertEqual(5, len(spans))
+        # The most recent spans are retained, the last being the outermost
+        self.assertEqual('generate_ions', spans[-1]['name'])
+
+    def test_restart_discards(self):
+        cpepfrag.start_tracing()
+        Peptide('AYHGMLPWK', 3, []).fragment(IonPreset.cid)
+        cpepfrag.start_tracing()
+        self.assertEqual([], self._spans())
+
+    def test_exited_threads(self):
+        peptide = Peptide('AYHGMLPWK', 3, [])
+        cpepfrag.start_tracing()
+        with ThreadPoolExecutor(4) as pool:
+            list(pool.map(lambda _: peptide.fragment(IonPreset.cid), range(8)))
+
+        # The spans of the exited threads are kept for export
+        self.assertEqual(
+            8, [span['name'] for span in self._spans()].count('generate_ions')
+        )
+
+
+class _ModSite(ctypes.Structure):
+    _fields_ = [('site', ctypes.c_long), ('mass', ctypes.c_double)]
+
+
+class _Peptide(ctypes.Structure):
+    _fields_ = [
+        ('sequence', ctypes.c_char_p),
+        ('mods', ctypes.POINTER(_ModSite)),
+        ('n_mods', ctypes.c_size_t),
+        ('charge', ctypes.c_long),
+        ('radical', ctypes.c_int),
+        ('mass_type', ctypes.c_int),
+    ]
+
+
+class _CAPI(ctypes.Structure):
+    _fields_ = [
+        ('version', ctypes.c_uint),
+        ('last_error', ctypes.CFUNCTYPE(ctypes.c_char_p)),
+        ('calculate_mass', ctypes.CFUNCTYPE(
+            ctypes.c_int, ctypes.POINTER(_Peptide),
+            ctypes.POINTER(ctypes.c_double), ctypes.c_size_t)),
+        ('register_ion_types', ctypes.c_void_p),
+        ('generate_ions', ctypes.CFUNCTYPE(
+            ctypes.c_int, ctypes.POINTER(_Peptide), ctypes.c_long,
+            ctypes.POINTER(ctypes.c_double), ctypes.POINTER(ctypes.c_int32),
+            ctypes.c_size_t, ctypes.POINTER(ctypes.c_size_t))),
+        ('annotate_peaks', ctypes.CFUNCTYPE(
+            ctypes.c_int, ctypes.POINTER(_Peptide), ctypes.c_long,
+            ctypes.POINTER(ctypes.c_double), ctypes.c_size_t, ctypes.c_double,
+            ctypes.c_char_p, ctypes.c_size_t,
+            ctypes.POINTER(ctypes.c_size_t))),
+    ]
+
+
+class TestCAPI(unittest.TestCase):
+    """
+    Tests for the C API exported by the extension, called via ctypes.
+
+    """
+    @classmethod
+    def setUpClass(cls):
+        get_pointer = ctypes.pythonapi.PyCapsule_GetPointer
+        get_pointer.restype = ctypes.c_void_p
+        get_pointer.argtypes = [ctypes.py_object, ctypes.c_char_p]
+        address = get_pointer(cpepfrag._C_API, b'cpepfrag._C_API')
+        cls.api = _CAPI.from_address(address)
+
+    def setUp(self):
+        self.peptide = Peptide(
+            'AYHGMLPWK', 3, [ModSite(15.994915, 5, 'Oxidation')]
+        )
+        self.mods = (_ModSite * 1)(_ModSite(5, 15.994915))
+        self.c_peptide = _Peptide(b'AYHGMLPWK', self.mods, 1, 3, 0, 0)
+        self.handle = cpepfrag.register_ion_types(
+            {IonType.b.value: [], IonType.y.value: [('H2O', 18.01056468403)]}
+        )
+
+    def test_version(self):
+        self.assertGreaterEqual(self.api.version, 1)
+
+    def test_calculate_mass(self):
+        masses = (ctypes.c_double * 11)()
+        self.assertEqual(0, self.api.calculate_mass(self.c_peptide, masses, 11))
+        self.assertEqual(self.peptide.peptide_mass, list(masses))
+
+    def test_generate_ions(self):
+        n_ions = ctypes.c_size_t()
+        self.assertEqual(2, self.api.generate_ions(
+            self.c_peptide, self.handle, None, None, 0, ctypes.byref(n_ions)
+        ))
+
+        mz = (ctypes.c_double * n_ions.value)()
+        positions = (ctypes.c_int32 * n_ions.value)()
+        self.assertEqual(0, self.api.generate_ions(
+            self.c_peptide, self.handle, mz, positions, n_ions.value,
+            ctypes.byref(n_ions)
+        ))
+
+        expected = self.peptide.fragment(
+            {IonType.b: [], IonType.y: ['H2O']}
+        )
+        self.assertEqual([i[0] for i in expected], list(mz))
+        self.assertEqual([i[2] for i in expected], list(positions))
+
+    def test_annotate_peaks(self):
+        expected = self.peptide.fragment({IonType.b: [], IonType.y: ['H2O']})
+        peaks = (ctypes.c_double * 3)(
+            expected[0][0] + 0.01, 1.0, expected[5][0] - 0.01
+        )
+        labels = ctypes.create_string_buffer(3 * 16)
+        n_matched = ctypes.c_size_t()
+        self.assertEqual(0, self.api.annotate_peaks(
+            self.c_peptide, self.handle, peaks, 3, 0.02, labels, 16,
+            ctypes.byref(n_matched)
+        ))
+        self.assertEqual(2, n_matched.value)
+        self.assertEqual(
+            [expected[0][1], '', expected[5][1]],
+            [labels.raw[ii * 16:(ii + 1) * 16].split(b'\0')[0].decode()
+             for ii in range(3)]
+        )
+
+    def annotate(self, sequence: str, charge: int) -> List[str]:
+        """
+        Annotates the m/z of every b and y ion of the peptide via the C API,
+        returning the labels.
+
+        """
+        expected = Peptide(sequence, charge, []).fragment(
+            {IonType.b: [], IonType.y: ['H2O']}
+        )
+        peaks = (ctypes.c_double * len(expected))(*[i[0] for i in expected])
+        labels = ctypes.create_string_buffer(len(expected) * 32)
+        n_matched = ctypes.c_size_t()
+        c_peptide = _Peptide(sequence.encode(), None, 0, charge, 0, 0)
+        self.assertEqual(0, self.api.annotate_peaks(
+            c_peptide, self.handle, peaks, len(expected), 1e-6, labels, 32,
+            ctypes.byref(n_matched)
+        ))
+        return [labels.raw[ii * 32:(ii + 1) * 32].split(b'\0')[0].decode()
+                for ii in range(len(expected))]
+
+    def test_threads(self):
+        # ctypes releases the GIL, so the labels are built concurrently
+        sequences = ['AYHGMLPWKDCR' * n for n in range(1, 9)]
+        expected = [self.annotate(seq, 6) for seq in sequences]
+        with ThreadPoolExecutor(max_workers=8) as executor:
+            for _ in range(10):
+                results = list(executor.map(
+                    lambda seq: self.annotate(seq, 6), sequences
+                ))
+                self.assertEqual(expected, results)
+
+    def test_thread_errors(self):
+        # Each thread sees only its own errors
+        def calculate(residue: str) -> bytes:
+            c_peptide = _Peptide(f'AY{residue}GK'.encode(), None, 0, 2, 0, 0)
+            masses = (ctypes.c_double * 11)()
+            for _ in range(200):
+                self.assertEqual(1, self.api.calculate_mass(c_peptide, masses, 11))
+                self.assertEqual(0, self.api.calculate_mass(self.c_peptide, masses, 11))
+            return self.api.last_error()
+
+        residues = ['B', 'J', 'O', 'U', 'X', 'Z']
+        with ThreadPoolExecutor(max_workers=len(residues)) as executor:
+            errors = list(executor.map(calculate, residues))
+        for residue, error in zip(residues, errors):
+            self.assertIn(residue.encode(), error)
+
+    def test_invalid_residue(self):
+        c_peptide = _Peptide(b'AYXGK', None, 0, 2, 0, 0)
+        masses = (ctypes.c_double * 7)()
+        self.assertEqual(1, self.api.calculate_mass(c_peptide, masses, 7))
+        self.assertIn(b'X', self.api.last_error())
+
+
 class TestPeptides(unittest.TestCase):
     def test_peptides_equal(self):
         peptide = Peptide(
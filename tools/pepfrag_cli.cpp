@@ -0,0 +1,768 @@
+/*
+ * pepfrag-cli: bulk peptide fragmentation from the command line.
+ *
+ * Reads peptides as delimited text, one per line:
+ *
+ *     sequence<delimiter>charge[<delimiter>modifications]
+ *
+ * where modifications are separated by ';', each given as mass@site, with site
+ * a 1-based residue position, "nterm" or "cterm", e.g.
+ *
+ *     ACMDK	2	57.021464@2;15.994915@3;304.20536@nterm
+ *
+ * A first line whose charge is not an integer is treated as a header.
+ *
+ * Peptides are read, fragmented by a pool of worker threads and written, in
+ * input order, as either:
+ *
+ *   - tsv: one line per ion, with columns peptide, sequence, charge, mass,
+ *     label and position.
+ *   - binary: the bytes "PFRG", a uint32 format version (1), then for each
+ *     peptide a uint64 peptide index, a uint32 ion count n, n float64 masses
+ *     and n int32 positions, all in native byte order. Labels are not
+ *     generated.
+ *
+ * Run with --help for the available options.
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "fragment.h"
+
+const uint32_t BINARY_FORMAT_VERSION = 1;
+
+enum class OutputFormat { tsv, binary };
+
+struct Options {
+	std::string input = "-";
+	std::string output = "-";
+	char delimiter = 0;
+	OutputFormat format = OutputFormat::tsv;
+	std::string ionTypes = "default";
+	bool radical = false;
+	long massType = 0;
+	bool residueLosses = false;
+	size_t maxLosses = 1;
+	double minMz = -std::numeric_limits<double>::infinity();
+	double maxMz = std::numeric_limits<double>::infinity();
+	size_t maxIons = 0;
+	bool basicChargeLimit = false;
+	size_t minInternalLength = 2;
+	size_t maxInternalLength = 0;
+	bool labels = true;
+	int precision = 6;
+	size_t threads = std::max(1u, std::thread::hardware_concurrency());
+	size_t batchSize = 1024;
+	bool skipInvalid = false;
+	bool quiet = false;
+};
+
+void printUsage() {
+	std::fprintf(stderr,
+		"Usage: pepfrag-cli [options] [input]\n"
+		"\n"
+		"Fragments the peptides in input (default: stdin), one per line as\n"
+		"sequence, charge and optional modifications (mass@site;...).\n"
+		"\n"
+		"Options:\n"
+		"  -o, --output FILE     Output file (default: stdout)\n"
+		"  -f, --format FORMAT   tsv or binary (default: tsv)\n"
+		"  -d, --delimiter D     tab or comma (default: comma for .csv input, else tab)\n"
+		"  -i, --ions IONS       default, cid, etd, ethcd, or a specification such as\n"
+		"                        'precursor:H2O;b:H2O,NH3;y;int' where losses are the names\n"
+		"                        of fixed masses or label=mass (default: default)\n"
+		"  -t, --threads N       Worker threads (default: hardware concurrency)\n"
+		"  --batch-size N        Peptides per work item (default: 1024)\n"
+		"  --radical             Generate radical ions\n"
+		"  --average             Use average rather than monoisotopic masses\n"
+		"  --residue-losses      Apply H2O, NH3 and H3PO4 losses only to fragments\n"
+		"                        with S/T/E/D, R/K/N/Q or a phosphosite respectively\n"
+		"  --max-losses N        Combine up to N neutral losses per fragment (default: 1)\n"
+		"  --min-mz MZ           Skip ions below this m/z\n"
+		"  --max-mz MZ           Skip ions above this m/z\n"
+		"  --max-ions N          Generate at most N ions of each ion type, lowest\n"
+		"                        charge states first\n"
+		"  --basic-charge-limit  Charge fragments only up to their number of basic\n"
+		"                        sites (K, R, H and their N-terminal amine)\n"
+		"  --min-internal-length N\n"
+		"                        Minimum residues of internal (int) fragments (default: 2)\n"
+		"  --max-internal-length N\n"
+		"                        Maximum residues of internal fragments\n"
+		"  --no-labels           Leave the label column empty\n"
+		"  --precision N         Decimal places of TSV masses (default: 6)\n"
+		"  --skip-invalid        Skip, rather than fail on, invalid peptides\n"
+		"  -q, --quiet           Do not report progress and throughput\n"
+		"  -h, --help            Show this message\n");
+}
+
+/* Argument parsing */
+
+size_t parseSize(const std::string& value, const std::string& name) {
+	try {
+		size_t pos;
+		long long parsed = std::stoll(value, &pos);
+		if (pos == value.size() && parsed > 0) {
+			return (size_t) parsed;
+		}
+	}
+	catch (const std::exception&) {}
+	throw std::invalid_argument(name + " must be a positive integer: " + value);
+}
+
+double parseMz(const std::string& value, const std::string& name) {
+	try {
+		size_t pos;
+		double parsed = std::stod(value, &pos);
+		if (pos == value.size() && parsed >= 0.) {
+			return parsed;
+		}
+	}
+	catch (const std::exception&) {}
+	throw std::invalid_argument(name + " must be a non-negative number: " + value);
+}
+
+bool parsePositive(const std::string& field, long& value) {
+	try {
+		size_t pos;
+		value = std::stol(field, &pos);
+		return pos == field.size() && value > 0;
+	}
+	catch (const std::exception&) {
+		return false;
+	}
+}
+
+Options parseArguments(int argc, char** argv) {
+	Options options;
+	bool delimiterSet = false;
+
+	for (int ii = 1; ii < argc; ii++) {
+		std::string arg = argv[ii];
+		auto value = [&]() -> std::string {
+			if (ii + 1 >= argc) {
+				throw std::invalid_argument("Missing value for " + arg);
+			}
+			return argv[++ii];
+		};
+
+		if (arg == "-h" || arg == "--help") {
+			printUsage();
+			std::exit(0);
+		}
+		else if (arg == "-o" || arg == "--output") {
+			options.output = value();
+		}
+		else if (arg == "-f" || arg == "--format") {
+			std::string format = value();
+			if (format == "tsv") {
+				options.format = OutputFormat::tsv;
+			}
+			else if (format == "binary") {
+				options.format = OutputFormat::binary;
+			}
+			else {
+				throw std::invalid_argument("Unknown output format: " + format);
+			}
+		}
+		else if (arg == "-d" || arg == "--delimiter") {
+			std::string delimiter = value();
+			if (delimiter == "tab" || delimiter == "\t") {
+				options.delimiter = '\t';
+			}
+			else if (delimiter == "comma" || delimiter == ",") {
+				options.delimiter = ',';
+			}
+			else {
+				throw std::invalid_argument("Unknown delimiter: " + delimiter);
+			}
+			delimiterSet = true;
+		}
+		else if (arg == "-i" || arg == "--ions") {
+			options.ionTypes = value();
+		}
+		else if (arg == "-t" || arg == "--threads") {
+			options.threads = parseSize(value(), arg);
+		}
+		else if (arg == "--batch-size") {
+			options.batchSize = parseSize(value(), arg);
+		}
+		else if (arg == "--radical") {
+			options.radical = true;
+		}
+		else if (arg == "--average") {
+			options.massType = 1;
+		}
+		else if (arg == "--residue-losses") {
+			options.residueLosses = true;
+		}
+		else if (arg == "--max-losses") {
+			options.maxLosses = parseSize(value(), arg);
+		}
+		else if (arg == "--min-mz") {
+			options.minMz = parseMz(value(), arg);
+		}
+		else if (arg == "--max-mz") {
+			options.maxMz = parseMz(value(), arg);
+		}
+		else if (arg == "--max-ions") {
+			options.maxIons = parseSize(value(), arg);
+		}
+		else if (arg == "--basic-charge-limit") {
+			options.basicChargeLimit = true;
+		}
+		else if (arg == "--min-internal-length") {
+			options.minInternalLength = parseSize(value(), arg);
+		}
+		else if (arg == "--max-internal-length") {
+			options.maxInternalLength = parseSize(value(), arg);
+		}
+		else if (arg == "--no-labels") {
+			options.labels = false;
+		}
+		else if (arg == "--precision") {
+			long precision;
+			std::string precisionArg = value();
+			if (precisionArg != "0" && !parsePositive(precisionArg, precision)) {
+				throw std::invalid_argument(arg + " must be a non-negative integer: " + precisionArg);
+			}
+			options.precision = precisionArg == "0" ? 0 : (int) std::min(precision, 17L);
+		}
+		else if (arg == "--skip-invalid") {
+			options.skipInvalid = true;
+		}
+		else if (arg == "-q" || arg == "--quiet") {
+			options.quiet = true;
+		}
+		else if (arg.size() > 1 && arg[0] == '-') {
+			throw std::invalid_argument("Unknown option: " + arg);
+		}
+		else {
+			options.input = arg;
+		}
+	}
+
+	if (!delimiterSet) {
+		const std::string csv = ".csv";
+		bool isCsv = options.input.size() >= csv.size()
+			&& options.input.compare(options.input.size() - csv.size(), csv.size(), csv) == 0;
+		options.delimiter = isCsv ? ',' : '\t';
+	}
+	if (options.format == OutputFormat::binary) {
+		options.labels = false;
+	}
+
+	return options;
+}
+
+std::vector<std::string> split(const std::string& str, char delimiter) {
+	std::vector<std::string> parts;
+	size_t start = 0;
+	while (true) {
+		size_t end = str.find(delimiter, start);
+		parts.push_back(str.substr(start, end - start));
+		if (end == std::string::npos) {
+			return parts;
+		}
+		start = end + 1;
+	}
+}
+
+IonType parseIonType(const std::string& name) {
+	const std::vector<std::pair<std::string, IonType>> names{
+		{"precursor", IonType::precursor}, {"imm", IonType::immonium},
+		{"b", IonType::b}, {"y", IonType::y}, {"a", IonType::a},
+		{"c", IonType::c}, {"z", IonType::z}, {"x", IonType::x},
+		{"int", IonType::internal}, {"d", IonType::d}, {"v", IonType::v},
+		{"w", IonType::w}
+	};
+	for (const auto& pair : names) {
+		if (pair.first == name) {
+			return pair.second;
+		}
+	}
+	throw std::invalid_argument("Unknown ion type: " + name);
+}
+
+/*
+ * Returns the ion types for a preset name, matching the presets of the
+ * Python package, or parsed from a specification.
+ */
+IonTypeMap parseIonTypes(const std::string& spec) {
+	auto loss = [](const char* name) { return NeutralLossPair(name, FIXED_MASSES.at(name)); };
+
+	if (spec == "default") {
+		return {
+			{IonType::precursor, {loss("H2O"), loss("NH3"), loss("CO2")}},
+			{IonType::immonium, {}},
+			{IonType::b, {loss("H2O"), loss("NH3"), loss("CO")}},
+			{IonType::y, {loss("NH3"), loss("H2O")}},
+			{IonType::a, {}},
+			{IonType::c, {}},
+			{IonType::z, {}},
+			{IonType::x, {}}
+		};
+	}
+	if (spec == "cid") {
+		return {{IonType::b, {}}, {IonType::y, {}}};
+	}
+	if (spec == "etd") {
+		return {{IonType::c, {}}, {IonType::z, {}}};
+	}
+	if (spec == "ethcd") {
+		return {{IonType::b, {}}, {IonType::y, {}}, {IonType::c, {}}, {IonType::z, {}}};
+	}
+
+	IonTypeMap ionTypes;
+	for (const std::string& entry : split(spec, ';')) {
+		if (entry.empty()) continue;
+		size_t colon = entry.find(':');
+		std::vector<NeutralLossPair> losses;
+		if (colon != std::string::npos) {
+			for (const std::string& name : split(entry.substr(colon + 1), ',')) {
+				if (name.empty()) continue;
+				size_t equals = name.find('=');
+				if (equals != std::string::npos) {
+					losses.emplace_back(name.substr(0, equals), std::stod(name.substr(equals + 1)));
+				}
+				else if (FIXED_MASSES.count(name)) {
+					losses.push_back(loss(name.c_str()));
+				}
+				else {
+					throw std::invalid_argument("Unknown neutral loss: " + name);
+				}
+			}
+		}
+		ionTypes.emplace_back(parseIonType(entry.substr(0, colon)), losses);
+	}
+	if (ionTypes.empty()) {
+		throw std::invalid_argument("No ion types specified");
+	}
+	return ionTypes;
+}
+
+/* Input */
+
+struct PeptideRecord {
+	std::string sequence;
+	long charge;
+	std::map<long, double> modSiteMasses;
+};
+
+
+PeptideRecord parsePeptide(const std::string& line, char delimiter) {
+	std::vector<std::string> fields = split(line, delimiter);
+	if (fields.size() < 2 || fields.size() > 3) {
+		throw std::invalid_argument("Expected 2 or 3 fields, found " + std::to_string(fields.size()));
+	}
+
+	PeptideRecord peptide;
+	peptide.sequence = fields[0];
+	if (!parsePositive(fields[1], peptide.charge)) {
+		throw std::invalid_argument("Invalid charge: " + fields[1]);
+	}
+
+	if (fields.size() == 3) {
+		for (const std::string& mod : split(fields[2], ';')) {
+			if (mod.empty()) continue;
+			size_t at = mod.find('@');
+			if (at == std::string::npos) {
+				throw std::invalid_argument("Invalid modification: " + mod);
+			}
+			std::string site = mod.substr(at + 1);
+			long siteIndex;
+			if (site == "nterm" || site == "N-term") {
+				siteIndex = 0;
+			}
+			else if (site == "cterm" || site == "C-term") {
+				siteIndex = (long) peptide.sequence.size() + 1;
+			}
+			else if (!parsePositive(site, siteIndex)) {
+				throw std::invalid_argument("Invalid modification site: " + site);
+			}
+			// As for the Python API, only the first modification at a site applies
+			peptide.modSiteMasses.emplace(siteIndex, std::stod(mod.substr(0, at)));
+		}
+	}
+
+	return peptide;
+}
+
+/* Pipeline */
+
+struct Batch {
+	size_t index;
+	// The input line number of the first line
+	size_t firstLine;
+	// The peptide index of the first line
+	size_t firstPeptide;
+	std::vector<std::string> lines;
+
+	std::string output;
+	size_t nPeptides = 0;
+	size_t nIons = 0;
+	size_t nSkipped = 0;
+	std::string error;
+};
+
+using BatchPtr = std::unique_ptr<Batch>;
+
+template<class T>
+class BlockingQueue {
+	public:
+		explicit BlockingQueue(size_t capacity) : capacity(capacity) {}
+
+		// Returns false if the queue was closed
+		bool push(T item) {
+			std::unique_lock<std::mutex> lock(mutex);
+			notFull.wait(lock, [this]() { return items.size() < capacity || closed; });
+			if (closed) return false;
+			items.push_back(std::move(item));
+			notEmpty.notify_one();
+			return true;
+		}
+
+		// Returns false once the queue is closed and empty
+		bool pop(T& item) {
+			std::unique_lock<std::mutex> lock(mutex);
+			notEmpty.wait(lock, [this]() { return !items.empty() || closed; });
+			if (items.empty()) return false;
+			item = std::move(items.front());
+			items.pop_front();
+			notFull.notify_one();
+			return true;
+		}
+
+		void close() {
+			std::lock_guard<std::mutex> lock(mutex);
+			closed = true;
+			notEmpty.notify_all();
+			notFull.notify_all();
+		}
+
+	private:
+		std::mutex mutex;
+		std::condition_variable notEmpty, notFull;
+		std::deque<T> items;
+		size_t capacity;
+		bool closed = false;
+};
+
+template<class T>
+void appendBinary(std::string& output, const T& value) {
+	output.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+const double POWERS_OF_TEN[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17
+};
+
+/*
+ * Appends value with the given number of decimal places, as printf's %.*f
+ * would, but without its cost in the common case.
+ */
+void appendFixed(std::string& output, double value, int precision) {
+	double scaled = std::fabs(value) * POWERS_OF_TEN[precision];
+	double integral = std::floor(scaled);
+	double fraction = scaled - integral;
+	// Fall back to printf where the rounding could be affected by the error
+	// in scaled, or where scaled cannot be held exactly in an integer
+	if (scaled >= 1e15 || std::fabs(fraction - 0.5) < 1e-3) {
+		char number[64];
+		std::snprintf(number, sizeof(number), "%.*f", precision, value);
+		output += number;
+		return;
+	}
+
+	unsigned long long digits = (unsigned long long) integral + (fraction > 0.5 ? 1 : 0);
+	char buffer[32];
+	char* end = buffer + sizeof(buffer);
+	char* start = end;
+	for (int ii = 0; ii < precision; ii++) {
+		*--start = (char) ('0' + digits % 10);
+		digits /= 10;
+	}
+	if (precision > 0) {
+		*--start = '.';
+	}
+	do {
+		*--start = (char) ('0' + digits % 10);
+		digits /= 10;
+	} while (digits > 0);
+	if (std::signbit(value)) {
+		*--start = '-';
+	}
+	output.append(start, end);
+}
+
+void writeIons(
+	const Options& options,
+	size_t peptideIndex,
+	const PeptideRecord& peptide,
+	const Ions& ions,
+	std::string& output)
+{
+	if (options.format == OutputFormat::binary) {
+		appendBinary<uint64_t>(output, peptideIndex);
+		appendBinary<uint32_t>(output, (uint32_t) ions.size());
+		for (const Ion& ion : ions) {
+			appendBinary<double>(output, ion.mass);
+		}
+		for (const Ion& ion : ions) {
+			appendBinary<int32_t>(output, (int32_t) ion.position);
+		}
+		return;
+	}
+
+	for (const Ion& ion : ions) {
+		output += std::to_string(peptideIndex);
+		output += '\t';
+		output += peptide.sequence;
+		output += '\t';
+		output += std::to_string(peptide.charge);
+		output += '\t';
+		appendFixed(output, ion.mass, options.precision);
+		output += '\t';
+		output += ion.label;
+		output += '\t';
+		output += std::to_string(ion.position);
+		output += '\n';
+	}
+}
+
+/*
+ * The ion generation options selected by the command line options.
+ */
+IonGenerationOptions generationOptions(const Options& options) {
+	IonGenerationOptions generation;
+	generation.labels = options.labels;
+	generation.residueLosses = options.residueLosses;
+	generation.maxLosses = options.maxLosses;
+	generation.minMz = options.minMz;
+	generation.maxMz = options.maxMz;
+	generation.maxIons = options.maxIons;
+	generation.basicChargeLimit = options.basicChargeLimit;
+	generation.minInternalLength = options.minInternalLength;
+	generation.maxInternalLength = options.maxInternalLength;
+	return generation;
+}
+
+void processBatch(
+	const Options& options,
+	const IonConfig& config,
+	const IonGenerationOptions& generation,
+	Workspace& workspace,
+	Batch& batch)
+{
+	for (size_t ii = 0; ii < batch.lines.size(); ii++) {
+		const std::string& line = batch.lines[ii];
+		try {
+			PeptideRecord peptide = parsePeptide(line, options.delimiter);
+			fragmentPeptide(
+				peptide.sequence, peptide.modSiteMasses, peptide.charge, config, options.radical,
+				options.massType, generation, workspace);
+			writeIons(options, batch.firstPeptide + ii, peptide, workspace.ions, batch.output);
+			batch.nPeptides++;
+			batch.nIons += workspace.ions.size();
+		}
+		catch (const std::exception& ex) {
+			if (!options.skipInvalid) {
+				batch.error = "line " + std::to_string(batch.firstLine + ii) + ": " + ex.what();
+				return;
+			}
+			batch.nSkipped++;
+		}
+	}
+}
+
+class Progress {
+	public:
+		explicit Progress(bool enabled)
+			: enabled(enabled), start(std::chrono::steady_clock::now()), lastReport(start) {}
+
+		void update(const Batch& batch) {
+			nPeptides += batch.nPeptides;
+			nIons += batch.nIons;
+			nSkipped += batch.nSkipped;
+
+			auto now = std::chrono::steady_clock::now();
+			if (enabled && now - lastReport >= std::chrono::seconds(1)) {
+				report(now);
+				lastReport = now;
+			}
+		}
+
+		void finish() {
+			if (enabled) {
+				report(std::chrono::steady_clock::now());
+				std::fprintf(stderr, "\n");
+			}
+		}
+
+	private:
+		void report(std::chrono::steady_clock::time_point now) {
+			double seconds = std::chrono::duration<double>(now - start).count();
+			std::fprintf(
+				stderr, "\r%zu peptides (%zu skipped), %zu ions in %.1fs: %.0f peptides/s, %.0f ions/s",
+				nPeptides, nSkipped, nIons, seconds,
+				nPeptides / seconds, nIons / seconds);
+			std::fflush(stderr);
+		}
+
+		bool enabled;
+		std::chrono::steady_clock::time_point start, lastReport;
+		size_t nPeptides = 0, nIons = 0, nSkipped = 0;
+};
+
+int run(const Options& options) {
+	std::ifstream inputFile;
+	if (options.input != "-") {
+		inputFile.open(options.input);
+		if (!inputFile) {
+			throw std::runtime_error("Unable to open " + options.input);
+		}
+	}
+	std::istream& input = options.input == "-" ? std::cin : inputFile;
+
+	FILE* output = options.output == "-" ? stdout : std::fopen(options.output.c_str(), "wb");
+	if (output == nullptr) {
+		throw std::runtime_error("Unable to open " + options.output);
+	}
+
+	const IonConfig config = makeIonConfig(parseIonTypes(options.ionTypes));
+	const IonGenerationOptions generation = generationOptions(options);
+
+	BlockingQueue<BatchPtr> work(2 * options.threads);
+	BlockingQueue<BatchPtr> done(4 * options.threads);
+	std::atomic<bool> failed(false);
+
+	std::thread reader([&]() {
+		std::string line;
+		size_t lineNumber = 0, peptideIndex = 0, batchIndex = 0;
+		BatchPtr batch;
+		while (!failed && std::getline(input, line)) {
+			lineNumber++;
+			if (!line.empty() && line.back() == '\r') {
+				line.pop_back();
+			}
+			if (line.empty()) continue;
+			if (lineNumber == 1) {
+				std::vector<std::string> fields = split(line, options.delimiter);
+				long charge;
+				if (fields.size() > 1 && !parsePositive(fields[1], charge)) continue;
+			}
+			if (!batch) {
+				batch.reset(new Batch());
+				batch->index = batchIndex++;
+				batch->firstLine = lineNumber;
+				batch->firstPeptide = peptideIndex;
+				batch->lines.reserve(options.batchSize);
+			}
+			batch->lines.push_back(std::move(line));
+			peptideIndex++;
+			if (batch->lines.size() == options.batchSize) {
+				if (!work.push(std::move(batch))) break;
+			}
+		}
+		if (batch) {
+			work.push(std::move(batch));
+		}
+		work.close();
+	});
+
+	std::atomic<size_t> activeWorkers(options.threads);
+	std::vector<std::thread> workers;
+	for (size_t ii = 0; ii < options.threads; ii++) {
+		workers.emplace_back([&]() {
+			Workspace workspace;
+			BatchPtr batch;
+			while (work.pop(batch)) {
+				processBatch(options, config, generation, workspace, *batch);
+				batch->lines.clear();
+				if (!done.push(std::move(batch))) break;
+			}
+			if (--activeWorkers == 0) {
+				done.close();
+			}
+		});
+	}
+
+	// Write the batches in input order
+	if (options.format == OutputFormat::binary) {
+		std::fwrite("PFRG", 1, 4, output);
+		std::fwrite(&BINARY_FORMAT_VERSION, sizeof(BINARY_FORMAT_VERSION), 1, output);
+	}
+	else {
+		std::fputs("peptide\tsequence\tcharge\tmass\tlabel\tposition\n", output);
+	}
+
+	Progress progress(!options.quiet);
+	std::map<size_t, BatchPtr> pending;
+	size_t nextBatch = 0;
+	std::string error;
+	BatchPtr batch;
+	while (done.pop(batch)) {
+		pending.emplace(batch->index, std::move(batch));
+		for (auto it = pending.find(nextBatch); it != pending.end(); it = pending.find(nextBatch)) {
+			Batch& next = *it->second;
+			if (!next.error.empty() && error.empty()) {
+				error = next.error;
+				failed = true;
+				work.close();
+				done.close();
+			}
+			if (error.empty()) {
+				std::fwrite(next.output.data(), 1, next.output.size(), output);
+				progress.update(next);
+			}
+			pending.erase(it);
+			nextBatch++;
+		}
+	}
+
+	reader.join();
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+	progress.finish();
+
+	if (output != stdout) {
+		std::fclose(output);
+	}
+	else {
+		std::fflush(output);
+	}
+
+	if (!error.empty()) {
+		throw std::runtime_error(error);
+	}
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	std::ios::sync_with_stdio(false);
+	try {
+		return run(parseArguments(argc, argv));
+	}
+	catch (const std::exception& ex) {
+		std::fprintf(stderr, "pepfrag-cli: %s\n", ex.what());
+		return 1;
+	}
+}